@@ -19,204 +19,547 @@
 #include <span>
 #include <vector>
 #include <stdexcept>
-#include "pe.h"
+#include <string.h>
+#include <functional>
+#include <optional>
+#include "pe_image.h"
 #include "authenticode.h"
+#include "multibuffer.h"
 #include "sha1.h"
 #include "sha256.h"
+#include "dual_hasher.h"
+#include "thread_pool.h"
 
 using namespace std;
 
 template<typename Hasher> using hash_type = decltype(Hasher{}.finalize());
 
-template<typename T, typename Hasher>
-static hash_type<Hasher> authenticode2(span<const uint8_t> file, uint16_t num_sections,
-                                       const T& opthead) {
+// Hashes everything up to SizeOfHeaders, skipping the checksum and the
+// certificate directory entry.
+template<typename Hasher>
+static void hash_headers(Hasher& ctx, const pe_image& image) {
+    for (auto sp : image.hashed_headers()) {
+        if (!sp.empty())
+            ctx.update(sp.data(), sp.size());
+    }
+}
+
+template<typename Hasher>
+hash_type<Hasher> authenticode(const pe_image& image) {
     Hasher ctx;
-    size_t bytes_hashed;
 
-    ctx.update(file.data(), (uintptr_t)&opthead.CheckSum - (uintptr_t)file.data());
-    ctx.update((const uint8_t*)&opthead.Subsystem, offsetof(T, DataDirectory) - offsetof(T, Subsystem));
+    hash_headers(ctx, image);
 
-    span dd(opthead.DataDirectory, opthead.NumberOfRvaAndSizes);
+    // sections should be guaranteed to be sorted
 
-    ctx.update((const uint8_t*)dd.data(),
-               min(dd.size(), IMAGE_DIRECTORY_ENTRY_CERTIFICATE) * sizeof(IMAGE_DATA_DIRECTORY));
+    for (const auto& s : image.sections()) {
+        if (s.SizeOfRawData == 0)
+            continue;
 
-    const uint8_t* ptr;
-    uint32_t cert_size;
+        auto sp = image.section_data(s);
 
-    if (opthead.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_CERTIFICATE) {
-        ptr = (const uint8_t*)&dd[IMAGE_DIRECTORY_ENTRY_CERTIFICATE + 1];
-        cert_size = dd[IMAGE_DIRECTORY_ENTRY_CERTIFICATE].Size;
-    } else {
-        ptr = (const uint8_t*)&dd[opthead.NumberOfRvaAndSizes];
-        cert_size = 0;
+        ctx.update(sp.data(), sp.size());
     }
 
-    ctx.update(ptr, file.data() + opthead.SizeOfHeaders - ptr);
-    bytes_hashed = opthead.SizeOfHeaders;
+    auto trailer = image.trailer();
 
-    auto sections = span((const IMAGE_SECTION_HEADER*)((uint8_t*)opthead.DataDirectory + (opthead.NumberOfRvaAndSizes * sizeof(IMAGE_DATA_DIRECTORY))),
-                         num_sections);
+    if (!trailer.empty())
+        ctx.update(trailer.data(), trailer.size());
 
-    // sections should be guaranteed to be sorted
+    return ctx.finalize();
+}
+
+template decltype(sha1_hasher{}.finalize()) authenticode<sha1_hasher>(const pe_image& image);
+template decltype(sha256_hasher{}.finalize()) authenticode<sha256_hasher>(const pe_image& image);
+template decltype(dual_hasher<sha256_hasher, sha1_hasher>{}.finalize()) authenticode<dual_hasher<sha256_hasher, sha1_hasher>>(const pe_image& image);
+
+// Size of the reads we make when hashing a stream.
+static const size_t STREAM_CHUNK_SIZE = 256 * 1024;
+
+// The most we'll hold in memory when hashing a stream, for the headers, the
+// certificate table at the end, or the gaps between sections.
+static const size_t STREAM_MAX_BUFFER = 64 * 1024 * 1024;
+
+// A file that's being read from start to finish. The beginning of it is kept
+// in buf until we've finished with the headers, after which buf just holds
+// the most recent read.
+class pe_stream {
+public:
+    explicit pe_stream(const function<size_t(span<uint8_t>)>& read_func) : read_func(read_func) {
+    }
+
+    // Reads until at least the first n bytes of the file are in buf, and
+    // returns them. If the file is shorter than that, returns what there is.
+    span<const uint8_t> head(size_t n) {
+        if (n > STREAM_MAX_BUFFER)
+            throw runtime_error("Headers too large to hash as a stream.");
+
+        while (buf.size() < n) {
+            auto old_size = buf.size();
+
+            buf.resize(max(n, old_size + STREAM_CHUNK_SIZE));
+
+            auto ret = read_func(span(buf).subspan(old_size));
+
+            buf.resize(old_size + ret);
+
+            if (ret == 0)
+                break;
+        }
+
+        return span(buf).subspan(0, min(n, buf.size()));
+    }
+
+    // Marks the first n bytes of the file as having been dealt with.
+    void skip_head(size_t n) {
+        buf_off = n;
+        pos = n;
+    }
+
+    // Passes the next len bytes to func a chunk at a time, and returns how
+    // many there were before the end of the file.
+    uint64_t pass(uint64_t len, const function<void(span<const uint8_t>)>& func) {
+        uint64_t done = 0;
+
+        while (done < len) {
+            if (buf_off == buf.size()) {
+                buf.resize(STREAM_CHUNK_SIZE);
+                buf.shrink_to_fit();
+                buf_off = 0;
+
+                auto ret = read_func(buf);
+
+                buf.resize(ret);
+
+                if (ret == 0)
+                    break;
+            }
+
+            auto n = (size_t)min(len - done, (uint64_t)(buf.size() - buf_off));
+
+            func(span(buf).subspan(buf_off, n));
+
+            buf_off += n;
+            pos += n;
+            done += n;
+        }
+
+        return done;
+    }
+
+    uint64_t pos = 0;
 
-    for (auto s : sections) {
+private:
+    const function<size_t(span<uint8_t>)>& read_func;
+    vector<uint8_t> buf;
+    size_t buf_off = 0;
+};
+
+
+template<typename Hasher>
+hash_type<Hasher> authenticode_stream(const function<size_t(span<uint8_t>)>& read_func) {
+    pe_stream stream(read_func);
+    auto file = stream.head(sizeof(IMAGE_DOS_HEADER));
+
+    // If the file's too short, the pe_image constructor will say so.
+
+    while (true) {
+        auto needed = pe_image::headers_size(file);
+
+        if (needed <= file.size())
+            break;
+
+        file = stream.head(needed);
+
+        if (file.size() < needed)
+            break;
+    }
+
+    pe_image image(file, true);
+    vector<IMAGE_SECTION_HEADER> sections(image.sections().begin(), image.sections().end());
+    auto cert_size = image.cert_size();
+    uint64_t size_of_headers = image.size_of_headers();
+    Hasher ctx;
+
+    hash_headers(ctx, image);
+
+    // image points into the stream's buffer, which we're about to reuse
+
+    stream.skip_head(image.size_of_headers());
+
+    // Like authenticode(), after the sections we hash everything from
+    // SizeOfHeaders plus the section sizes to the end of the file, less the
+    // certificate table. If there are gaps between the sections this begins
+    // before we get to the end of them, so we have to hang on to the data
+    // from this point onwards, which we've worked out is bounded.
+
+    uint64_t tail_start = size_of_headers;
+    uint64_t sections_end = size_of_headers;
+
+    for (const auto& s : sections) {
         if (s.SizeOfRawData == 0)
             continue;
 
-        if (s.PointerToRawData + s.SizeOfRawData > file.size())
+        if (s.PointerToRawData < sections_end)
+            throw runtime_error("Sections overlap, so can't hash as a stream.");
+
+        tail_start += s.SizeOfRawData;
+        sections_end = (uint64_t)s.PointerToRawData + s.SizeOfRawData;
+    }
+
+    if (sections_end - tail_start > STREAM_MAX_BUFFER || cert_size > STREAM_MAX_BUFFER)
+        throw runtime_error("Gaps between sections too large to hash as a stream.");
+
+    vector<uint8_t> tail;
+    bool tail_hashable = false;
+
+    // Everything after tail_start goes through tail, so that we can hold
+    // back the last cert_size bytes.
+    auto add_tail = [&](span<const uint8_t> sp) {
+        if (stream.pos + sp.size() <= tail_start)
+            return;
+
+        if (stream.pos < tail_start)
+            sp = sp.subspan((size_t)(tail_start - stream.pos));
+
+        tail.insert(tail.end(), sp.begin(), sp.end());
+
+        if (tail_hashable && tail.size() > cert_size + STREAM_CHUNK_SIZE) {
+            auto n = tail.size() - cert_size;
+
+            ctx.update(tail.data(), n);
+            tail.erase(tail.begin(), tail.begin() + (ptrdiff_t)n);
+        }
+    };
+
+    for (const auto& s : sections) {
+        if (s.SizeOfRawData == 0)
+            continue;
+
+        auto gap = s.PointerToRawData - stream.pos;
+
+        if (stream.pass(gap, add_tail) != gap)
             throw runtime_error("Section out of bounds.");
 
-        ctx.update(file.data() + s.PointerToRawData, s.SizeOfRawData);
-        bytes_hashed += s.SizeOfRawData;
+        auto len = stream.pass(s.SizeOfRawData, [&](span<const uint8_t> sp) {
+            ctx.update(sp.data(), sp.size());
+            add_tail(sp);
+        });
+
+        if (len != s.SizeOfRawData)
+            throw runtime_error("Section out of bounds.");
     }
 
-    if (file.size() > bytes_hashed)
-        ctx.update(file.data() + bytes_hashed, file.size() - bytes_hashed - cert_size);
+    tail_hashable = true;
+
+    stream.pass(UINT64_MAX, add_tail);
+
+    if (stream.pos > tail_start) {
+        if (tail.size() < cert_size)
+            throw runtime_error("Certificate table out of bounds.");
+
+        ctx.update(tail.data(), tail.size() - cert_size);
+    }
 
     return ctx.finalize();
 }
 
+template decltype(sha1_hasher{}.finalize()) authenticode_stream<sha1_hasher>(const function<size_t(span<uint8_t>)>& read_func);
+template decltype(sha256_hasher{}.finalize()) authenticode_stream<sha256_hasher>(const function<size_t(span<uint8_t>)>& read_func);
+template decltype(dual_hasher<sha256_hasher, sha1_hasher>{}.finalize()) authenticode_stream<dual_hasher<sha256_hasher, sha1_hasher>>(const function<size_t(span<uint8_t>)>& read_func);
+
+// Shared source of zeroes for padding, so that we don't need to allocate.
+static const uint8_t zeroes[65536] = {};
+
 template<typename Hasher>
-hash_type<Hasher> authenticode(span<const uint8_t> file) {
-    if (file.size() < sizeof(IMAGE_DOS_HEADER))
-        throw runtime_error("File too short for IMAGE_DOS_HEADER.");
+static void update_zeroes(Hasher& ctx, size_t len) {
+    while (len > 0) {
+        auto n = min(len, sizeof(zeroes));
+
+        ctx.update(zeroes, n);
+        len -= n;
+    }
+}
+
+// Whether sp is all zeroes. This gets vectorized - we look at 64 bytes at a
+// time, and only check the result every 256 bytes.
+static bool is_zero(span<const uint8_t> sp) {
+    typedef uint64_t u64x8 __attribute__((vector_size(64)));
+
+    auto ptr = sp.data();
+    auto len = sp.size();
+
+    while (len >= 256) {
+        u64x8 v[4];
+
+        memcpy(v, ptr, sizeof(v));
 
-    auto& dos_header = *(const IMAGE_DOS_HEADER*)file.data();
+        auto acc = v[0] | v[1] | v[2] | v[3];
 
-    if (dos_header.e_magic != IMAGE_DOS_SIGNATURE)
-        throw runtime_error("Invalid DOS signature.");
+        for (unsigned int i = 0; i < 8; i++) {
+            if (acc[i] != 0)
+                return false;
+        }
 
-    auto& nt_header = *(const IMAGE_NT_HEADERS*)(file.data() + dos_header.e_lfanew);
+        ptr += 256;
+        len -= 256;
+    }
 
-    if (file.size() < dos_header.e_lfanew + sizeof(IMAGE_NT_HEADERS))
-        throw runtime_error("File too short for IMAGE_NT_HEADERS.");
+    while (len > 0) {
+        if (*ptr != 0)
+            return false;
 
-    if (nt_header.Signature != IMAGE_NT_SIGNATURE)
-        throw runtime_error("Incorrect PE signature.");
+        ptr++;
+        len--;
+    }
+
+    return true;
+}
 
-    switch (nt_header.OptionalHeader32.Magic) {
-        case IMAGE_NT_OPTIONAL_HDR32_MAGIC:
-            return authenticode2<IMAGE_OPTIONAL_HEADER32, Hasher>(file, nt_header.FileHeader.NumberOfSections,
-                                                                  nt_header.OptionalHeader32);
+// The hash of a page of zeroes. Images full of padding have lots of these,
+// and nearly always just the one page size, so we keep the last one we did.
+template<typename Hasher>
+static const hash_type<Hasher>& zero_page_hash(uint32_t page_size) {
+    static thread_local uint32_t cached_size = 0;
+    static thread_local hash_type<Hasher> cached;
 
-        case IMAGE_NT_OPTIONAL_HDR64_MAGIC:
-            return authenticode2<IMAGE_OPTIONAL_HEADER64, Hasher>(file, nt_header.FileHeader.NumberOfSections,
-                                                                  nt_header.OptionalHeader64);
+    if (cached_size != page_size) {
+        Hasher ctx;
 
-        default:
-            throw runtime_error("Invalid optional header magic.");
+        update_zeroes(ctx, page_size);
+        cached = ctx.finalize();
+        cached_size = page_size;
     }
+
+    return cached;
 }
 
-template decltype(sha1_hasher{}.finalize()) authenticode<sha1_hasher>(span<const uint8_t> file);
-template decltype(sha256_hasher{}.finalize()) authenticode<sha256_hasher>(span<const uint8_t> file);
 
-template<typename T, typename Hasher>
-static hash_type<Hasher> get_first_hash(span<const uint8_t> file, const T& opthead) {
+// The first page hash covers the headers, zero-padded to the section alignment.
+template<typename Hasher>
+static hash_type<Hasher> finish_first_hash(Hasher& ctx, const pe_image& image) {
+    if (image.size_of_headers() < image.section_alignment())
+        update_zeroes(ctx, image.section_alignment() - image.size_of_headers());
+
+    return ctx.finalize();
+}
+
+template<typename Hasher>
+static hash_type<Hasher> get_first_hash(const pe_image& image) {
     Hasher ctx;
 
-    ctx.update(file.data(), (uintptr_t)&opthead.CheckSum - (uintptr_t)file.data());
-    ctx.update((const uint8_t*)&opthead.Subsystem, offsetof(T, DataDirectory) - offsetof(T, Subsystem));
+    hash_headers(ctx, image);
+
+    return finish_first_hash(ctx, image);
+}
+
+// Hashes the pages of a section between start and end, appending them to ret.
+// The pages are all independent, so they are hashed together. The last page of
+// a section is short, so it's hashed on its own and padded out with zeroes.
+// Pages which are all zeroes don't need hashing at all.
+template<typename Hasher>
+static void hash_pages(vector<pair<uint32_t, hash_type<Hasher>>>& ret, const pe_image& image,
+                       const IMAGE_SECTION_HEADER& sect, uint32_t start, uint32_t end) {
+    vector<span<const uint8_t>> pages;
+    vector<bool> zero;
+    optional<hash_type<Hasher>> tail;
+    auto sect_data = image.section_data(sect);
+    auto page_size = image.section_alignment();
+
+    for (uint64_t off = start; off < end; off += page_size) {
+        auto data = sect_data.subspan((size_t)off, (size_t)min((uint64_t)page_size, sect_data.size() - off));
+
+        if (is_zero(data)) {
+            zero.push_back(true);
+            continue;
+        }
+
+        zero.push_back(false);
 
-    span dd(opthead.DataDirectory, opthead.NumberOfRvaAndSizes);
+        if (data.size() == page_size)
+            pages.push_back(data);
+        else {
+            Hasher ctx;
+
+            ctx.update(data.data(), data.size());
+            update_zeroes(ctx, page_size - data.size());
+
+            tail = ctx.finalize();
+        }
+    }
 
-    ctx.update((const uint8_t*)dd.data(),
-               min(dd.size(), IMAGE_DIRECTORY_ENTRY_CERTIFICATE) * sizeof(IMAGE_DATA_DIRECTORY));
+    auto hashes = hash_many<Hasher>(pages);
+    size_t n = 0;
 
-    const uint8_t* ptr;
+    for (size_t i = 0; i < zero.size(); i++) {
+        auto off = (uint32_t)(sect.PointerToRawData + start + (i * page_size));
 
-    if (opthead.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_CERTIFICATE)
-        ptr = (const uint8_t*)&dd[IMAGE_DIRECTORY_ENTRY_CERTIFICATE + 1];
+        if (zero[i])
+            ret.emplace_back(off, zero_page_hash<Hasher>(page_size));
+        else if (n == hashes.size())
+            ret.emplace_back(off, *tail);
+        else
+            ret.emplace_back(off, hashes[n++]);
+    }
+}
+
+// The list ends with a zero hash at the end of the last section, or at the end
+// of the headers if there aren't any sections.
+template<typename Hasher>
+static void add_last_page_hash(vector<pair<uint32_t, hash_type<Hasher>>>& ret, const pe_image& image) {
+    hash_type<Hasher> zero_hash;
+    auto sections = image.sections();
+
+    memset(zero_hash.data(), 0, sizeof(zero_hash));
+
+    if (sections.empty())
+        ret.emplace_back(image.size_of_headers(), zero_hash);
     else
-        ptr = (const uint8_t*)&dd[opthead.NumberOfRvaAndSizes];
+        ret.emplace_back(sections.back().PointerToRawData + sections.back().SizeOfRawData, zero_hash);
+}
+
+// Number of pages in each job when hashing pages on a thread pool.
+static const uint32_t PAGES_PER_JOB = 256;
 
-    ctx.update(ptr, file.data() + opthead.SizeOfHeaders - ptr);
+// Files smaller than this aren't worth splitting up between threads.
+static const size_t PARALLEL_MIN_SIZE = 16 * 1024 * 1024;
 
-    if (opthead.SizeOfHeaders < opthead.SectionAlignment) {
-        vector<uint8_t> padding(opthead.SectionAlignment - opthead.SizeOfHeaders, 0);
+// Hashes all the pages of the sections on the thread pool, appending them to
+// ret in offset order. If alongside is set, it's run at the same time as
+// another job.
+template<typename Hasher>
+static void hash_pages_parallel(vector<pair<uint32_t, hash_type<Hasher>>>& ret, const pe_image& image,
+                                thread_pool& pool, const function<void()>& alongside) {
+    struct page_run {
+        const IMAGE_SECTION_HEADER* sect;
+        uint32_t start;
+        uint32_t end;
+    };
+
+    vector<page_run> runs;
+    auto page_size = image.section_alignment();
+
+    for (const auto& s : image.sections()) {
+        if (s.SizeOfRawData == 0)
+            continue;
 
-        ctx.update(padding.data(), padding.size());
+        for (uint64_t off = 0; off < s.SizeOfRawData; off += (uint64_t)page_size * PAGES_PER_JOB) {
+            auto end = (uint32_t)min((uint64_t)s.SizeOfRawData, off + ((uint64_t)page_size * PAGES_PER_JOB));
+
+            runs.push_back({ &s, (uint32_t)off, end });
+        }
     }
 
-    return ctx.finalize();
+    vector<vector<pair<uint32_t, hash_type<Hasher>>>> results(runs.size());
+    size_t first = alongside ? 1 : 0;
+
+    pool.parallel_for(runs.size() + first, [&](size_t i) {
+        if (i < first) {
+            alongside();
+            return;
+        }
+
+        const auto& r = runs[i - first];
+
+        hash_pages<Hasher>(results[i - first], image, *r.sect, r.start, r.end);
+    });
+
+    for (auto& r : results) {
+        ret.insert(ret.end(), r.begin(), r.end());
+    }
 }
 
 template<typename Hasher>
-vector<pair<uint32_t, hash_type<Hasher>>> get_page_hashes(span<const uint8_t> file) {
+vector<pair<uint32_t, hash_type<Hasher>>> get_page_hashes(const pe_image& image, thread_pool* pool) {
     vector<pair<uint32_t, hash_type<Hasher>>> ret;
 
-    if (file.size() < sizeof(IMAGE_DOS_HEADER))
-        throw runtime_error("File too short for IMAGE_DOS_HEADER.");
+    ret.emplace_back(0, get_first_hash<Hasher>(image));
 
-    auto& dos_header = *(const IMAGE_DOS_HEADER*)file.data();
+    if (pool && pool->size() > 1 && image.file().size() >= PARALLEL_MIN_SIZE)
+        hash_pages_parallel<Hasher>(ret, image, *pool, nullptr);
+    else {
+        for (const auto& sect : image.sections()) {
+            if (sect.SizeOfRawData == 0)
+                continue;
 
-    if (dos_header.e_magic != IMAGE_DOS_SIGNATURE)
-        throw runtime_error("Invalid DOS signature.");
+            hash_pages<Hasher>(ret, image, sect, 0, sect.SizeOfRawData);
+        }
+    }
 
-    auto& nt_header = *(const IMAGE_NT_HEADERS*)(file.data() + dos_header.e_lfanew);
+    add_last_page_hash<Hasher>(ret, image);
 
-    if (file.size() < dos_header.e_lfanew + sizeof(IMAGE_NT_HEADERS))
-        throw runtime_error("File too short for IMAGE_NT_HEADERS.");
+    return ret;
+}
 
-    if (nt_header.Signature != IMAGE_NT_SIGNATURE)
-        throw runtime_error("Incorrect PE signature.");
+template vector<pair<uint32_t, decltype(sha1_hasher{}.finalize())>> get_page_hashes<sha1_hasher>(const pe_image& image, thread_pool* pool);
+template vector<pair<uint32_t, decltype(sha256_hasher{}.finalize())>> get_page_hashes<sha256_hasher>(const pe_image& image, thread_pool* pool);
 
-    span<const IMAGE_SECTION_HEADER> sections;
-    uint32_t page_size;
+// Number of pages to hash at a time in authenticode_with_page_hashes, small
+// enough that they're still in cache when we come to read them a second time.
+static const uint32_t PAGES_PER_RUN = 16;
 
-    switch (nt_header.OptionalHeader32.Magic) {
-        case IMAGE_NT_OPTIONAL_HDR32_MAGIC:
-            ret.emplace_back(0, get_first_hash<IMAGE_OPTIONAL_HEADER32, Hasher>(file, nt_header.OptionalHeader32));
-            page_size = nt_header.OptionalHeader32.SectionAlignment;
-            sections = span((const IMAGE_SECTION_HEADER*)((uint8_t*)nt_header.OptionalHeader32.DataDirectory + (nt_header.OptionalHeader32.NumberOfRvaAndSizes * sizeof(IMAGE_DATA_DIRECTORY))),
-                            nt_header.FileHeader.NumberOfSections);
-            break;
+template<typename Hasher, typename PageHasher>
+pe_hashes<Hasher, PageHasher> authenticode_with_page_hashes(const pe_image& image, thread_pool* pool) {
+    pe_hashes<Hasher, PageHasher> ret;
 
-        case IMAGE_NT_OPTIONAL_HDR64_MAGIC:
-            ret.emplace_back(0, get_first_hash<IMAGE_OPTIONAL_HEADER64, Hasher>(file, nt_header.OptionalHeader64));
-            page_size = nt_header.OptionalHeader64.SectionAlignment;
-            sections = span((const IMAGE_SECTION_HEADER*)((uint8_t*)nt_header.OptionalHeader64.DataDirectory + (nt_header.OptionalHeader64.NumberOfRvaAndSizes * sizeof(IMAGE_DATA_DIRECTORY))),
-                            nt_header.FileHeader.NumberOfSections);
-            break;
+    // On a thread pool, the image hash is one job and the pages are split
+    // between the others.
+
+    if (pool && pool->size() > 1 && image.file().size() >= PARALLEL_MIN_SIZE) {
+        ret.page_hashes.emplace_back(0, get_first_hash<PageHasher>(image));
+
+        hash_pages_parallel<PageHasher>(ret.page_hashes, image, *pool, [&]() {
+            ret.hash = authenticode<Hasher>(image);
+        });
 
-        default:
-            throw runtime_error("Invalid optional header magic.");
+        add_last_page_hash<PageHasher>(ret.page_hashes, image);
+
+        return ret;
     }
 
-    for (const auto& sect : sections) {
-        if (sect.SizeOfRawData == 0)
-            continue;
+    Hasher ctx;
+    auto page_size = image.section_alignment();
 
-        uint64_t off = 0;
-        while (off < sect.SizeOfRawData) {
-            Hasher ctx;
+    hash_headers(ctx, image);
 
-            if (off + page_size <= sect.SizeOfRawData)
-                ctx.update(file.data() + sect.PointerToRawData + off, page_size);
-            else {
-                ctx.update(file.data() + sect.PointerToRawData + off, sect.SizeOfRawData - off);
+    // The headers are the same for the image hash and the first page hash, so
+    // if we can we take a copy of the hasher rather than doing them again.
 
-                vector<uint8_t> padding(page_size - (sect.SizeOfRawData - off), 0);
+    if constexpr (is_same_v<Hasher, PageHasher>) {
+        auto ctx2 = ctx;
 
-                ctx.update(padding.data(), padding.size());
-            }
+        ret.page_hashes.emplace_back(0, finish_first_hash(ctx2, image));
+    } else
+        ret.page_hashes.emplace_back(0, get_first_hash<PageHasher>(image));
 
-            ret.emplace_back(sect.PointerToRawData + off, ctx.finalize());
+    // sections should be guaranteed to be sorted
+
+    for (const auto& s : image.sections()) {
+        if (s.SizeOfRawData == 0)
+            continue;
+
+        auto sect_data = image.section_data(s);
 
-            off += page_size;
+        for (uint64_t off = 0; off < s.SizeOfRawData; off += (uint64_t)page_size * PAGES_PER_RUN) {
+            auto end = (uint32_t)min((uint64_t)s.SizeOfRawData, off + ((uint64_t)page_size * PAGES_PER_RUN));
+
+            ctx.update(sect_data.data() + off, end - off);
+            hash_pages<PageHasher>(ret.page_hashes, image, s, (uint32_t)off, end);
         }
     }
 
-    hash_type<Hasher> zero_hash;
+    auto trailer = image.trailer();
 
-    memset(zero_hash.data(), 0, sizeof(zero_hash));
+    if (!trailer.empty())
+        ctx.update(trailer.data(), trailer.size());
+
+    ret.hash = ctx.finalize();
 
-    ret.emplace_back(sections.back().PointerToRawData + sections.back().SizeOfRawData, zero_hash);
+    add_last_page_hash<PageHasher>(ret.page_hashes, image);
 
     return ret;
 }
 
-template vector<pair<uint32_t, decltype(sha1_hasher{}.finalize())>> get_page_hashes<sha1_hasher>(span<const uint8_t> file);
-template vector<pair<uint32_t, decltype(sha256_hasher{}.finalize())>> get_page_hashes<sha256_hasher>(span<const uint8_t> file);
+template pe_hashes<sha1_hasher, sha1_hasher> authenticode_with_page_hashes<sha1_hasher, sha1_hasher>(const pe_image& image, thread_pool* pool);
+template pe_hashes<sha256_hasher, sha256_hasher> authenticode_with_page_hashes<sha256_hasher, sha256_hasher>(const pe_image& image, thread_pool* pool);
+template pe_hashes<dual_hasher<sha256_hasher, sha1_hasher>, sha256_hasher> authenticode_with_page_hashes<dual_hasher<sha256_hasher, sha1_hasher>, sha256_hasher>(const pe_image& image, thread_pool* pool);
@@ -19,10 +19,35 @@
 
 #include <span>
 #include <vector>
+#include <functional>
 #include <stdint.h>
 
+class thread_pool;
+class pe_image;
+
+template<typename Hasher>
+decltype(Hasher{}.finalize()) authenticode(const pe_image& image);
+
+// Calculates the Authenticode hash of a file which can only be read from start
+// to finish, such as a pipe. read_func fills as much of its buffer as it can,
+// and returns 0 at the end of the file. Only the headers, and the data after
+// the last section, are kept in memory.
 template<typename Hasher>
-decltype(Hasher{}.finalize()) authenticode(std::span<const uint8_t> file);
+decltype(Hasher{}.finalize()) authenticode_stream(const std::function<size_t(std::span<uint8_t>)>& read_func);
 
 template<typename Hasher>
-std::vector<std::pair<uint32_t, decltype(Hasher{}.finalize())>> get_page_hashes(std::span<const uint8_t> file);
+std::vector<std::pair<uint32_t, decltype(Hasher{}.finalize())>> get_page_hashes(const pe_image& image,
+                                                                               thread_pool* pool = nullptr);
+
+template<typename Hasher, typename PageHasher = Hasher>
+struct pe_hashes {
+    decltype(Hasher{}.finalize()) hash;
+    std::vector<std::pair<uint32_t, decltype(PageHasher{}.finalize())>> page_hashes;
+};
+
+// Calculates the Authenticode hash and the page hashes in one pass through the file.
+// If pool is given, large files have their pages split between its threads,
+// with the Authenticode hash calculated alongside.
+template<typename Hasher, typename PageHasher = Hasher>
+pe_hashes<Hasher, PageHasher> authenticode_with_page_hashes(const pe_image& image,
+                                                            thread_pool* pool = nullptr);
@@ -15,79 +15,612 @@
  * You should have received a copy of the GNU General Public Licence
  * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
 
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <iostream>
 #include <format>
 #include <string.h>
+#include <optional>
+#include <vector>
+#include <charconv>
+#include <fstream>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
 #include "sha1.h"
 #include "sha256.h"
+#include "dual_hasher.h"
 #include "config.h"
 #include "authenticode.h"
+#include "pe_image.h"
+#include "digest_cache.h"
+#include "file_reader.h"
+#include "thread_pool.h"
+#include "walker.h"
+#include "daemon.h"
 
 using namespace std;
 
+static string hex_string(span<const uint8_t> digest) {
+    string hash;
+
+    for (auto b : digest) {
+        hash += format("{:02x}", b);
+    }
+
+    return hash;
+}
+
+static void print_hash(span<const uint8_t> digest, const char* fn) {
+    cout << format("{}  {}\n", hex_string(digest), fn);
+}
+
+// The cache keeps the SHA-1 hash alongside the SHA-256 one, as version 2
+// catalogues need both, so anything which isn't SHA-1 alone is looked up as
+// SHA-256.
 template<typename Hasher>
-static void calc_authenticode(const char* fn) {
-    int fd = open(fn, O_RDONLY);
+using cache_hasher = conditional_t<is_same_v<Hasher, sha1_hasher>, sha1_hasher, sha256_hasher>;
+
+template<typename Hasher>
+using digest_t = decltype(Hasher{}.finalize());
+
+// Number of files we work on at a time. Their hashes are kept until the
+// whole batch is done, and then printed in order.
+static const size_t FILES_PER_BATCH = 1024;
+
+// Number of files given to each thread at a time, when there's more than one.
+static const size_t FILES_PER_JOB = 16;
+
+template<typename Hasher>
+static digest_t<Hasher> from_cache(const file_hashes<cache_hasher<Hasher>>& fh) {
+    if constexpr (is_same_v<Hasher, dual_hasher<sha256_hasher, sha1_hasher>>)
+        return { fh.hash, fh.sha1_hash };
+    else
+        return fh.hash;
+}
+
+template<typename Hasher>
+static void print_digest(const digest_t<Hasher>& digest, const char* fn) {
+    if constexpr (is_same_v<Hasher, dual_hasher<sha256_hasher, sha1_hasher>>) {
+        print_hash(digest.second, fn);
+        print_hash(digest.first, fn);
+    } else
+        print_hash(digest, fn);
+}
+
+template<typename Hasher>
+static digest_t<Hasher> hash_file(const pe_image& image, const struct stat& st, digest_cache* cache) {
+    if (!cache)
+        return authenticode<Hasher>(image);
+
+    file_hashes<cache_hasher<Hasher>> fh;
+
+    fh.is_pe = true;
+
+    if constexpr (is_same_v<Hasher, sha1_hasher>)
+        fh.hash = authenticode<sha1_hasher>(image);
+    else
+        tie(fh.hash, fh.sha1_hash) = authenticode<dual_hasher<sha256_hasher, sha1_hasher>>(image);
+
+    cache->add(st, false, fh);
+
+    return from_cache<Hasher>(fh);
+}
+
+enum class checksum_mode {
+    none,
+    report,
+    fix
+};
+
+// What --checksum or --fix-checksum found for a file.
+struct checksum_result {
+    uint32_t stored;
+    uint32_t computed;
+    bool fixed = false;
+};
+
+// Works out the PE checksum from the same copy of the file we hashed, and if
+// asked writes it back. CheckSum isn't part of the Authenticode hash, so
+// changing it doesn't affect what we've printed.
+static checksum_result check_checksum(const pe_image& image, const filesystem::path& fn, bool fix) {
+    checksum_result ret{ image.stored_checksum(), image.checksum() };
+
+    if (!fix || ret.stored == ret.computed)
+        return ret;
+
+    int fd = open(fn.c_str(), O_WRONLY | O_CLOEXEC);
 
     if (fd == -1)
-        throw runtime_error("open failed (errno " + to_string(errno) + ")");
+        throw runtime_error("open of " + fn.string() + " for writing failed (errno " + to_string(errno) + ")");
+
+    auto written = pwrite(fd, &ret.computed, sizeof(ret.computed), (off_t)image.checksum_offset());
+    auto err = errno;
 
-    struct stat st;
+    close(fd);
+
+    if (written != sizeof(ret.computed))
+        throw runtime_error("write of checksum to " + fn.string() + " failed (errno " + to_string(err) + ")");
 
-    if (fstat(fd, &st) == -1) {
-        auto err = errno;
-        close(fd);
-        throw runtime_error("fstat failed (errno " + to_string(err) + ")");
+    ret.fixed = true;
+
+    return ret;
+}
+
+// Hashes the files in fns, putting the results or the errors in the
+// corresponding places in digests and errors. If cs_mode is set, the PE
+// checksums are checked too, which means ignoring the cache.
+template<typename Hasher>
+static void hash_files(span<const filesystem::path> fns, span<optional<digest_t<Hasher>>> digests,
+                       span<string> errors, digest_cache* cache, io_mode io,
+                       span<optional<checksum_result>> checksums = {},
+                       checksum_mode cs_mode = checksum_mode::none) {
+    vector<size_t> to_read;
+    vector<filesystem::path> read_fns;
+
+    for (size_t i = 0; i < fns.size(); i++) {
+        if (cache && fns[i] != "-" && cs_mode == checksum_mode::none) {
+            struct stat st;
+            file_hashes<cache_hasher<Hasher>> fh;
+
+            if (stat(fns[i].c_str(), &st) == -1) {
+                errors[i] = "stat failed (errno " + to_string(errno) + ")";
+                continue;
+            }
+
+            // a non-PE file would only be in the cache because of makecat
+            if (S_ISREG(st.st_mode) && cache->find(st, false, fh) && fh.is_pe) {
+                digests[i] = from_cache<Hasher>(fh);
+                continue;
+            }
+        }
+
+        to_read.push_back(i);
+        read_fns.push_back(fns[i]);
     }
 
-    size_t length = st.st_size;
+    file_reader reader(io);
+    vector<file_contents> files;
+    size_t pos = 0;
+
+    while (pos < read_fns.size()) {
+        auto n = reader.read(span(read_fns).subspan(pos), files);
+
+        for (size_t j = 0; j < n; j++) {
+            auto i = to_read[pos + j];
+
+            try {
+                if (files[j].is_stream()) {
+                    digests[i] = authenticode_stream<Hasher>([&](span<uint8_t> buf) {
+                        return files[j].read_stream(buf);
+                    });
+
+                    if (cs_mode != checksum_mode::none)
+                        errors[i] = "Can't check the PE checksum of a pipe.";
+                } else {
+                    pe_image image(files[j].data());
+
+                    digests[i] = hash_file<Hasher>(image, files[j].file_stat(), cache);
 
-    void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (addr == MAP_FAILED) {
-        auto err = errno;
-        close(fd);
-        throw runtime_error("mmap failed (errno " + to_string(err) + ")");
+                    if (cs_mode != checksum_mode::none)
+                        checksums[i] = check_checksum(image, fns[i], cs_mode == checksum_mode::fix);
+                }
+            } catch (const exception& e) {
+                errors[i] = e.what();
+            }
+        }
+
+        pos += n;
     }
+}
 
-    try {
-        auto digest = authenticode<Hasher>(span((uint8_t*)addr, length));
+static void print_checksum(const checksum_result& cs, const char* fn) {
+    if (cs.stored == cs.computed)
+        cout << format("{}: checksum {:08x} OK\n", fn, cs.computed);
+    else if (cs.fixed)
+        cout << format("{}: checksum {:08x} fixed, header had {:08x}\n", fn, cs.computed, cs.stored);
+    else
+        cout << format("{}: checksum {:08x} FAILED, header has {:08x}\n", fn, cs.computed, cs.stored);
+}
+
+// Returns false if any of the PE checksums were wrong and not fixed.
+// If client is set, the hashing is passed to nyand instead.
+template<typename Hasher>
+static bool calc_authenticode(const char* prog, span<const filesystem::path> fns, digest_cache* cache,
+                              io_mode io, thread_pool& pool, checksum_mode cs_mode, daemon_client* client) {
+    bool checksums_ok = true;
+
+    // The files are hashed on the thread pool, but the results are printed
+    // afterwards in the order we were given them.
+
+    for (size_t start = 0; start < fns.size(); start += FILES_PER_BATCH) {
+        auto batch = fns.subspan(start, min(FILES_PER_BATCH, fns.size() - start));
+        vector<optional<digest_t<Hasher>>> digests(batch.size());
+        vector<string> errors(batch.size());
+        vector<optional<checksum_result>> checksums(batch.size());
+
+        if (client)
+            client->authenticode<Hasher>(batch, digests, errors);
+        else {
+            auto per_job = pool.size() > 1 ? FILES_PER_JOB : batch.size();
+            auto num_jobs = (batch.size() + per_job - 1) / per_job;
 
-        string hash;
+            pool.parallel_for(num_jobs, [&](size_t j) {
+                auto job_start = j * per_job;
+                auto n = min(per_job, batch.size() - job_start);
 
-        for (auto b : digest) {
-            hash += format("{:02x}", b);
+                hash_files<Hasher>(batch.subspan(job_start, n), span(digests).subspan(job_start, n),
+                                   span(errors).subspan(job_start, n), cache, io,
+                                   span(checksums).subspan(job_start, n), cs_mode);
+            });
         }
 
-        cout << format("{}  {}\n", hash, fn);
-    } catch (...) {
-        munmap(addr, length);
-        close(fd);
-        throw;
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (digests[i])
+                print_digest<Hasher>(*digests[i], batch[i].c_str());
+
+            if (checksums[i]) {
+                print_checksum(*checksums[i], batch[i].c_str());
+
+                if (checksums[i]->stored != checksums[i]->computed && !checksums[i]->fixed)
+                    checksums_ok = false;
+            }
+
+            if (!errors[i].empty())
+                cerr << format("{}: {}: {}\n", prog, batch[i].string(), errors[i]);
+        }
     }
 
-    munmap(addr, length);
-    close(fd);
+    return checksums_ok;
+}
+
+// A line of a file given to --check.
+struct check_line {
+    string fn;
+    string expected;
+    size_t work;
+};
+
+// A file which is listed in a batch of --check lines, possibly more than once.
+struct check_work {
+    filesystem::path fn;
+    bool sha1 = false;
+    bool sha256 = false;
+    string sha1_hex;
+    string sha256_hex;
+    string error;
+};
+
+struct check_totals {
+    size_t checked = 0;
+    size_t bad_lines = 0;
+    size_t unreadable = 0;
+    size_t mismatched = 0;
+};
+
+// Parses a line in the format we output, i.e. the hex digest, two spaces,
+// and the filename. Like sha1sum, we also accept an asterisk in place of the
+// second space. The digest is lowercased.
+static bool parse_check_line(string_view line, string& digest, string& fn) {
+    auto sp = line.find(' ');
+
+    if (sp == string_view::npos || (sp != 40 && sp != 64) || line.size() < sp + 3)
+        return false;
+
+    if (line[sp + 1] != ' ' && line[sp + 1] != '*')
+        return false;
+
+    digest.clear();
+
+    for (auto c : line.substr(0, sp)) {
+        if (c >= '0' && c <= '9')
+            digest += c;
+        else if (c >= 'a' && c <= 'f')
+            digest += c;
+        else if (c >= 'A' && c <= 'F')
+            digest += (char)(c - 'A' + 'a');
+        else
+            return false;
+    }
+
+    fn = line.substr(sp + 2);
+
+    return true;
+}
+
+// Hashes the files in work, using SHA-1, SHA-256, or both, according to
+// which lengths of digest they were listed with.
+static void check_hash(span<check_work> work, digest_cache* cache, io_mode io, thread_pool& pool) {
+    vector<filesystem::path> fns[3];
+    vector<size_t> indices[3];
+
+    for (size_t i = 0; i < work.size(); i++) {
+        auto type = work[i].sha1 && work[i].sha256 ? 2 : (work[i].sha256 ? 1 : 0);
+
+        fns[type].push_back(work[i].fn);
+        indices[type].push_back(i);
+    }
+
+    vector<optional<digest_t<sha1_hasher>>> sha1_digests(fns[0].size());
+    vector<optional<digest_t<sha256_hasher>>> sha256_digests(fns[1].size());
+    vector<optional<digest_t<dual_hasher<sha256_hasher, sha1_hasher>>>> dual_digests(fns[2].size());
+    vector<string> errors[3];
+    vector<pair<unsigned int, size_t>> jobs;
+    auto per_job = pool.size() > 1 ? FILES_PER_JOB : work.size();
+
+    for (unsigned int type = 0; type < 3; type++) {
+        errors[type].resize(fns[type].size());
+
+        for (size_t start = 0; start < fns[type].size(); start += per_job) {
+            jobs.emplace_back(type, start);
+        }
+    }
+
+    pool.parallel_for(jobs.size(), [&](size_t j) {
+        auto [type, start] = jobs[j];
+        auto n = min(per_job, fns[type].size() - start);
+        auto f = span(fns[type]).subspan(start, n);
+        auto e = span(errors[type]).subspan(start, n);
+
+        switch (type) {
+            case 0:
+                hash_files<sha1_hasher>(f, span(sha1_digests).subspan(start, n), e, cache, io);
+            break;
+
+            case 1:
+                hash_files<sha256_hasher>(f, span(sha256_digests).subspan(start, n), e, cache, io);
+            break;
+
+            case 2:
+                hash_files<dual_hasher<sha256_hasher, sha1_hasher>>(f, span(dual_digests).subspan(start, n), e,
+                                                                   cache, io);
+            break;
+        }
+    });
+
+    for (unsigned int type = 0; type < 3; type++) {
+        for (size_t k = 0; k < indices[type].size(); k++) {
+            auto& w = work[indices[type][k]];
+
+            switch (type) {
+                case 0:
+                    if (sha1_digests[k])
+                        w.sha1_hex = hex_string(*sha1_digests[k]);
+                break;
+
+                case 1:
+                    if (sha256_digests[k])
+                        w.sha256_hex = hex_string(*sha256_digests[k]);
+                break;
+
+                case 2:
+                    if (dual_digests[k]) {
+                        w.sha256_hex = hex_string(dual_digests[k]->first);
+                        w.sha1_hex = hex_string(dual_digests[k]->second);
+                    }
+                break;
+            }
+
+            w.error = move(errors[type][k]);
+        }
+    }
+}
+
+// Checks the files listed in a batch of lines, and prints the results.
+static void check_batch(const char* prog, span<const check_line> lines, span<check_work> work, bool quiet,
+                        bool status, check_totals& totals, digest_cache* cache, io_mode io,
+                        thread_pool& pool) {
+    check_hash(work, cache, io, pool);
+
+    for (const auto& l : lines) {
+        const auto& w = work[l.work];
+
+        totals.checked++;
+
+        if (!w.error.empty()) {
+            cerr << format("{}: {}: {}\n", prog, l.fn, w.error);
+
+            if (!status)
+                cout << format("{}: FAILED open or read\n", l.fn);
+
+            totals.unreadable++;
+        } else if ((l.expected.size() == 40 ? w.sha1_hex : w.sha256_hex) != l.expected) {
+            if (!status)
+                cout << format("{}: FAILED\n", l.fn);
+
+            totals.mismatched++;
+        } else if (!quiet && !status)
+            cout << format("{}: OK\n", l.fn);
+    }
+}
+
+// Reads a list of digests in the format we print them, and checks that the
+// files still match. The list is read a batch at a time, so it can be as long
+// as it likes.
+static bool check_manifest(const char* prog, const char* manifest, bool quiet, bool status, digest_cache* cache,
+                           io_mode io, thread_pool& pool) {
+    ifstream file;
+    istream* in = &cin;
+    string line, digest, fn;
+    check_totals totals;
+    vector<check_line> lines;
+    vector<check_work> work;
+    unordered_map<string, size_t> work_map;
+
+    if (strcmp(manifest, "-")) {
+        file.open(manifest);
+
+        if (!file.is_open()) {
+            cerr << format("{}: {}: could not open for reading\n", prog, manifest);
+            return false;
+        }
+
+        in = &file;
+    }
+
+    auto flush = [&]() {
+        check_batch(prog, lines, work, quiet, status, totals, cache, io, pool);
+        lines.clear();
+        work.clear();
+        work_map.clear();
+    };
+
+    while (getline(*in, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        if (!parse_check_line(line, digest, fn)) {
+            totals.bad_lines++;
+            continue;
+        }
+
+        // a file listed with both SHA-1 and SHA-256 only needs reading once
+
+        auto [it, inserted] = work_map.try_emplace(fn, work.size());
+
+        if (inserted) {
+            work.emplace_back();
+            work.back().fn = fn;
+        }
+
+        if (digest.size() == 40)
+            work[it->second].sha1 = true;
+        else
+            work[it->second].sha256 = true;
+
+        lines.push_back({ fn, digest, it->second });
+
+        if (lines.size() == FILES_PER_BATCH)
+            flush();
+    }
+
+    flush();
+
+    if (totals.checked == 0) {
+        cerr << format("{}: {}: no properly formatted checksum lines found\n", prog, manifest);
+        return false;
+    }
+
+    if (!status) {
+        if (totals.bad_lines != 0) {
+            cerr << format("{}: WARNING: {} {} improperly formatted\n", prog, totals.bad_lines,
+                           totals.bad_lines == 1 ? "line is" : "lines are");
+        }
+
+        if (totals.unreadable != 0) {
+            cerr << format("{}: WARNING: {} listed {} not be read\n", prog, totals.unreadable,
+                           totals.unreadable == 1 ? "file could" : "files could");
+        }
+
+        if (totals.mismatched != 0) {
+            cerr << format("{}: WARNING: {} computed {} NOT match\n", prog, totals.mismatched,
+                           totals.mismatched == 1 ? "checksum did" : "checksums did");
+        }
+    }
+
+    return totals.unreadable == 0 && totals.mismatched == 0;
+}
+
+// Reads a list of filenames, one per line or separated by nulls, from a file
+// or from stdin.
+static void read_file_list(const char* prog, const char* list, char delim, vector<filesystem::path>& fns) {
+    ifstream file;
+    istream* in = &cin;
+    string line;
+
+    if (strcmp(list, "-")) {
+        file.open(list);
+
+        if (!file.is_open())
+            throw runtime_error("open of " + string(list) + " failed");
+
+        in = &file;
+    }
+
+    while (getline(*in, line, delim)) {
+        if (delim == '\n' && !line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        if (!line.empty())
+            fns.emplace_back(line);
+    }
+
+    if (in->bad())
+        cerr << format("{}: error reading {}\n", prog, list);
+}
+
+// Removes the files that don't start with an MZ header. Files which can't be
+// read are kept, so that the error gets reported when we try to hash them.
+static void filter_pe(vector<filesystem::path>& fns, thread_pool& pool) {
+    vector<uint8_t> keep(fns.size());
+    auto num_jobs = (fns.size() + FILES_PER_JOB - 1) / FILES_PER_JOB;
+
+    pool.parallel_for(num_jobs, [&](size_t j) {
+        for (size_t i = j * FILES_PER_JOB; i < min((j + 1) * FILES_PER_JOB, fns.size()); i++) {
+            try {
+                keep[i] = has_dos_signature(fns[i]);
+            } catch (const exception&) {
+                keep[i] = true;
+            }
+        }
+    });
+
+    size_t n = 0;
+
+    for (size_t i = 0; i < fns.size(); i++) {
+        if (keep[i])
+            fns[n++] = move(fns[i]);
+    }
+
+    fns.resize(n);
 }
 
 enum class hash_type {
     sha1,
-    sha256
+    sha256,
+    both
 };
 
 int main(int argc, char* argv[]) {
     if (argc < 2 || !strcmp(argv[1], "--help")) {
-        cerr << format(R"(Usage: {} [--sha1 | --sha256] FILE...
-Print the Authenticode hash of PE files.
+        cerr << format(R"(Usage: {} [--sha1] [--sha256] [OPTION]... [FILE]...
+  or:  {} -c [--quiet] [--status] [-j N] [--cache FILE] [--io MODE] FILE...
+Print or check the Authenticode hash of PE files.
 
       --sha1        output SHA1 hash
       --sha256      output SHA256 hash
+  -c, --check       read hashes from the FILEs and check them; the algorithm
+                      is chosen by the length of each hash
+      --quiet       don't print OK for each file that matches
+      --status      don't output anything, the exit status shows success
+  -r DIR            hash all the files beneath DIR
+      --files-from FILE
+                    hash the files listed in FILE, one per line
+  -0                the list given by --files-from is separated by nulls
+                      rather than newlines; if --files-from isn't given,
+                      the list is read from standard input
+      --pe-only     skip files that don't start with an MZ header
+      --checksum    also check the PE checksum in the optional header
+      --fix-checksum
+                    also check the PE checksum, and correct it if it's wrong
+      -j N          hash files using N threads (default: 1)
+      --cache FILE  remember the hashes of files in FILE, and reuse them if
+                      the files haven't changed
+      --io MODE     how to read files: auto (the default), mmap, pread, or
+                      io_uring
+      --no-daemon   hash the files ourselves, even if nyand is running
       --help        display this help and exit
       --version     output version information and exit
-)", argv[0]);
+
+If both --sha1 and --sha256 are given, each file is only read once. With
+--check or --files-from, a FILE of - means standard input. Otherwise, - means
+a PE file piped to standard input.
+
+If nyand is running, the hashing is passed to it, and its cache is used rather
+than the one given by --cache. This isn't done with --check, --checksum, or
+--fix-checksum, or when reading from standard input.
+)", argv[0], argv[0]);
 
         return 1;
     }
@@ -98,37 +631,218 @@ Print the Authenticode hash of PE files.
         return 1;
     }
 
+    bool do_sha1 = false, do_sha256 = false, check = false, quiet = false, status = false;
+    bool null_delim = false, pe_only = false, use_daemon = true;
+    checksum_mode cs_mode = checksum_mode::none;
+    const char* cache_fn = nullptr;
+    const char* files_from = nullptr;
+    vector<const char*> dirs;
+    io_mode io = io_mode::automatic;
+    unsigned int num_threads = 1;
+    int first_file = 1;
+
+    while (first_file < argc) {
+        if (!strcmp(argv[first_file], "--sha1"))
+            do_sha1 = true;
+        else if (!strcmp(argv[first_file], "--sha256"))
+            do_sha256 = true;
+        else if (!strcmp(argv[first_file], "-c") || !strcmp(argv[first_file], "--check"))
+            check = true;
+        else if (!strcmp(argv[first_file], "--quiet"))
+            quiet = true;
+        else if (!strcmp(argv[first_file], "--status"))
+            status = true;
+        else if (!strcmp(argv[first_file], "-0"))
+            null_delim = true;
+        else if (!strcmp(argv[first_file], "--pe-only"))
+            pe_only = true;
+        else if (!strcmp(argv[first_file], "--no-daemon"))
+            use_daemon = false;
+        else if (!strcmp(argv[first_file], "--checksum"))
+            cs_mode = max(cs_mode, checksum_mode::report);
+        else if (!strcmp(argv[first_file], "--fix-checksum"))
+            cs_mode = checksum_mode::fix;
+        else if (!strcmp(argv[first_file], "-r")) {
+            if (first_file + 1 == argc) {
+                cerr << argv[0] << ": -r requires a directory." << endl;
+                return 1;
+            }
+
+            first_file++;
+            dirs.push_back(argv[first_file]);
+        } else if (!strcmp(argv[first_file], "--files-from")) {
+            if (first_file + 1 == argc) {
+                cerr << argv[0] << ": --files-from requires a filename." << endl;
+                return 1;
+            }
+
+            first_file++;
+            files_from = argv[first_file];
+        }
+        else if (!strcmp(argv[first_file], "--cache")) {
+            if (first_file + 1 == argc) {
+                cerr << argv[0] << ": --cache requires a filename." << endl;
+                return 1;
+            }
+
+            first_file++;
+            cache_fn = argv[first_file];
+        } else if (!strcmp(argv[first_file], "--io")) {
+            optional<io_mode> mode;
+
+            if (first_file + 1 < argc)
+                mode = parse_io_mode(argv[first_file + 1]);
+
+            if (!mode) {
+                cerr << argv[0] << ": --io must be one of auto, mmap, pread, or io_uring." << endl;
+                return 1;
+            }
+
+            first_file++;
+            io = *mode;
+        } else if (!strncmp(argv[first_file], "-j", 2)) {
+            string_view val;
+
+            if (argv[first_file][2] != 0)
+                val = argv[first_file] + 2;
+            else if (first_file + 1 < argc)
+                val = argv[++first_file];
+
+            auto [ptr, ec] = from_chars(val.data(), val.data() + val.size(), num_threads);
+
+            if (val.empty() || ptr != val.data() + val.size() || ec != errc() || num_threads == 0) {
+                cerr << argv[0] << ": invalid number of threads." << endl;
+                return 1;
+            }
+        } else
+            break;
+
+        first_file++;
+    }
+
+    if (check && (do_sha1 || do_sha256)) {
+        cerr << argv[0] << ": --sha1 and --sha256 can't be used with --check." << endl;
+        return 1;
+    }
+
+    if (check && (!dirs.empty() || files_from || null_delim || pe_only)) {
+        cerr << argv[0] << ": -r, --files-from, -0, and --pe-only can't be used with --check." << endl;
+        return 1;
+    }
+
+    if (check && cs_mode != checksum_mode::none) {
+        cerr << argv[0] << ": --checksum and --fix-checksum can't be used with --check." << endl;
+        return 1;
+    }
+
+    if (null_delim && !files_from)
+        files_from = "-";
+
+    if (!check && (quiet || status)) {
+        cerr << argv[0] << ": --quiet and --status are only meaningful with --check." << endl;
+        return 1;
+    }
+
+    if (!check && !do_sha1 && !do_sha256) {
+        cerr << argv[0] << ": --sha1 or --sha256 must be specified." << endl;
+        return 1;
+    }
+
     enum hash_type type;
 
-    if (!strcmp(argv[1], "--sha1"))
+    if (do_sha1 && do_sha256)
+        type = hash_type::both;
+    else if (do_sha1)
         type = hash_type::sha1;
-    else if (!strcmp(argv[1], "--sha256"))
+    else
         type = hash_type::sha256;
-    else {
-        cerr << argv[0] << ": first argument must be either --sha1 or --sha256." << endl;
-        return 1;
-    }
 
-    if (argc < 3) {
+    if (first_file == argc && dirs.empty() && !files_from) {
         cerr << argv[0] << ": at least one file must be specified." << endl;
         return 1;
     }
 
-    for (int i = 2; i < argc; i++) {
+    optional<digest_cache> cache;
+
+    if (cache_fn) {
         try {
+            cache.emplace(cache_fn);
+        } catch (const exception& e) {
+            cerr << format("{}: {}\n", argv[0], e.what());
+            return 1;
+        }
+    }
+
+    auto cache_ptr = cache ? &*cache : nullptr;
+    thread_pool pool(num_threads);
+    bool success = true;
+
+    try {
+        if (check) {
+            for (int i = first_file; i < argc; i++) {
+                if (!check_manifest(argv[0], argv[i], quiet, status, cache_ptr, io, pool))
+                    success = false;
+            }
+        } else {
+            vector<filesystem::path> fns(argv + first_file, argv + argc);
+
+            if (files_from)
+                read_file_list(argv[0], files_from, null_delim ? '\0' : '\n', fns);
+
+            if (pe_only)
+                filter_pe(fns, pool);
+
+            for (auto dir : dirs) {
+                auto res = walk_directory(dir, pe_only, pool);
+
+                for (const auto& err : res.errors) {
+                    cerr << format("{}: {}\n", argv[0], err);
+                }
+
+                if (!res.errors.empty())
+                    success = false;
+
+                fns.insert(fns.end(), make_move_iterator(res.files.begin()), make_move_iterator(res.files.end()));
+            }
+
+            // nyand can't read our stdin, or write to our files
+            unique_ptr<daemon_client> client;
+
+            if (use_daemon && cs_mode == checksum_mode::none && find(fns.begin(), fns.end(), "-") == fns.end())
+                client = daemon_client::connect();
+
             switch (type) {
                 case hash_type::sha1:
-                    calc_authenticode<sha1_hasher>(argv[i]);
+                    if (!calc_authenticode<sha1_hasher>(argv[0], fns, cache_ptr, io, pool, cs_mode, client.get()))
+                        success = false;
                 break;
 
                 case hash_type::sha256:
-                    calc_authenticode<sha256_hasher>(argv[i]);
+                    if (!calc_authenticode<sha256_hasher>(argv[0], fns, cache_ptr, io, pool, cs_mode, client.get()))
+                        success = false;
+                break;
+
+                case hash_type::both:
+                    if (!calc_authenticode<dual_hasher<sha256_hasher, sha1_hasher>>(argv[0], fns, cache_ptr, io,
+                                                                                    pool, cs_mode, client.get())) {
+                        success = false;
+                    }
                 break;
             }
+        }
+    } catch (const exception& e) {
+        cerr << format("{}: {}\n", argv[0], e.what());
+        return 1;
+    }
+
+    if (cache) {
+        try {
+            cache->flush();
         } catch (const exception& e) {
-            cerr << format("{}: {}: {}\n", argv[0], argv[i], e.what());
+            cerr << format("{}: {}\n", argv[0], e.what());
+            return 1;
         }
     }
 
-    return 0;
+    return success ? 0 : 1;
 }
@@ -19,30 +19,33 @@
    Michał Trojnara (https://github.com/mtrojnar) for their reverse-engineering
    work, which made this a lot easier. */
 
-#include <openssl/asn1.h>
-#include <openssl/asn1t.h>
-#include <openssl/err.h>
-#include <openssl/types.h>
-#include <openssl/objects.h>
-#include <openssl/pkcs12.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <string.h>
+#include <stdio.h>
+#include <time.h>
 #include <string>
 #include <vector>
 #include <span>
 #include <algorithm>
+#include <tuple>
+#include <exception>
 #include <filesystem>
+#include <optional>
 #include "sha1.h"
 #include "sha256.h"
+#include "dual_hasher.h"
+#include "thread_pool.h"
 #include "authenticode.h"
+#include "multibuffer.h"
 #include "cat.h"
-#include "pe.h"
+#include "pe_image.h"
+#include "der.h"
+#include "digest_cache.h"
 
 using namespace std;
 
+#define szOID_RSA_signedData "1.2.840.113549.1.7.2"
 #define szOID_CTL "1.3.6.1.4.1.311.10.1"
 #define szOID_CATALOG_LIST "1.3.6.1.4.1.311.12.1.1"
 #define szOID_CATALOG_LIST_MEMBER "1.3.6.1.4.1.311.12.1.2"
@@ -60,288 +63,246 @@ using namespace std;
 
 static const uint8_t page_hashes_guid[] = { 0xa6, 0xb5, 0x86, 0xd5, 0xb4, 0xa1, 0x24, 0x66, 0xae, 0x05, 0xa2, 0x17, 0xda, 0x8e, 0x60, 0xd6 };
 
-struct SpcAttributeTypeAndOptionalValue {
-    ASN1_OBJECT* type;
-    ASN1_TYPE* value;
+// The OIDs, and the attributes which are the same for every file, are only
+// encoded once.
+
+struct cat_constants {
+    cat_constants();
+
+    vector<uint8_t> oid_signed_data;
+    vector<uint8_t> oid_ctl;
+    vector<uint8_t> oid_catalog_list;
+    vector<uint8_t> oid_catalog_list_member;
+    vector<uint8_t> oid_catalog_list_member2;
+    vector<uint8_t> oid_name_value;
+    vector<uint8_t> oid_spc_indirect_data;
+    vector<uint8_t> oid_page_hashes_v1;
+    vector<uint8_t> oid_page_hashes_v2;
+    vector<uint8_t> oid_pe_image_data;
+    vector<uint8_t> oid_sha1;
+    vector<uint8_t> oid_sha256;
+
+    // CatalogAuthAttrs for cat_member_info and cat_member_info2
+    vector<uint8_t> member_info_pe;
+    vector<uint8_t> member_info_flat;
+    vector<uint8_t> member_info2_pe;
+    vector<uint8_t> member_info2_flat;
+
+    // SpcAttributeTypeAndOptionalValues for the data of spc_indirect_data_content
+    vector<uint8_t> pe_image_data;
+    vector<uint8_t> cab_data;
+
+    // the start of SpcPeImageData, before the SpcLink
+    vector<uint8_t> pe_image_flags;
 };
 
-ASN1_SEQUENCE(SpcAttributeTypeAndOptionalValue) = {
-    ASN1_SIMPLE(SpcAttributeTypeAndOptionalValue, type, ASN1_OBJECT),
-    ASN1_OPT(SpcAttributeTypeAndOptionalValue, value, ASN1_ANY)
-} ASN1_SEQUENCE_END(SpcAttributeTypeAndOptionalValue)
+static void write_bmpstring(der_writer& w, string_view s);
 
-IMPLEMENT_ASN1_FUNCTIONS(SpcAttributeTypeAndOptionalValue)
+static vector<uint8_t> make_member_info(string_view guid) {
+    der_writer w;
 
-struct cat_name_value {
-    ASN1_BMPSTRING* tag;
-    uint32_t flags;
-    ASN1_OCTET_STRING value;
-};
-
-ASN1_SEQUENCE(cat_name_value) = {
-    ASN1_SIMPLE(cat_name_value, tag, ASN1_BMPSTRING),
-    ASN1_EMBED(cat_name_value, flags, INT32),
-    ASN1_EMBED(cat_name_value, value, ASN1_OCTET_STRING)
-} ASN1_SEQUENCE_END(cat_name_value)
+    w.begin(DER_SEQUENCE);
+    w.raw(der_oid(CAT_MEMBERINFO_OBJID));
+    w.begin(DER_SET);
+    w.begin(DER_SEQUENCE);
+    write_bmpstring(w, guid);
+    w.integer(512); // cert_version
+    w.end();
+    w.end();
+    w.end();
 
-IMPLEMENT_ASN1_FUNCTIONS(cat_name_value)
+    return w.buf;
+}
 
-struct cat_member_info {
-    ASN1_BMPSTRING* guid;
-    uint32_t cert_version;
-};
+static vector<uint8_t> make_member_info2(bool is_pe) {
+    der_writer w;
 
-ASN1_SEQUENCE(cat_member_info) = {
-    ASN1_SIMPLE(cat_member_info, guid, ASN1_BMPSTRING),
-    ASN1_EMBED(cat_member_info, cert_version, INT32)
-} ASN1_SEQUENCE_END(cat_member_info)
+    // a CHOICE of NULLs, with an implicit tag of 0 for PE files and 2 for flat files
 
-IMPLEMENT_ASN1_FUNCTIONS(cat_member_info)
+    w.begin(DER_SEQUENCE);
+    w.raw(der_oid(CAT_MEMBERINFO2_OBJID));
+    w.begin(DER_SET);
+    w.header(der_context(is_pe ? 0 : 2, false), 0);
+    w.end();
+    w.end();
 
-struct cat_member_info2 {
-    int type;
-    union {
-        ASN1_NULL pe;
-        ASN1_NULL unknown1;
-        ASN1_NULL flat;
-        // FIXME - more?
-    };
-};
+    return w.buf;
+}
 
-ASN1_CHOICE(cat_member_info2) = {
-    ASN1_IMP_EMBED(cat_member_info2, pe, ASN1_NULL, 0),
-    ASN1_IMP_EMBED(cat_member_info2, unknown1, ASN1_NULL, 1),
-    ASN1_IMP_EMBED(cat_member_info2, flat, ASN1_NULL, 2)
-} ASN1_CHOICE_END(cat_member_info2)
+// an SpcLink with an empty unicode SpcString for the file
+static const uint8_t empty_spc_link[] = { 0xa2, 0x02, 0x80, 0x00 };
+
+cat_constants::cat_constants() {
+    oid_signed_data = der_oid(szOID_RSA_signedData);
+    oid_ctl = der_oid(szOID_CTL);
+    oid_catalog_list = der_oid(szOID_CATALOG_LIST);
+    oid_catalog_list_member = der_oid(szOID_CATALOG_LIST_MEMBER);
+    oid_catalog_list_member2 = der_oid(szOID_CATALOG_LIST_MEMBER2);
+    oid_name_value = der_oid(CAT_NAMEVALUE_OBJID);
+    oid_spc_indirect_data = der_oid(SPC_INDIRECT_DATA_OBJID);
+    oid_page_hashes_v1 = der_oid(SPC_PE_IMAGE_PAGE_HASHES_V1_OBJID);
+    oid_page_hashes_v2 = der_oid(SPC_PE_IMAGE_PAGE_HASHES_V2_OBJID);
+    oid_pe_image_data = der_oid(SPC_PE_IMAGE_DATA_OBJID);
+    oid_sha1 = der_oid(szOID_OIWSEC_sha1);
+    oid_sha256 = der_oid(szOID_NIST_sha256);
+
+    member_info_pe = make_member_info("{C689AAB8-8E78-11D0-8C47-00C04FC295EE}");
+    member_info_flat = make_member_info("{DE351A42-8E59-11D0-8C47-00C04FC295EE}");
+    member_info2_pe = make_member_info2(true);
+    member_info2_flat = make_member_info2(false);
+
+    // SpcPeImageData flags are a BIT STRING of 101, i.e. 0xa0 with 5 bits unused
+    static const uint8_t flags[] = { DER_BIT_STRING, 0x02, 0x05, 0xa0 };
+
+    pe_image_flags.assign(flags, flags + sizeof(flags));
+
+    der_writer w;
+
+    w.begin(DER_SEQUENCE);
+    w.raw(oid_pe_image_data);
+    w.begin(DER_SEQUENCE);
+    w.raw(pe_image_flags);
+    w.put(der_context(0, true), empty_spc_link);
+    w.end();
+    w.end();
+
+    pe_image_data = move(w.buf);
+
+    w.buf.clear();
+    w.begin(DER_SEQUENCE);
+    w.raw(der_oid(SPC_CAB_DATA_OBJID));
+    w.raw(empty_spc_link);
+    w.end();
+
+    cab_data = move(w.buf);
+}
 
-IMPLEMENT_ASN1_FUNCTIONS(cat_member_info2)
+static const cat_constants& constants() {
+    static const cat_constants c;
 
-struct spc_digest {
-    SpcAttributeTypeAndOptionalValue algorithm;
-    ASN1_OCTET_STRING hash;
-};
+    return c;
+}
 
-ASN1_SEQUENCE(spc_digest) = {
-    ASN1_EMBED(spc_digest, algorithm, SpcAttributeTypeAndOptionalValue),
-    ASN1_EMBED(spc_digest, hash, ASN1_OCTET_STRING),
-} ASN1_SEQUENCE_END(spc_digest)
+// Decodes one UTF-8 character, returning its length or 0 if it's invalid. This
+// follows OpenSSL's UTF8_getc, so that the strings come out the same as they
+// did when we used OPENSSL_utf82uni.
+static unsigned int utf8_getc(string_view s, uint32_t& val) {
+    auto c = (uint8_t)s[0];
+    unsigned int len;
+    uint32_t min;
+
+    if (!(c & 0x80)) {
+        val = c;
+        return 1;
+    } else if ((c & 0xe0) == 0xc0) {
+        len = 2;
+        val = c & 0x1f;
+        min = 0x80;
+    } else if ((c & 0xf0) == 0xe0) {
+        len = 3;
+        val = c & 0xf;
+        min = 0x800;
+    } else if ((c & 0xf8) == 0xf0) {
+        len = 4;
+        val = c & 0x7;
+        min = 0x10000;
+    } else
+        return 0;
+
+    if (s.size() < len)
+        return 0;
+
+    for (unsigned int i = 1; i < len; i++) {
+        if (((uint8_t)s[i] & 0xc0) != 0x80)
+            return 0;
+
+        val = (val << 6) | ((uint8_t)s[i] & 0x3f);
+    }
 
-IMPLEMENT_ASN1_FUNCTIONS(spc_digest)
+    if (val < min || (val >= 0xd800 && val <= 0xdfff) || val > 0x10ffff)
+        return 0;
 
-struct spc_indirect_data_content {
-    SpcAttributeTypeAndOptionalValue data;
-    spc_digest digest;
-};
+    return len;
+}
 
-ASN1_SEQUENCE(spc_indirect_data_content) = {
-    ASN1_EMBED(spc_indirect_data_content, data, SpcAttributeTypeAndOptionalValue),
-    ASN1_EMBED(spc_indirect_data_content, digest, spc_digest)
-} ASN1_SEQUENCE_END(spc_indirect_data_content)
+// Writes a UTF-8 string as a BMPString, i.e. big-endian UTF-16. If it's not
+// valid UTF-8, it's treated as Latin-1.
+static void write_bmpstring(der_writer& w, string_view s) {
+    size_t len = 0;
+    bool valid = true;
 
-IMPLEMENT_ASN1_FUNCTIONS(spc_indirect_data_content)
+    for (auto t = s; !t.empty(); ) {
+        uint32_t c;
+        auto n = utf8_getc(t, c);
 
-struct SpcSerializedObject {
-    ASN1_OCTET_STRING classId;
-    ASN1_OCTET_STRING serializedData;
-};
+        if (n == 0) {
+            valid = false;
+            break;
+        }
 
-ASN1_SEQUENCE(SpcSerializedObject) = {
-    ASN1_EMBED(SpcSerializedObject, classId, ASN1_OCTET_STRING),
-    ASN1_EMBED(SpcSerializedObject, serializedData, ASN1_OCTET_STRING)
-} ASN1_SEQUENCE_END(SpcSerializedObject)
+        len += c >= 0x10000 ? 4 : 2;
+        t = t.substr(n);
+    }
 
-IMPLEMENT_ASN1_FUNCTIONS(SpcSerializedObject)
+    if (!valid) {
+        w.header(DER_BMPSTRING, s.size() * 2);
 
-struct SpcString {
-    int type;
-    union {
-        ASN1_BMPSTRING unicode;
-        ASN1_IA5STRING ascii;
-    };
-};
+        for (auto c : s) {
+            w.buf.push_back(0);
+            w.buf.push_back((uint8_t)c);
+        }
 
-ASN1_CHOICE(SpcString) = {
-    ASN1_IMP_EMBED(SpcString, unicode, ASN1_BMPSTRING, 0),
-    ASN1_IMP_EMBED(SpcString, ascii, ASN1_IA5STRING, 1),
-} ASN1_CHOICE_END(SpcString)
+        return;
+    }
 
-IMPLEMENT_ASN1_FUNCTIONS(SpcString)
+    w.header(DER_BMPSTRING, len);
 
-struct SpcLink {
-    int type;
-    union {
-        ASN1_IA5STRING url;
-        SpcSerializedObject moniker;
-        SpcString file;
+    auto put16 = [&](uint32_t v) {
+        w.buf.push_back((uint8_t)(v >> 8));
+        w.buf.push_back((uint8_t)v);
     };
-};
-
-ASN1_CHOICE(SpcLink) = {
-    ASN1_IMP_EMBED(SpcLink, url, ASN1_IA5STRING, 0),
-    ASN1_IMP_EMBED(SpcLink, moniker, SpcSerializedObject, 1),
-    ASN1_EXP_EMBED(SpcLink, file, SpcString, 2)
-} ASN1_CHOICE_END(SpcLink)
 
-IMPLEMENT_ASN1_FUNCTIONS(SpcLink)
-
-struct SpcPeImageData {
-    ASN1_BIT_STRING flags;
-    SpcLink* file;
-};
-
-ASN1_SEQUENCE(SpcPeImageData) = {
-    ASN1_EMBED(SpcPeImageData, flags, ASN1_BIT_STRING),
-    ASN1_EXP_OPT(SpcPeImageData, file, SpcLink, 0)
-} ASN1_SEQUENCE_END(SpcPeImageData)
-
-IMPLEMENT_ASN1_FUNCTIONS(SpcPeImageData)
-
-struct cat_attr {
-    int type;
-    union {
-        cat_name_value name_value;
-        cat_member_info member_info;
-        spc_indirect_data_content spcidc;
-        cat_member_info2 member_info2;
-    };
-};
+    while (!s.empty()) {
+        uint32_t c;
+        auto n = utf8_getc(s, c);
 
-ASN1_CHOICE(cat_attr) = {
-    ASN1_EMBED(cat_attr, name_value, cat_name_value),
-    ASN1_EMBED(cat_attr, member_info, cat_member_info),
-    ASN1_EMBED(cat_attr, spcidc, spc_indirect_data_content),
-    ASN1_EMBED(cat_attr, member_info2, cat_member_info2),
-} ASN1_CHOICE_END(cat_attr)
+        if (c >= 0x10000) {
+            put16(0xd800 + ((c - 0x10000) >> 10));
+            put16(0xdc00 + ((c - 0x10000) & 0x3ff));
+        } else
+            put16(c);
 
-DEFINE_STACK_OF(cat_attr)
-IMPLEMENT_ASN1_FUNCTIONS(cat_attr)
-
-struct CatalogAuthAttr {
-    ASN1_OBJECT* type;
-    STACK_OF(cat_attr)* contents;
-};
-
-ASN1_SEQUENCE(CatalogAuthAttr) = {
-    ASN1_SIMPLE(CatalogAuthAttr, type, ASN1_OBJECT),
-    ASN1_SET_OF(CatalogAuthAttr, contents, cat_attr)
-} ASN1_SEQUENCE_END(CatalogAuthAttr)
-
-DEFINE_STACK_OF(CatalogAuthAttr)
-IMPLEMENT_ASN1_FUNCTIONS(CatalogAuthAttr)
-
-struct CatalogInfo {
-    ASN1_OCTET_STRING digest;
-    STACK_OF(CatalogAuthAttr)* attributes;
-};
-
-ASN1_SEQUENCE(CatalogInfo) = {
-    ASN1_EMBED(CatalogInfo, digest, ASN1_OCTET_STRING),
-    ASN1_SET_OF(CatalogInfo, attributes, CatalogAuthAttr)
-} ASN1_SEQUENCE_END(CatalogInfo)
-
-DEFINE_STACK_OF(CatalogInfo)
-IMPLEMENT_ASN1_FUNCTIONS(CatalogInfo)
-
-struct cert_extension {
-    ASN1_OBJECT* type;
-    ASN1_OCTET_STRING blob;
-};
-
-ASN1_SEQUENCE(cert_extension) = {
-    ASN1_SIMPLE(cert_extension, type, ASN1_OBJECT),
-    ASN1_EMBED(cert_extension, blob, ASN1_OCTET_STRING)
-} ASN1_SEQUENCE_END(cert_extension)
-
-DEFINE_STACK_OF(cert_extension)
-IMPLEMENT_ASN1_FUNCTIONS(cert_extension)
-
-struct MsCtlContent {
-    SpcAttributeTypeAndOptionalValue type;
-    ASN1_OCTET_STRING* identifier;
-    ASN1_UTCTIME* time;
-    SpcAttributeTypeAndOptionalValue version;
-    STACK_OF(CatalogInfo)* header_attributes;
-    STACK_OF(cert_extension)* extensions;
-};
-
-ASN1_SEQUENCE(MsCtlContent) = {
-    ASN1_EMBED(MsCtlContent, type, SpcAttributeTypeAndOptionalValue),
-    ASN1_SIMPLE(MsCtlContent, identifier, ASN1_OCTET_STRING),
-    ASN1_SIMPLE(MsCtlContent, time, ASN1_UTCTIME),
-    ASN1_EMBED(MsCtlContent, version, SpcAttributeTypeAndOptionalValue),
-    ASN1_SEQUENCE_OF(MsCtlContent, header_attributes, CatalogInfo),
-    ASN1_EXP_SEQUENCE_OF(MsCtlContent, extensions, cert_extension, 0)
-} ASN1_SEQUENCE_END(MsCtlContent)
-
-IMPLEMENT_ASN1_FUNCTIONS(MsCtlContent)
-
-static void populate_cat_name_value(cat_name_value& cnv, string_view tag, uint32_t flags,
-                                    const char16_t* value) {
-    int unilen;
-    auto uni = OPENSSL_utf82uni(tag.data(), (int)tag.size(), nullptr, &unilen);
-
-    ASN1_STRING_set(cnv.tag, uni,
-                    (int)(unilen - sizeof(char16_t))); // we don't want the trailing null
-
-    OPENSSL_free(uni);
-
-    cnv.flags = flags;
-
-    auto value_len = char_traits<char16_t>::length(value) + 1; // include trailing null
-    ASN1_OCTET_STRING_set(&cnv.value, (uint8_t*)value, (int)(value_len * sizeof(char16_t)));
-}
-
-static void add_cat_name_value(STACK_OF(CatalogAuthAttr)* attributes, string_view tag,
-                               uint32_t flags, const char16_t* value) {
-    auto attr = CatalogAuthAttr_new();
-    attr->type = OBJ_txt2obj(CAT_NAMEVALUE_OBJID, 1);
-
-    auto ca = cat_attr_new();
-    ca->type = 0;
-
-    ca->name_value.tag = ASN1_STRING_new();
-    populate_cat_name_value(ca->name_value, tag, flags, value);
-
-    sk_cat_attr_push(attr->contents, ca);
-
-    sk_CatalogAuthAttr_push(attributes, attr);
+        s = s.substr(n);
+    }
 }
 
-static void add_cat_member_info(STACK_OF(CatalogAuthAttr)* attributes, string_view guid,
-                                uint32_t cert_version) {
-    auto attr = CatalogAuthAttr_new();
-    attr->type = OBJ_txt2obj(CAT_MEMBERINFO_OBJID, 1);
-
-    auto ca = cat_attr_new();
-    ca->type = 1;
-
-    int unilen;
-    auto uni = OPENSSL_utf82uni(guid.data(), (int)guid.size(), nullptr, &unilen);
-
-    ca->member_info.guid = ASN1_STRING_new();
-    ASN1_STRING_set(ca->member_info.guid, uni, unilen - 2); // don't include trailing null
-
-    OPENSSL_free(uni);
-
-    ca->member_info.cert_version = cert_version;
-
-    sk_cat_attr_push(attr->contents, ca);
-
-    sk_CatalogAuthAttr_push(attributes, attr);
+// cat_name_value ::= SEQUENCE {
+//     tag BMPString,
+//     flags INTEGER,
+//     value OCTET STRING -- UTF-16, including the trailing null
+// }
+static void write_cat_name_value(der_writer& w, string_view tag, uint32_t flags, u16string_view value) {
+    w.begin(DER_SEQUENCE);
+    write_bmpstring(w, tag);
+    w.integer((int32_t)flags);
+    w.header(DER_OCTET_STRING, (value.size() + 1) * sizeof(char16_t));
+    w.raw(span((const uint8_t*)value.data(), value.size() * sizeof(char16_t)));
+    w.buf.push_back(0);
+    w.buf.push_back(0);
+    w.end();
 }
 
-static void add_cat_member_info2(STACK_OF(CatalogAuthAttr)* attributes, bool is_pe) {
-    auto attr = CatalogAuthAttr_new();
-    attr->type = OBJ_txt2obj(CAT_MEMBERINFO2_OBJID, 1);
-
-    auto ca = cat_attr_new();
-    ca->type = 3;
-
-    ca->member_info2.type = is_pe ? 0 : 2;
-
-    sk_cat_attr_push(attr->contents, ca);
-
-    sk_CatalogAuthAttr_push(attributes, attr);
+// CatalogAuthAttr ::= SEQUENCE {
+//     type OBJECT IDENTIFIER,
+//     contents SET OF cat_attr
+// }
+static void write_cat_name_value_attr(der_writer& w, const cat_extension& ext) {
+    w.begin(DER_SEQUENCE);
+    w.raw(constants().oid_name_value);
+    w.begin(DER_SET);
+    write_cat_name_value(w, ext.name, ext.flags, ext.value);
+    w.end();
+    w.end();
 }
 
 template<size_t N>
@@ -358,137 +319,76 @@ static vector<uint8_t> page_hashes_data(span<const pair<uint32_t, array<uint8_t,
     return ret;
 }
 
-struct openssl_deleter {
-    void operator()(uint8_t* ptr) {
-        OPENSSL_free(ptr);
-    }
-};
-
+// spc_indirect_data_content ::= SEQUENCE {
+//     data SpcAttributeTypeAndOptionalValue,
+//     digest SEQUENCE {
+//         algorithm SpcAttributeTypeAndOptionalValue,
+//         hash OCTET STRING
+//     }
+// }
+//
+// For PE files, data is SpcPeImageData. If there's page hashes, the file is an
+// SpcLink with a moniker whose serializedData is the DER of
+// SET { SpcAttributeTypeAndOptionalValue { page hashes OID, SET { OCTET STRING } } }.
 template<typename Hasher>
-static void add_spc_indirect_data_context(STACK_OF(CatalogAuthAttr)* attributes,
-                                          span<const uint8_t> hash, bool is_pe,
-                                          span<const pair<uint32_t, decltype(Hasher{}.finalize())>> page_hashes) {
-    auto attr = CatalogAuthAttr_new();
-    attr->type = OBJ_txt2obj(SPC_INDIRECT_DATA_OBJID, 1);
-
-    auto ca = cat_attr_new();
-    ca->type = 2;
-
-    auto& spcidc = ca->spcidc;
-
-    if (is_pe) {
-        auto pid = SpcPeImageData_new();
-        ASN1_BIT_STRING_set_bit(&pid->flags, 0, 1);
-        ASN1_BIT_STRING_set_bit(&pid->flags, 1, 0);
-        ASN1_BIT_STRING_set_bit(&pid->flags, 2, 1);
-        pid->file = SpcLink_new();
-
-        if (page_hashes.empty())
-            pid->file->type = 2;
-        else {
-            pid->file->type = 1;
-
-            ASN1_OCTET_STRING_set(&pid->file->moniker.classId, page_hashes_guid, sizeof(page_hashes_guid));
-
-            auto val = SpcAttributeTypeAndOptionalValue_new();
-
-            if constexpr (is_same_v<Hasher, sha1_hasher>)
-                val->type = OBJ_txt2obj(SPC_PE_IMAGE_PAGE_HASHES_V1_OBJID, 1);
-            else if constexpr (is_same_v<Hasher, sha256_hasher>)
-                val->type = OBJ_txt2obj(SPC_PE_IMAGE_PAGE_HASHES_V2_OBJID, 1);
-
-            auto str = page_hashes_data(page_hashes);
-
-            auto os = ASN1_TYPE_new();
-            ASN1_TYPE_set(os, V_ASN1_OCTET_STRING, ASN1_OCTET_STRING_new());
-            ASN1_OCTET_STRING_set(os->value.octet_string, str.data(), (int)str.size());
-
-            auto set = sk_ASN1_TYPE_new_null();
-            sk_ASN1_TYPE_push(set, os);
-
-            {
-                uint8_t* out = nullptr;
-
-                int len = i2d_ASN1_SET_ANY(set, &out);
-
-                val->value = ASN1_TYPE_new();
-                ASN1_TYPE_set(val->value, V_ASN1_SET, ASN1_STRING_new());
-                ASN1_STRING_set(val->value->value.set, out, len);
-
-                OPENSSL_free(out);
-            }
-
-            sk_ASN1_TYPE_free(set);
-            ASN1_TYPE_free(os);
-
-            unique_ptr<uint8_t, openssl_deleter> spc;
-            int spc_len;
-
-            {
-                uint8_t* out = nullptr;
-
-                spc_len = i2d_SpcAttributeTypeAndOptionalValue(val, &out);
-
-                SpcAttributeTypeAndOptionalValue_free(val);
-
-                spc.reset(out);
-            }
-
-            {
-                auto os = ASN1_TYPE_new();
-                ASN1_TYPE_set(os, V_ASN1_SEQUENCE, ASN1_STRING_new());
-                ASN1_STRING_set(os->value.set, spc.get(), spc_len);
-
-                auto set = sk_ASN1_TYPE_new_null();
-                sk_ASN1_TYPE_push(set, os);
-
-                {
-                    uint8_t* out = nullptr;
-
-                    int len = i2d_ASN1_SET_ANY(set, &out);
-
-                    ASN1_OCTET_STRING_set(&pid->file->moniker.serializedData, out, len);
-
-                    OPENSSL_free(out);
-                }
-
-                sk_ASN1_TYPE_free(set);
-                ASN1_TYPE_free(os);
-            }
-        }
-
-        auto oct = ASN1_item_pack(pid, SpcPeImageData_it(), nullptr);
-
-        SpcPeImageData_free(pid);
-
-        spcidc.data.type = OBJ_txt2obj(SPC_PE_IMAGE_DATA_OBJID, 1);
-        spcidc.data.value = ASN1_TYPE_new();
-        ASN1_TYPE_set(spcidc.data.value, V_ASN1_SEQUENCE, oct);
-    } else {
-        auto link = SpcLink_new();
-        link->type = 2;
-
-        auto oct = ASN1_item_pack(link, SpcLink_it(), nullptr);
-
-        SpcLink_free(link);
-
-        spcidc.data.type = OBJ_txt2obj(SPC_CAB_DATA_OBJID, 1);
-        spcidc.data.value = ASN1_TYPE_new();
-        ASN1_TYPE_set(spcidc.data.value, V_ASN1_SEQUENCE, oct);
+static void write_spc_indirect_data_context(der_writer& w, span<const uint8_t> hash, bool is_pe,
+                                            span<const pair<uint32_t, decltype(Hasher{}.finalize())>> page_hashes) {
+    const auto& k = constants();
+
+    w.begin(DER_SEQUENCE);
+    w.raw(k.oid_spc_indirect_data);
+    w.begin(DER_SET);
+    w.begin(DER_SEQUENCE);
+
+    if (!is_pe)
+        w.raw(k.cab_data);
+    else if (page_hashes.empty())
+        w.raw(k.pe_image_data);
+    else {
+        w.begin(DER_SEQUENCE);
+        w.raw(k.oid_pe_image_data);
+        w.begin(DER_SEQUENCE); // SpcPeImageData
+        w.raw(k.pe_image_flags);
+        w.begin(der_context(0, true));
+        w.begin(der_context(1, true)); // SpcSerializedObject
+        w.put(DER_OCTET_STRING, page_hashes_guid);
+        w.begin(DER_OCTET_STRING);
+        w.begin(DER_SET);
+        w.begin(DER_SEQUENCE);
+
+        if constexpr (is_same_v<Hasher, sha1_hasher>)
+            w.raw(k.oid_page_hashes_v1);
+        else if constexpr (is_same_v<Hasher, sha256_hasher>)
+            w.raw(k.oid_page_hashes_v2);
+
+        w.begin(DER_SET);
+        w.put(DER_OCTET_STRING, page_hashes_data(page_hashes));
+        w.end();
+        w.end();
+        w.end();
+        w.end();
+        w.end();
+        w.end();
+        w.end();
+        w.end();
     }
 
+    w.begin(DER_SEQUENCE);
+    w.begin(DER_SEQUENCE);
+
     if constexpr (is_same_v<Hasher, sha1_hasher>)
-        spcidc.digest.algorithm.type = OBJ_txt2obj(szOID_OIWSEC_sha1, 1);
+        w.raw(k.oid_sha1);
     else if constexpr (is_same_v<Hasher, sha256_hasher>)
-        spcidc.digest.algorithm.type = OBJ_txt2obj(szOID_NIST_sha256, 1);
-
-    spcidc.digest.algorithm.value = ASN1_TYPE_new();
-    spcidc.digest.algorithm.value->type = V_ASN1_NULL;
-    ASN1_OCTET_STRING_set(&spcidc.digest.hash, hash.data(), (int)hash.size());
+        w.raw(k.oid_sha256);
 
-    sk_cat_attr_push(attr->contents, ca);
+    w.header(DER_NULL, 0);
+    w.end();
+    w.put(DER_OCTET_STRING, hash);
+    w.end();
 
-    sk_CatalogAuthAttr_push(attributes, attr);
+    w.end();
+    w.end();
+    w.end();
 }
 
 static uint8_t hex_char(uint8_t val) {
@@ -527,205 +427,512 @@ static vector<uint8_t> make_hash_string(span<const uint8_t> hash) {
     return ret;
 }
 
-static void add_extension(STACK_OF(cert_extension)* extensions, string_view name, uint32_t flags,
-                          const char16_t* value) {
-    auto ext = cert_extension_new();
-    ext->type = OBJ_txt2obj(CAT_NAMEVALUE_OBJID, 1);
+static const size_t MAX_BATCH_FILE_SIZE = 1024 * 1024;
 
-    auto cnv = cat_name_value_new();
+// Hashes the files in entries, putting the results in the corresponding
+// places in hashes.
+template<typename Hasher>
+static void hash_entries(span<const cat_entry> entries, span<file_hashes<Hasher>> hashes, bool do_page_hashes,
+                         thread_pool& pool, digest_cache* cache, io_mode io) {
+    vector<size_t> to_read;
+    vector<filesystem::path> fns;
+    vector<pair<size_t, struct stat>> misses;
 
-    populate_cat_name_value(*cnv, name, flags, value);
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (cache) {
+            struct stat st;
 
-    uint8_t* out = nullptr;
-    int len = i2d_cat_name_value(cnv, &out);
+            if (stat(entries[i].fn.string().c_str(), &st) == -1)
+                throw runtime_error("stat of " + entries[i].fn.string() + " failed (errno " + to_string(errno) + ")");
 
-    cat_name_value_free(cnv);
+            if (cache->find(st, do_page_hashes, hashes[i]))
+                continue;
+        }
 
-    ASN1_OCTET_STRING_set(&ext->blob, out, len);
+        to_read.push_back(i);
+        fns.push_back(entries[i].fn);
+    }
 
-    OPENSSL_free(out);
+    file_reader reader(io);
+    vector<file_contents> files;
+    vector<pair<size_t, span<const uint8_t>>> batch;
 
-    sk_cert_extension_push(extensions, ext);
-}
+    // Flat files are put aside and hashed together, as there may be a lot of
+    // small ones which we can do several at a time.
 
-static vector<uint8_t> do_pkcs(MsCtlContent* c) {
-    auto p7 = PKCS7_new();
-    auto p7s = PKCS7_SIGNED_new();
+    auto flush_batch = [&]() {
+        vector<span<const uint8_t>> msgs;
 
-    p7->type = OBJ_nid2obj(NID_pkcs7_signed);
-    p7->d.sign = p7s;
+        msgs.reserve(batch.size());
 
-    p7s->contents->type = OBJ_txt2obj(szOID_CTL, 1);
-    ASN1_INTEGER_set(p7s->version, 1);
+        for (const auto& b : batch) {
+            msgs.emplace_back(b.second);
+        }
 
-    auto oct = ASN1_item_pack(c, MsCtlContent_it(), nullptr);
+        auto h = hash_many<Hasher>(msgs);
 
-    p7s->contents->d.other = ASN1_TYPE_new();
-    ASN1_TYPE_set(p7s->contents->d.other, V_ASN1_SEQUENCE, oct);
+        for (size_t i = 0; i < batch.size(); i++) {
+            hashes[batch[i].first].hash = h[i];
+        }
 
-    unsigned char* out = nullptr;
-    int len = i2d_PKCS7(p7, &out);
+        if constexpr (is_same_v<Hasher, sha256_hasher>) {
+            auto h2 = hash_many<sha1_hasher>(msgs);
 
-    if (len == -1)
-        throw runtime_error("i2d_PKCS7 failed");
+            for (size_t i = 0; i < batch.size(); i++) {
+                hashes[batch[i].first].sha1_hash = h2[i];
+            }
+        }
 
-    vector<uint8_t> ret;
+        batch.clear();
+    };
 
-    ret.assign(out, out + len);
+    size_t pos = 0;
 
-    OPENSSL_free(out);
+    while (pos < fns.size()) {
+        auto n = reader.read(span(fns).subspan(pos), files);
 
-    PKCS7_free(p7);
+        for (size_t j = 0; j < n; j++) {
+            auto i = to_read[pos + j];
+            auto& fh = hashes[i];
+            span<const uint8_t> sp;
 
-    return ret;
+            // makecat's errors don't otherwise say which file they're about
+            try {
+                sp = files[j].data();
+            } catch (const file_error& e) {
+                throw runtime_error(e.describe(fns[pos + j]));
+            }
+
+            // The key comes from the file we actually read, in case it's been
+            // replaced since we looked it up.
+            if (cache)
+                misses.emplace_back(i, files[j].file_stat());
+
+            if (pe_image::is_pe(sp)) {
+                pe_image image(sp);
+
+                fh.is_pe = true;
+
+                if constexpr (is_same_v<Hasher, sha256_hasher>) {
+                    if (do_page_hashes) {
+                        auto h = authenticode_with_page_hashes<dual_hasher<Hasher, sha1_hasher>, Hasher>(image, &pool);
+
+                        tie(fh.hash, fh.sha1_hash) = h.hash;
+                        fh.page_hashes = move(h.page_hashes);
+                    } else
+                        tie(fh.hash, fh.sha1_hash) = authenticode<dual_hasher<Hasher, sha1_hasher>>(image);
+                } else {
+                    if (do_page_hashes) {
+                        auto h = authenticode_with_page_hashes<Hasher>(image, &pool);
+
+                        fh.hash = h.hash;
+                        fh.page_hashes = move(h.page_hashes);
+                    } else
+                        fh.hash = authenticode<Hasher>(image);
+                }
+            } else if (sp.size() > MAX_BATCH_FILE_SIZE) {
+                // Large files gain nothing from batching, and for v2 we want to
+                // read them only once.
+
+                if constexpr (is_same_v<Hasher, sha256_hasher>) {
+                    dual_hasher<Hasher, sha1_hasher> ctx;
+
+                    ctx.update(sp.data(), sp.size());
+                    tie(fh.hash, fh.sha1_hash) = ctx.finalize();
+                } else {
+                    Hasher ctx;
+
+                    ctx.update(sp.data(), sp.size());
+                    fh.hash = ctx.finalize();
+                }
+            } else
+                batch.emplace_back(i, sp);
+        }
+
+        // the reader reuses its buffer, so this has to be done before the
+        // next lot of files are read
+
+        flush_batch();
+
+        pos += n;
+    }
+
+    for (const auto& [i, st] : misses) {
+        cache->add(st, do_page_hashes, hashes[i]);
+    }
 }
 
+// Number of entries given to each thread at a time, when there's more than one.
+// This also limits how many files each thread has open.
+static const size_t ENTRIES_PER_JOB = 32;
+
 template<typename Hasher>
-vector<uint8_t> cat<Hasher>::write(bool do_page_hashes) {
-    unique_ptr<MsCtlContent, decltype(&MsCtlContent_free)> c{MsCtlContent_new(), MsCtlContent_free};
+void cache_file_hashes(span<const cat_entry> entries, bool do_page_hashes, thread_pool& pool,
+                       digest_cache& cache, io_mode io) {
+    auto num_jobs = (entries.size() + ENTRIES_PER_JOB - 1) / ENTRIES_PER_JOB;
 
-    c->type.type = OBJ_txt2obj(szOID_CATALOG_LIST, 1);
-    c->type.value = nullptr;
+    pool.parallel_for(num_jobs, [&](size_t j) {
+        auto start = j * ENTRIES_PER_JOB;
+        auto n = min(ENTRIES_PER_JOB, entries.size() - start);
+        vector<file_hashes<Hasher>> hashes(n);
 
-    ASN1_OCTET_STRING_set(c->identifier, (uint8_t*)identifier.data(), (int)identifier.size());
-    ASN1_UTCTIME_set(c->time, time);
+        try {
+            hash_entries<Hasher>(entries.subspan(start, n), hashes, do_page_hashes, pool, &cache, io);
+        } catch (...) {
+            // one of them has failed, so do the others one at a time
 
-    if constexpr (is_same_v<Hasher, sha256_hasher>)
-        c->version.type = OBJ_txt2obj(szOID_CATALOG_LIST_MEMBER2, 1);
-    else
-        c->version.type = OBJ_txt2obj(szOID_CATALOG_LIST_MEMBER, 1);
+            for (size_t i = 0; i < n; i++) {
+                try {
+                    hash_entries<Hasher>(entries.subspan(start + i, 1), span(hashes).subspan(i, 1),
+                                         do_page_hashes, pool, &cache, io);
+                } catch (...) {
+                }
+            }
+        }
+    });
+}
 
-    c->version.value = ASN1_TYPE_new();
-    ASN1_TYPE_set(c->version.value, V_ASN1_NULL, nullptr);
+template void cache_file_hashes<sha1_hasher>(span<const cat_entry> entries, bool do_page_hashes, thread_pool& pool,
+                                             digest_cache& cache, io_mode io);
+template void cache_file_hashes<sha256_hasher>(span<const cat_entry> entries, bool do_page_hashes, thread_pool& pool,
+                                               digest_cache& cache, io_mode io);
 
-    vector<unique_ptr<CatalogInfo, decltype(&CatalogInfo_free)>> files;
+// Writes time as a UTCTime. Like OpenSSL, we leave it empty if the year can't
+// be represented.
+static void write_utctime(der_writer& w, time_t time) {
+    struct tm tm;
 
-    for (const auto& ent : entries) {
-        unique_ptr<CatalogInfo, decltype(&CatalogInfo_free)> catinfo{CatalogInfo_new(), CatalogInfo_free};
-        vector<pair<uint32_t, decltype(Hasher{}.finalize())>> page_hashes;
-        decltype(Hasher{}.finalize()) hash;
-        decltype(sha1_hasher{}.finalize()) sha1_hash;
-        bool is_pe = false;
+    if (!gmtime_r(&time, &tm) || tm.tm_year < 50 || tm.tm_year >= 150) {
+        w.header(DER_UTCTIME, 0);
+        return;
+    }
 
-        int fd = open(ent.fn.string().c_str(), O_RDONLY);
+    char buf[20];
 
-        if (fd == -1)
-            throw runtime_error("open of " + ent.fn.string() + " failed (errno " + to_string(errno) + ")");
+    auto len = snprintf(buf, sizeof(buf), "%02d%02d%02d%02d%02d%02dZ", tm.tm_year % 100, tm.tm_mon + 1,
+                        tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
 
-        struct stat st;
+    w.put(DER_UTCTIME, span((const uint8_t*)buf, (size_t)len));
+}
 
-        if (fstat(fd, &st) == -1) {
-            auto err = errno;
-            close(fd);
-            throw runtime_error("fstat of " + ent.fn.string() + " failed (errno " + to_string(err) + ")");
-        }
+// Position of an encoded CatalogInfo within the buffer.
+struct catinfo_pos {
+    size_t start;
+    size_t end;
+    string_view digest;
+};
+
+// Collects the catalogue in memory.
+struct vector_output {
+    void write(span<const uint8_t> sp) {
+        buf.insert(buf.end(), sp.begin(), sp.end());
+    }
+
+    vector<uint8_t> buf;
+};
+
+// Writes the catalogue to a file descriptor, buffering the many small pieces
+// so that they don't each need a system call.
+class fd_output {
+public:
+    fd_output(int fd) : fd(fd) {
+        buf.reserve(BUFFER_SIZE);
+    }
 
-        size_t length = st.st_size;
+    void write(span<const uint8_t> sp) {
+        if (buf.size() + sp.size() > BUFFER_SIZE) {
+            flush();
 
-        void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (addr == MAP_FAILED) {
-            auto err = errno;
-            close(fd);
-            throw runtime_error("mmap of " + ent.fn.string() + " failed (errno " + to_string(err) + ")");
+            if (sp.size() >= BUFFER_SIZE) {
+                write_all(sp);
+                return;
+            }
         }
 
-        try {
-            auto sp = span((uint8_t*)addr, length);
+        buf.insert(buf.end(), sp.begin(), sp.end());
+    }
 
-            if (sp.size() > sizeof(IMAGE_DOS_HEADER) && ((const IMAGE_DOS_HEADER*)sp.data())->e_magic == IMAGE_DOS_SIGNATURE) {
-                is_pe = true;
-                hash = authenticode<Hasher>(sp);
+    void flush() {
+        write_all(buf);
+        buf.clear();
+    }
 
-                if constexpr (is_same_v<Hasher, sha256_hasher>)
-                    sha1_hash = authenticode<sha1_hasher>(sp);
+private:
+    void write_all(span<const uint8_t> sp) {
+        while (!sp.empty()) {
+            auto ret = ::write(fd, sp.data(), sp.size());
 
-                if (do_page_hashes)
-                    page_hashes = get_page_hashes<Hasher>(sp);
-            } else {
-                Hasher ctx;
+            if (ret == -1) {
+                if (errno == EINTR)
+                    continue;
 
-                ctx.update(sp.data(), sp.size());
+                throw runtime_error("write failed (errno " + to_string(errno) + ")");
+            }
 
-                hash = ctx.finalize();
+            sp = sp.subspan((size_t)ret);
+        }
+    }
 
-                if constexpr (is_same_v<Hasher, sha256_hasher>) {
-                    sha1_hasher ctx2;
+    static const size_t BUFFER_SIZE = 65536;
 
-                    ctx2.update(sp.data(), sp.size());
+    int fd;
+    vector<uint8_t> buf;
+};
 
-                    sha1_hash = ctx2.finalize();
-                }
-            }
+template<typename Hasher>
+template<typename Output>
+void cat<Hasher>::write_der(Output& out, bool do_page_hashes, unsigned int num_threads) {
+    const auto& k = constants();
+
+    vector<file_hashes<Hasher>> hashes(entries.size());
+    optional<thread_pool> own_pool;
+    auto& pool = this->pool ? *this->pool : own_pool.emplace(num_threads);
+
+    // The files are hashed on the thread pool, but the catalogue is put
+    // together afterwards in entry order, so the output is the same whichever
+    // thread did what.
+
+    auto per_job = pool.size() > 1 ? ENTRIES_PER_JOB : max(entries.size(), (size_t)1);
+    auto num_jobs = (entries.size() + per_job - 1) / per_job;
+    vector<exception_ptr> errors(num_jobs);
+
+    pool.parallel_for(num_jobs, [&](size_t j) {
+        auto start = j * per_job;
+        auto n = min(per_job, entries.size() - start);
+
+        try {
+            hash_entries<Hasher>(span(entries).subspan(start, n), span(hashes).subspan(start, n),
+                                 do_page_hashes, pool, cache, io);
         } catch (...) {
-            munmap(addr, length);
-            close(fd);
-            throw;
+            errors[j] = current_exception();
         }
+    });
+
+    // report the same error as we would if we'd done the files in order
+
+    for (const auto& err : errors) {
+        if (err)
+            rethrow_exception(err);
+    }
+
+    // CatalogInfo ::= SEQUENCE {
+    //     digest OCTET STRING,
+    //     attributes SET OF CatalogAuthAttr
+    // }
+    //
+    // These are each encoded into files, and then written out in order of
+    // digest. This is the only copy of them we keep - everything else in the
+    // catalogue is small.
+
+    der_writer files;
+    vector<catinfo_pos> positions;
+    vector<size_t> ends;
+    size_t set_start = 0;
+
+    auto begin_catinfo = [&](span<const uint8_t> digest) {
+        positions.push_back({ files.size(), 0, {} });
+        files.begin(DER_SEQUENCE);
+        files.put(DER_OCTET_STRING, digest);
+        files.begin(DER_SET);
+        set_start = files.size();
+        ends.clear();
+    };
+
+    auto end_catinfo = [&]() {
+        files.sort_set(set_start, ends);
+        files.end();
+        files.end();
+        positions.back().end = files.size();
+    };
 
-        munmap(addr, length);
-        close(fd);
+    for (size_t i = 0; i < entries.size(); i++) {
+        const auto& ent = entries[i];
+        auto& [hash, sha1_hash, is_pe, page_hashes] = hashes[i];
 
         // digest is string for version 1, binary for version 2
         if constexpr (is_same_v<Hasher, sha256_hasher>)
-            ASN1_OCTET_STRING_set(&catinfo->digest, hash.data(), (int)hash.size());
-        else {
-            auto hash_str = make_hash_string(hash);
-
-            ASN1_OCTET_STRING_set(&catinfo->digest, hash_str.data(), (int)hash_str.size());
-        }
+            begin_catinfo(hash);
+        else
+            begin_catinfo(make_hash_string(hash));
 
         for (const auto& ce : ent.extensions) {
-            add_cat_name_value(catinfo->attributes, ce.name, ce.flags, ce.value.c_str());
+            write_cat_name_value_attr(files, ce);
+            ends.push_back(files.size());
         }
 
         if constexpr (is_same_v<Hasher, sha256_hasher>)
-            add_cat_member_info2(catinfo->attributes, is_pe);
-        else {
-            if (is_pe)
-                add_cat_member_info(catinfo->attributes, "{C689AAB8-8E78-11D0-8C47-00C04FC295EE}", 512);
-            else
-                add_cat_member_info(catinfo->attributes, "{DE351A42-8E59-11D0-8C47-00C04FC295EE}", 512);
-        }
+            files.raw(is_pe ? k.member_info2_pe : k.member_info2_flat);
+        else
+            files.raw(is_pe ? k.member_info_pe : k.member_info_flat);
 
-        add_spc_indirect_data_context<Hasher>(catinfo->attributes, hash, is_pe, page_hashes);
+        ends.push_back(files.size());
 
-        files.emplace_back(catinfo.release(), CatalogInfo_free);
+        write_spc_indirect_data_context<Hasher>(files, hash, is_pe, page_hashes);
+        ends.push_back(files.size());
+
+        // the page hashes are now encoded, so we don't need them twice
+        page_hashes.clear();
+        page_hashes.shrink_to_fit();
+
+        end_catinfo();
 
         // version 2 files also have SHA1 entries
         if constexpr (is_same_v<Hasher, sha256_hasher>) {
-            catinfo.reset(CatalogInfo_new());
-
-            ASN1_OCTET_STRING_set(&catinfo->digest, sha1_hash.data(), (int)sha1_hash.size());
+            begin_catinfo(sha1_hash);
 
-            add_cat_member_info2(catinfo->attributes, is_pe);
+            files.raw(is_pe ? k.member_info2_pe : k.member_info2_flat);
+            ends.push_back(files.size());
 
             for (const auto& ce : ent.extensions) {
                 // FIXME - not if 0x01000000 flag set
-                add_cat_name_value(catinfo->attributes, ce.name, ce.flags, ce.value.c_str());
+                write_cat_name_value_attr(files, ce);
+                ends.push_back(files.size());
             }
 
-            files.emplace_back(catinfo.release(), CatalogInfo_free);
+            end_catinfo();
         }
     }
 
-    // follow Microsoft in sorting files by hash (even though they're in a SET)
+    hashes.clear();
+    hashes.shrink_to_fit();
 
-    sort(files.begin(), files.end(), [](const auto& a, const auto& b) {
-        string_view digest1((char*)a->digest.data, a->digest.length);
-        string_view digest2((char*)b->digest.data, b->digest.length);
+    // The digest is the first thing in each CatalogInfo. None are long enough
+    // to need more than a two-byte header.
 
-        return digest1 < digest2;
-    });
+    for (auto& pos : positions) {
+        auto ptr = files.buf.data() + pos.start;
+        auto hdr_len = ptr[1] < 0x80 ? 2 : 2 + (ptr[1] & 0x7f);
 
-    for (auto& catinfo : files) {
-        sk_CatalogInfo_push(c->header_attributes, catinfo.release());
+        pos.digest = string_view((const char*)ptr + hdr_len + 2, ptr[hdr_len + 1]);
     }
 
+    // follow Microsoft in sorting files by hash (even though they're in a SET)
+
+    sort(positions.begin(), positions.end(), [](const auto& a, const auto& b) {
+        return a.digest < b.digest;
+    });
+
+    // The catalogue is a PKCS#7 SignedData, without any signatures:
+    //
+    // ContentInfo ::= SEQUENCE {
+    //     contentType OBJECT IDENTIFIER, -- signedData
+    //     content [0] EXPLICIT SEQUENCE {
+    //         version INTEGER,
+    //         digestAlgorithms SET OF AlgorithmIdentifier,
+    //         contentInfo SEQUENCE {
+    //             contentType OBJECT IDENTIFIER, -- szOID_CTL
+    //             content [0] EXPLICIT MsCtlContent
+    //         },
+    //         signerInfos SET OF SignerInfo
+    //     }
+    // }
+    //
+    // MsCtlContent ::= SEQUENCE {
+    //     type SpcAttributeTypeAndOptionalValue,
+    //     identifier OCTET STRING,
+    //     time UTCTime,
+    //     version SpcAttributeTypeAndOptionalValue,
+    //     header_attributes SEQUENCE OF CatalogInfo,
+    //     extensions [0] EXPLICIT SEQUENCE OF cert_extension
+    // }
+    //
+    // We encode the small parts on either side of the CatalogInfos first, so
+    // that we know all the lengths before writing anything out.
+
+    der_writer ctl_start;
+
+    ctl_start.begin(DER_SEQUENCE);
+    ctl_start.raw(k.oid_catalog_list);
+    ctl_start.end();
+
+    ctl_start.put(DER_OCTET_STRING, identifier);
+    write_utctime(ctl_start, time);
+
+    ctl_start.begin(DER_SEQUENCE);
+
+    if constexpr (is_same_v<Hasher, sha256_hasher>)
+        ctl_start.raw(k.oid_catalog_list_member2);
+    else
+        ctl_start.raw(k.oid_catalog_list_member);
+
+    ctl_start.header(DER_NULL, 0);
+    ctl_start.end();
+
+    // cert_extension ::= SEQUENCE {
+    //     type OBJECT IDENTIFIER,
+    //     blob OCTET STRING -- DER of cat_name_value
+    // }
+
+    der_writer ctl_end;
+
+    ctl_end.begin(der_context(0, true));
+    ctl_end.begin(DER_SEQUENCE);
+
     for (const auto& ce : extensions) {
-        add_extension(c->extensions, ce.name, ce.flags, ce.value.c_str());
+        ctl_end.begin(DER_SEQUENCE);
+        ctl_end.raw(k.oid_name_value);
+        ctl_end.begin(DER_OCTET_STRING);
+        write_cat_name_value(ctl_end, ce.name, ce.flags, ce.value);
+        ctl_end.end();
+        ctl_end.end();
+    }
+
+    ctl_end.end();
+    ctl_end.end();
+
+    der_writer version;
+
+    version.integer(1);
+    version.header(DER_SET, 0); // digestAlgorithms
+
+    auto wrapped = [](size_t len) {
+        return der_header_size(len) + len;
+    };
+
+    auto ctl_len = ctl_start.size() + wrapped(files.size()) + ctl_end.size();
+    auto content_info_len = k.oid_ctl.size() + wrapped(wrapped(ctl_len));
+    auto signed_data_len = version.size() + wrapped(content_info_len) + wrapped(0); // signerInfos
+
+    der_writer head;
+
+    head.header(DER_SEQUENCE, k.oid_signed_data.size() + wrapped(wrapped(signed_data_len)));
+    head.raw(k.oid_signed_data);
+    head.header(der_context(0, true), wrapped(signed_data_len));
+    head.header(DER_SEQUENCE, signed_data_len);
+    head.raw(version.buf);
+    head.header(DER_SEQUENCE, content_info_len);
+    head.raw(k.oid_ctl);
+    head.header(der_context(0, true), wrapped(ctl_len));
+    head.header(DER_SEQUENCE, ctl_len);
+    head.raw(ctl_start.buf);
+    head.header(DER_SEQUENCE, files.size());
+
+    out.write(head.buf);
+
+    for (const auto& pos : positions) {
+        out.write(span(files.buf).subspan(pos.start, pos.end - pos.start));
     }
 
-    return do_pkcs(c.get());
+    ctl_end.header(DER_SET, 0); // signerInfos
+
+    out.write(ctl_end.buf);
+}
+
+template<typename Hasher>
+vector<uint8_t> cat<Hasher>::write(bool do_page_hashes, unsigned int num_threads) {
+    vector_output out;
+
+    write_der(out, do_page_hashes, num_threads);
+
+    return move(out.buf);
+}
+
+template<typename Hasher>
+void cat<Hasher>::write(int fd, bool do_page_hashes, unsigned int num_threads) {
+    fd_output out(fd);
+
+    write_der(out, do_page_hashes, num_threads);
+    out.flush();
 }
 
 template class cat<sha1_hasher>;
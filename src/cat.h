@@ -21,6 +21,7 @@
 #include <filesystem>
 #include <vector>
 #include <span>
+#include "file_reader.h"
 
 struct cat_extension {
     cat_extension(std::string_view name, uint32_t flags, std::u16string_view value) :
@@ -33,13 +34,16 @@ struct cat_extension {
 };
 
 struct cat_entry {
-    cat_entry(const std::filesystem::path& fn) : fn(fn) {
+    cat_entry(std::filesystem::path fn) : fn(std::move(fn)) {
     }
 
     std::filesystem::path fn;
     std::vector<cat_extension> extensions;
 };
 
+class digest_cache;
+class thread_pool;
+
 template<typename Hasher>
 class cat {
 public:
@@ -47,12 +51,29 @@ public:
         this->identifier.assign(identifier.begin(), identifier.end());
     }
 
-    std::vector<uint8_t> write(bool do_page_hashes);
+    std::vector<uint8_t> write(bool do_page_hashes, unsigned int num_threads = 1);
+    void write(int fd, bool do_page_hashes, unsigned int num_threads = 1);
 
     std::vector<cat_entry> entries;
     std::vector<cat_extension> extensions;
+    digest_cache* cache = nullptr;
+    io_mode io = io_mode::automatic;
+
+    // If set, the files are hashed on this rather than on a pool of
+    // num_threads made for the purpose.
+    thread_pool* pool = nullptr;
 
 private:
+    template<typename Output>
+    void write_der(Output& out, bool do_page_hashes, unsigned int num_threads);
+
     std::vector<uint8_t> identifier;
     time_t time;
 };
+
+// Hashes the files into cache, so that catalogues which list them can be
+// written without hashing them again. Files which can't be read are skipped,
+// and left for the catalogue to report.
+template<typename Hasher>
+void cache_file_hashes(std::span<const cat_entry> entries, bool do_page_hashes, thread_pool& pool,
+                       digest_cache& cache, io_mode io);
@@ -0,0 +1,961 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <charconv>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include "cdf.h"
+#include "digest_cache.h"
+#include "thread_pool.h"
+#include "walker.h"
+#include "sha1.h"
+#include "sha256.h"
+
+using namespace std;
+
+enum class cdf_section {
+    none,
+    CatalogHeader,
+    CatalogFiles
+};
+
+static constexpr size_t utf8_to_utf16_len(string_view sv) noexcept {
+    size_t ret = 0;
+
+    while (!sv.empty()) {
+        if ((uint8_t)sv[0] < 0x80) {
+            ret++;
+            sv = sv.substr(1);
+        } else if (((uint8_t)sv[0] & 0xe0) == 0xc0 && (uint8_t)sv.length() >= 2 && ((uint8_t)sv[1] & 0xc0) == 0x80) {
+            ret++;
+            sv = sv.substr(2);
+        } else if (((uint8_t)sv[0] & 0xf0) == 0xe0 && (uint8_t)sv.length() >= 3 && ((uint8_t)sv[1] & 0xc0) == 0x80 && ((uint8_t)sv[2] & 0xc0) == 0x80) {
+            ret++;
+            sv = sv.substr(3);
+        } else if (((uint8_t)sv[0] & 0xf8) == 0xf0 && (uint8_t)sv.length() >= 4 && ((uint8_t)sv[1] & 0xc0) == 0x80 && ((uint8_t)sv[2] & 0xc0) == 0x80 && ((uint8_t)sv[3] & 0xc0) == 0x80) {
+            char32_t cp = (char32_t)(((uint8_t)sv[0] & 0x7) << 18) | (char32_t)(((uint8_t)sv[1] & 0x3f) << 12) | (char32_t)(((uint8_t)sv[2] & 0x3f) << 6) | (char32_t)((uint8_t)sv[3] & 0x3f);
+
+            if (cp > 0x10ffff) {
+                ret++;
+                sv = sv.substr(4);
+                continue;
+            }
+
+            ret += 2;
+            sv = sv.substr(4);
+        } else {
+            ret++;
+            sv = sv.substr(1);
+        }
+    }
+
+    return ret;
+}
+
+template<typename T>
+requires (ranges::output_range<T, char16_t> && is_same_v<ranges::range_value_t<T>, char16_t>) ||
+    (sizeof(wchar_t) == 2 && ranges::output_range<T, wchar_t> && is_same_v<ranges::range_value_t<T>, wchar_t>)
+static constexpr void utf8_to_utf16_range(string_view sv, T& t) noexcept {
+    auto ptr = t.begin();
+
+    if (ptr == t.end())
+        return;
+
+    while (!sv.empty()) {
+        if ((uint8_t)sv[0] < 0x80) {
+            *ptr = (uint8_t)sv[0];
+            ptr++;
+
+            if (ptr == t.end())
+                return;
+
+            sv = sv.substr(1);
+        } else if (((uint8_t)sv[0] & 0xe0) == 0xc0 && (uint8_t)sv.length() >= 2 && ((uint8_t)sv[1] & 0xc0) == 0x80) {
+            char16_t cp = (char16_t)(((uint8_t)sv[0] & 0x1f) << 6) | (char16_t)((uint8_t)sv[1] & 0x3f);
+
+            *ptr = cp;
+            ptr++;
+
+            if (ptr == t.end())
+                return;
+
+            sv = sv.substr(2);
+        } else if (((uint8_t)sv[0] & 0xf0) == 0xe0 && (uint8_t)sv.length() >= 3 && ((uint8_t)sv[1] & 0xc0) == 0x80 && ((uint8_t)sv[2] & 0xc0) == 0x80) {
+            char16_t cp = (char16_t)(((uint8_t)sv[0] & 0xf) << 12) | (char16_t)(((uint8_t)sv[1] & 0x3f) << 6) | (char16_t)((uint8_t)sv[2] & 0x3f);
+
+            if (cp >= 0xd800 && cp <= 0xdfff) {
+                *ptr = 0xfffd;
+                ptr++;
+
+                if (ptr == t.end())
+                    return;
+
+                sv = sv.substr(3);
+                continue;
+            }
+
+            *ptr = cp;
+            ptr++;
+
+            if (ptr == t.end())
+                return;
+
+            sv = sv.substr(3);
+        } else if (((uint8_t)sv[0] & 0xf8) == 0xf0 && (uint8_t)sv.length() >= 4 && ((uint8_t)sv[1] & 0xc0) == 0x80 && ((uint8_t)sv[2] & 0xc0) == 0x80 && ((uint8_t)sv[3] & 0xc0) == 0x80) {
+            char32_t cp = (char32_t)(((uint8_t)sv[0] & 0x7) << 18) | (char32_t)(((uint8_t)sv[1] & 0x3f) << 12) | (char32_t)(((uint8_t)sv[2] & 0x3f) << 6) | (char32_t)((uint8_t)sv[3] & 0x3f);
+
+            if (cp > 0x10ffff) {
+                *ptr = 0xfffd;
+                ptr++;
+
+                if (ptr == t.end())
+                    return;
+
+                sv = sv.substr(4);
+                continue;
+            }
+
+            cp -= 0x10000;
+
+            *ptr = (char16_t)(0xd800 | (cp >> 10));
+            ptr++;
+
+            if (ptr == t.end())
+                return;
+
+            *ptr = (char16_t)(0xdc00 | (cp & 0x3ff));
+            ptr++;
+
+            if (ptr == t.end())
+                return;
+
+            sv = sv.substr(4);
+        } else {
+            *ptr = 0xfffd;
+            ptr++;
+
+            if (ptr == t.end())
+                return;
+
+            sv = sv.substr(1);
+        }
+    }
+}
+
+static constexpr u16string utf8_to_utf16(string_view sv) {
+    if (sv.empty())
+        return u"";
+
+    u16string ret(utf8_to_utf16_len(sv), 0);
+
+    utf8_to_utf16_range(sv, ret);
+
+    return ret;
+}
+
+static void parse_attribute(vector<cat_extension>& attributes, string_view value, unsigned int line_no) {
+    string_view type, oid, val;
+    unsigned int type_num;
+
+    if (auto colon = value.find(':'); colon != string::npos) {
+        type = value.substr(0, colon);
+        oid = value.substr(colon + 1);
+    } else
+        throw runtime_error("Line " + to_string(line_no) + ": ATTR value must have form {type}:{oid}:{value}.");
+
+    if (auto colon = oid.find(':'); colon != string::npos) {
+        val = oid.substr(colon + 1);
+        oid = oid.substr(0, colon);
+    } else
+        throw runtime_error("Line " + to_string(line_no) + ": ATTR value must have form {type}:{oid}:{value}.");
+
+    if (type.substr(0, 2) == "0x") {
+        auto [ptr, ec] = from_chars(type.begin() + 2, type.end(), type_num, 16);
+
+        if (ptr != type.end())
+            throw runtime_error("Line " + to_string(line_no) + ": could not parse type " + string(type) + " as integer.");
+    } else {
+        auto [ptr, ec] = from_chars(type.begin(), type.end(), type_num);
+
+        if (ptr != value.end())
+            throw runtime_error("Line " + to_string(line_no) + ": could not parse type " + string(type) + " as integer.");
+    }
+
+    if (type_num & 0x00020000)
+        throw runtime_error("Line " + to_string(line_no) + ": base64 values not yet supported.");
+
+    if (type_num & 0x00000002)
+        throw runtime_error("Line " + to_string(line_no) + ": OIDs not yet supported.");
+
+    attributes.emplace_back(oid, type_num, utf8_to_utf16(val));
+}
+
+// FIXME - is this actually random, or should it be a hash? (Does it matter?)
+static vector<uint8_t> create_identifier() {
+    random_device dev;
+    mt19937 rng(dev());
+    uniform_int_distribution<mt19937::result_type> dist(0, 0xffffffff);
+    vector<uint8_t> ret;
+
+    ret.reserve(16);
+
+    for (unsigned int i = 0; i < 4; i++) {
+        auto v = (uint32_t)dist(rng);
+
+        auto sp = span((uint8_t*)&v, sizeof(uint32_t));
+
+        ret.insert(ret.end(), sp.begin(), sp.end());
+    }
+
+    return ret;
+}
+
+cdf_file::cdf_file(const filesystem::path& fn) {
+    if (fn == "-") {
+        read_fd(STDIN_FILENO, "stdin");
+        return;
+    }
+
+    int fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+
+    // FIXME - throw more descriptive error message (not found, access denied, etc.)
+    if (fd == -1)
+        throw runtime_error("Could not open " + fn.string() + " for reading.");
+
+    try {
+        read_fd(fd, fn);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+cdf_file::~cdf_file() {
+    if (map)
+        munmap(map, length);
+}
+
+void cdf_file::read_fd(int fd, const filesystem::path& fn) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        throw runtime_error("fstat of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_size == 0)
+            return;
+
+        map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            length = (size_t)st.st_size;
+            madvise(map, length, MADV_SEQUENTIAL);
+            return;
+        }
+
+        map = nullptr;
+    }
+
+    // pipes and the like can't be mapped, so we read them instead
+
+    while (true) {
+        auto off = buf.size();
+
+        buf.resize(off + 65536);
+
+        auto ret = read(fd, buf.data() + off, buf.size() - off);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                buf.resize(off);
+                continue;
+            }
+
+            throw runtime_error("read of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+        }
+
+        buf.resize(off + (size_t)ret);
+
+        if (ret == 0)
+            break;
+    }
+}
+
+string_view cdf_file::text() const {
+    if (map)
+        return string_view((const char*)map, length);
+    else
+        return buf;
+}
+
+// Strips the whitespace from either end of a line, and the CR if it ends in
+// CRLF.
+static string_view trim(string_view sv) {
+    while (!sv.empty() && (sv.front() == ' ' || sv.front() == '\t')) {
+        sv = sv.substr(1);
+    }
+
+    while (!sv.empty() && (sv.back() == ' ' || sv.back() == '\t' || sv.back() == '\r')) {
+        sv = sv.substr(0, sv.size() - 1);
+    }
+
+    return sv;
+}
+
+// If name looks like TAGATTRn, an attribute of the file TAG, returns TAG.
+static optional<string_view> attribute_tag(string_view name) {
+    auto attr = name.find("ATTR");
+
+    if (attr == string::npos)
+        return nullopt;
+
+    unsigned int attr_num;
+    auto [ptr, ec] = from_chars(name.begin() + attr + 4, name.end(), attr_num, 16);
+
+    if (ptr != name.end())
+        return nullopt;
+
+    return name.substr(0, attr);
+}
+
+// CDFs are written for Windows, so use backslashes in paths.
+static filesystem::path native_path(string_view value) {
+    string fn{value};
+
+    if constexpr (filesystem::path::preferred_separator != '\\')
+        replace(fn.begin(), fn.end(), '\\', (char)filesystem::path::preferred_separator);
+
+    return fn;
+}
+
+static bool has_wildcards(string_view sv) {
+    return sv.find_first_of("*?") != string::npos;
+}
+
+cdf parse_cdf(string_view text) {
+    enum cdf_section sect = cdf_section::none;
+    unsigned int line_no = 0;
+    unsigned int encoding_type = 0x00010001; // PKCS_7_ASN_ENCODING | X509_ASN_ENCODING
+    bool all_hash = true;
+    cdf c;
+
+    // The tags only need to last as long as we're parsing, so they point into
+    // the text rather than being copied. Each maps to whether it's a pattern,
+    // and its index in files or patterns.
+    unordered_map<string_view, pair<bool, size_t>> file_indices;
+
+    // Most lines will be files, so this saves rehashing as the map grows.
+    file_indices.reserve((size_t)count(text.begin(), text.end(), '\n'));
+
+    while (!text.empty()) {
+        string_view line;
+
+        if (auto nl = (const char*)memchr(text.data(), '\n', text.size())) {
+            line = text.substr(0, (size_t)(nl - text.data()));
+            text = text.substr(line.size() + 1);
+        } else {
+            line = text;
+            text = {};
+        }
+
+        line_no++;
+
+        if (line.empty())
+            continue;
+
+        if (line.front() == '[') {
+            auto end = line.find(']');
+
+            if (end == string::npos)
+                throw runtime_error("Line " + to_string(line_no) + ": square brackets not terminated.");
+
+            auto sectname = line.substr(1, end - 1);
+
+            if (sectname == "CatalogHeader")
+                sect = cdf_section::CatalogHeader;
+            else if (sectname == "CatalogFiles")
+                sect = cdf_section::CatalogFiles;
+            else
+                throw runtime_error("Line " + to_string(line_no) + ": unrecognized section name " + string(sectname) + ".");
+
+            continue;
+        }
+
+        auto sv = trim(line);
+
+        if (sv.empty())
+            continue;
+
+        // FIXME - can we have comments?
+
+        auto eq = sv.find('=');
+
+        if (eq == string::npos)
+            throw runtime_error("Line " + to_string(line_no) + ": error while parsing.");
+
+        auto name = sv.substr(0, eq);
+        auto value = sv.substr(eq + 1);
+
+        switch (sect) {
+            case cdf_section::none:
+                throw runtime_error("Line " + to_string(line_no) + ": name-value pair outside of section.");
+
+            case cdf_section::CatalogHeader:
+                if (name == "Name")
+                    c.name = value;
+                else if (name == "ResultDir")
+                    c.result_dir = value;
+                else if (name == "CatalogVersion") {
+                    if (value.empty())
+                        break;
+
+                    auto [ptr, ec] = from_chars(value.begin(), value.end(), c.catalogue_version);
+
+                    if (ptr != value.end())
+                        throw runtime_error("Line " + to_string(line_no) + ": could not parse " + string(value) + " as integer.");
+
+                    if (c.catalogue_version != 1 && c.catalogue_version != 2)
+                        throw runtime_error("Line " + to_string(line_no) + ": invalid value " + to_string(c.catalogue_version) + " for CatalogVersion.");
+                } else if (name == "HashAlgorithms") {
+                    if (value.empty())
+                        c.algorithm = cdf_algorithm::none;
+                    else if (value == "SHA1")
+                        c.algorithm = cdf_algorithm::SHA1;
+                    else if (value == "SHA256")
+                        c.algorithm = cdf_algorithm::SHA256;
+                    else
+                        throw runtime_error("Line " + to_string(line_no) + ": invalid value " + string(value) + " for HashAlgorithms.");
+                } else if (name == "PageHashes") {
+                    if (value == "true")
+                        c.page_hashes = true;
+                    else if (value == "false")
+                        c.page_hashes = false;
+                    else
+                        throw runtime_error("Line " + to_string(line_no) + ": invalid value " + string(value) + " for PageHashes.");
+                } else if (name == "EncodingType") {
+                    if (value.substr(0, 2) == "0x") {
+                        auto [ptr, ec] = from_chars(value.begin() + 2, value.end(), encoding_type, 16);
+
+                        if (ptr != value.end())
+                            throw runtime_error("Line " + to_string(line_no) + ": could not parse " + string(value) + " as integer.");
+                    } else {
+                        auto [ptr, ec] = from_chars(value.begin(), value.end(), encoding_type);
+
+                        if (ptr != value.end())
+                            throw runtime_error("Line " + to_string(line_no) + ": could not parse " + string(value) + " as integer.");
+                    }
+
+                    if (encoding_type != 0x00010001)
+                        throw runtime_error("Line " + to_string(line_no) + ": unsupported value " + string(value) + " for EncodingType.");
+                } else if (name.substr(0, 7) == "CATATTR")
+                    parse_attribute(c.attributes, value, line_no);
+                else
+                    throw runtime_error("Line " + to_string(line_no) + ": unrecognized option " + string(name) + " in CatalogHeader section.");
+            break;
+
+            case cdf_section::CatalogFiles:
+                if (name.size() > 8 && name.substr(name.size() - 8) == "ALTSIPID")
+                    throw runtime_error("Line " + to_string(line_no) + ": ALTSIPID not yet supported.");
+
+                if (auto tag = attribute_tag(name)) {
+                    if (auto it = file_indices.find(*tag); it != file_indices.end()) {
+                        auto [is_pattern, idx] = it->second;
+
+                        if (is_pattern)
+                            parse_attribute(c.patterns[idx].extensions, value, line_no);
+                        else
+                            parse_attribute(c.files[idx].extensions, value, line_no);
+
+                        break;
+                    }
+                }
+
+                auto is_pattern = has_wildcards(value);
+
+                if (!file_indices.try_emplace(name, is_pattern, is_pattern ? c.patterns.size() : c.files.size()).second)
+                    throw runtime_error("Line " + to_string(line_no) + ": file " + string(name) + " already set.");
+
+                if (!name.starts_with("<HASH>"))
+                    all_hash = false;
+
+                if (is_pattern)
+                    c.patterns.emplace_back(native_path(value).string());
+                else
+                    c.files.emplace_back(native_path(value));
+            break;
+        }
+    }
+
+    switch (c.catalogue_version) {
+        case 0:
+            switch (c.algorithm) {
+                case cdf_algorithm::SHA1:
+                    c.catalogue_version = 1;
+                break;
+
+                case cdf_algorithm::SHA256:
+                    c.catalogue_version = 2;
+                break;
+
+                case cdf_algorithm::none:
+                    c.catalogue_version = 1;
+                    c.algorithm = cdf_algorithm::SHA1;
+                break;
+            }
+        break;
+
+        case 1:
+            if (c.algorithm == cdf_algorithm::SHA256)
+                throw runtime_error("CatalogVersion must be 2 if HashAlgorithms is SHA256.");
+            c.algorithm = cdf_algorithm::SHA1;
+        break;
+
+        case 2:
+            if (c.algorithm == cdf_algorithm::SHA1)
+                throw runtime_error("CatalogVersion must be 1 if HashAlgorithms is SHA1.");
+            c.algorithm = cdf_algorithm::SHA256;
+        break;
+    }
+
+    if (c.name.empty())
+        throw runtime_error("No value specified for Name.");
+
+    if (!all_hash)
+        throw runtime_error("Only catalogue files with identifiers beginning <HASH> are supported.");
+
+    return c;
+}
+
+filesystem::path cdf::output_path() const {
+    // FIXME - Microsoft makecat creates result_dir if it doesn't already exist
+    if (!result_dir.empty())
+        return filesystem::path{result_dir} / name;
+    else
+        return name;
+}
+
+// Matches a name against a single directory's worth of a pattern.
+static char ascii_lower(char c) {
+    if (c >= 'A' && c <= 'Z')
+        return (char)(c - 'A' + 'a');
+
+    return c;
+}
+
+// Matches case-insensitively, as Windows would, but only folding ASCII.
+static bool wildcard_match(string_view pattern, string_view name) {
+    size_t p = 0, n = 0;
+    optional<pair<size_t, size_t>> star;
+
+    // When something after a * fails to match, we go back and let the * take
+    // one more character.
+
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || ascii_lower(pattern[p]) == ascii_lower(name[n]))) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = make_pair(p, n);
+            p++;
+        } else if (star) {
+            p = star->first + 1;
+            n = ++star->second;
+        } else
+            return false;
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+
+    return p == pattern.size();
+}
+
+namespace {
+
+// Finds the files matching a pattern, a level of the directory tree at a time,
+// with all the directories on a level being read in parallel.
+class pattern_walker {
+public:
+    pattern_walker(const cdf_pattern& p, thread_pool& pool,
+                   const function<void(span<const filesystem::path>)>& found);
+
+    vector<filesystem::path> walk();
+
+    // The directories which were read, as adding a file to any of them could
+    // change what the pattern matches.
+    vector<filesystem::path> dirs;
+
+private:
+    struct walk_item {
+        filesystem::path dir;
+        size_t comp;
+    };
+
+    optional<vector<dir_entry>> read_dir(const filesystem::path& dir) const;
+    void walk_dir(const filesystem::path& dir, size_t comp, vector<walk_item>& next,
+                  vector<filesystem::path>& files, vector<filesystem::path>& dirs_read) const;
+
+    filesystem::path start;
+    vector<string> comps;
+    thread_pool& pool;
+    const function<void(span<const filesystem::path>)>& found;
+};
+
+}
+
+pattern_walker::pattern_walker(const cdf_pattern& p, thread_pool& pool,
+                               const function<void(span<const filesystem::path>)>& found) :
+                               start(p.base), pool(pool), found(found) {
+    string_view sv = p.pattern;
+
+    if (sv.starts_with('/')) {
+        start = "/";
+        sv = sv.substr(1);
+    }
+
+    while (true) {
+        auto slash = sv.find('/');
+        auto comp = sv.substr(0, slash);
+
+        // a ** following another would only find everything twice
+        if (!comp.empty() && comp != "." && !(comp == "**" && !comps.empty() && comps.back() == "**"))
+            comps.emplace_back(comp);
+
+        if (slash == string::npos)
+            break;
+
+        sv = sv.substr(slash + 1);
+    }
+}
+
+optional<vector<dir_entry>> pattern_walker::read_dir(const filesystem::path& dir) const {
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1) {
+        // a directory that isn't there just doesn't match anything
+        if (errno == ENOENT || errno == ENOTDIR)
+            return nullopt;
+
+        throw runtime_error("open of " + dir.string() + " failed (errno " + to_string(errno) + ")");
+    }
+
+    try {
+        auto entries = read_dir_entries(fd, dir);
+
+        close(fd);
+
+        return entries;
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
+void pattern_walker::walk_dir(const filesystem::path& dir, size_t comp, vector<walk_item>& next,
+                              vector<filesystem::path>& files, vector<filesystem::path>& dirs_read) const {
+    optional<vector<dir_entry>> listing;
+
+    auto list = [&]() -> const vector<dir_entry>& {
+        if (!listing) {
+            listing = read_dir(dir);
+
+            if (listing)
+                dirs_read.push_back(dir.empty() ? "." : dir);
+            else
+                listing.emplace();
+        }
+
+        return *listing;
+    };
+
+    while (true) {
+        const auto& c = comps[comp];
+        bool last = comp == comps.size() - 1;
+
+        if (c == "**") {
+            for (const auto& ent : list()) {
+                if (ent.is_dir && !ent.name.starts_with('.'))
+                    next.push_back({dir / ent.name, comp});
+            }
+
+            // on its own at the end, ** is every file below dir
+            if (last) {
+                for (const auto& ent : list()) {
+                    if (!ent.is_dir && !ent.name.starts_with('.'))
+                        files.push_back(dir / ent.name);
+                }
+
+                return;
+            }
+
+            // ** can also be no directories at all
+            comp++;
+            continue;
+        }
+
+        if (!has_wildcards(c)) {
+            if (!last) {
+                next.push_back({dir / c, comp + 1});
+                return;
+            }
+
+            struct stat st;
+
+            if (stat((dir / c).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                files.push_back(dir / c);
+
+            return;
+        }
+
+        for (const auto& ent : list()) {
+            if (ent.name.starts_with('.') && !c.starts_with('.'))
+                continue;
+
+            if (!wildcard_match(c, ent.name))
+                continue;
+
+            if (last && !ent.is_dir)
+                files.push_back(dir / ent.name);
+            else if (!last && ent.is_dir)
+                next.push_back({dir / ent.name, comp + 1});
+        }
+
+        return;
+    }
+}
+
+vector<filesystem::path> pattern_walker::walk() {
+    vector<filesystem::path> ret;
+    vector<walk_item> level;
+    mutex m;
+
+    if (comps.empty())
+        return ret;
+
+    level.push_back({start, 0});
+
+    while (!level.empty()) {
+        vector<walk_item> next;
+
+        pool.parallel_for(level.size(), [&](size_t i) {
+            vector<walk_item> dir_next;
+            vector<filesystem::path> files, dirs_read;
+
+            walk_dir(level[i].dir, level[i].comp, dir_next, files, dirs_read);
+
+            if (!files.empty())
+                found(files);
+
+            lock_guard lg(m);
+
+            next.insert(next.end(), make_move_iterator(dir_next.begin()), make_move_iterator(dir_next.end()));
+            ret.insert(ret.end(), make_move_iterator(files.begin()), make_move_iterator(files.end()));
+            dirs.insert(dirs.end(), make_move_iterator(dirs_read.begin()), make_move_iterator(dirs_read.end()));
+        });
+
+        swap(level, next);
+    }
+
+    // the directories are read in whatever order the threads get to them
+    sort(ret.begin(), ret.end());
+    sort(dirs.begin(), dirs.end());
+
+    return ret;
+}
+
+// Expands the patterns in c into files. As they're found, the files are queued
+// to be hashed into cache, so that by the time write() gets to them it only
+// has to look them up. The directories read are added to dirs.
+template<typename Hasher>
+static void expand_patterns(cdf& c, thread_pool& pool, digest_cache& cache, io_mode io,
+                            vector<filesystem::path>& dirs) {
+    vector<vector<filesystem::path>> matches(c.patterns.size());
+    mutex m;
+    condition_variable cv;
+    vector<cat_entry> queued;
+    bool done = false;
+    exception_ptr walk_error;
+
+    thread walker([&]() {
+        function<void(span<const filesystem::path>)> found = [&](span<const filesystem::path> fns) {
+            lock_guard lg(m);
+
+            queued.insert(queued.end(), fns.begin(), fns.end());
+            cv.notify_one();
+        };
+
+        try {
+            for (size_t i = 0; i < c.patterns.size(); i++) {
+                pattern_walker w(c.patterns[i], pool, found);
+
+                matches[i] = w.walk();
+                dirs.insert(dirs.end(), make_move_iterator(w.dirs.begin()), make_move_iterator(w.dirs.end()));
+            }
+        } catch (...) {
+            walk_error = current_exception();
+        }
+
+        lock_guard lg(m);
+
+        done = true;
+        cv.notify_one();
+    });
+
+    while (true) {
+        vector<cat_entry> batch;
+
+        {
+            unique_lock lock(m);
+
+            cv.wait(lock, [&]() { return done || !queued.empty(); });
+
+            if (queued.empty())
+                break;
+
+            swap(batch, queued);
+        }
+
+        cache_file_hashes<Hasher>(batch, c.page_hashes, pool, cache, io);
+    }
+
+    walker.join();
+
+    if (walk_error)
+        rethrow_exception(walk_error);
+
+    // Patterns can share directories, e.g. a\*.sys and a\*.dll.
+
+    sort(dirs.begin(), dirs.end());
+    dirs.erase(unique(dirs.begin(), dirs.end()), dirs.end());
+
+    unordered_set<string> listed;
+
+    for (const auto& ent : c.files) {
+        listed.insert(ent.fn.native());
+    }
+
+    for (size_t i = 0; i < c.patterns.size(); i++) {
+        if (matches[i].empty())
+            throw runtime_error("No files match " + c.patterns[i].pattern + ".");
+
+        for (auto& fn : matches[i]) {
+            if (!listed.insert(fn.native()).second)
+                continue;
+
+            auto& ent = c.files.emplace_back(move(fn));
+
+            ent.extensions = c.patterns[i].extensions;
+        }
+    }
+
+    c.patterns.clear();
+}
+
+void write_cat(cdf c, int fd, unsigned int num_threads, digest_cache* cache, io_mode io, thread_pool* pool,
+               vector<filesystem::path>* inputs) {
+    auto identifier = create_identifier();
+    optional<thread_pool> own_pool;
+    optional<digest_cache> run_cache;
+    vector<filesystem::path> dirs;
+
+    // The walker hashes what it finds into the cache, so we need one, and a
+    // pool for both of them to share.
+
+    if (!c.patterns.empty()) {
+        if (!pool)
+            pool = &own_pool.emplace(num_threads);
+
+        if (!cache)
+            cache = &run_cache.emplace(digest_cache::in_memory);
+    }
+
+    auto lambda = [&]<typename Hasher>() {
+        if (!c.patterns.empty())
+            expand_patterns<Hasher>(c, *pool, *cache, io, dirs);
+
+        if (inputs) {
+            inputs->clear();
+            inputs->reserve(c.files.size() + dirs.size());
+
+            for (const auto& ent : c.files) {
+                inputs->push_back(ent.fn);
+            }
+
+            inputs->insert(inputs->end(), dirs.begin(), dirs.end());
+        }
+
+        cat<Hasher> ct(identifier, time(nullptr));
+
+        ct.entries = move(c.files);
+        ct.extensions = move(c.attributes);
+        ct.cache = cache;
+        ct.io = io;
+        ct.pool = pool;
+
+        ct.write(fd, c.page_hashes, num_threads);
+    };
+
+    switch (c.algorithm) {
+        case cdf_algorithm::SHA1:
+            lambda.template operator()<sha1_hasher>();
+        break;
+
+        case cdf_algorithm::SHA256:
+            lambda.template operator()<sha256_hasher>();
+        break;
+
+        default:
+        break;
+    }
+}
+
+optional<filesystem::path> cdf_scanner::next_line(string_view line) {
+    if (!line.empty() && line.front() == '[') {
+        files = line.starts_with("[CatalogFiles]");
+        return nullopt;
+    }
+
+    if (!files)
+        return nullopt;
+
+    auto sv = trim(line);
+    auto eq = sv.find('=');
+
+    if (eq == string::npos || eq + 1 == sv.size() || attribute_tag(sv.substr(0, eq)))
+        return nullopt;
+
+    // patterns are left until the end, when write_cat expands them
+    if (has_wildcards(sv.substr(eq + 1)))
+        return nullopt;
+
+    return native_path(sv.substr(eq + 1));
+}
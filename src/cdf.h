@@ -0,0 +1,124 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <string_view>
+#include <optional>
+#include <vector>
+#include "cat.h"
+#include "file_reader.h"
+
+class digest_cache;
+class thread_pool;
+
+// The contents of a CDF. Files are mapped, and anything which can't be, such
+// as a pipe, is read into memory. A filename of - means stdin.
+class cdf_file {
+public:
+    explicit cdf_file(const std::filesystem::path& fn);
+    ~cdf_file();
+
+    cdf_file(const cdf_file&) = delete;
+    cdf_file& operator=(const cdf_file&) = delete;
+
+    std::string_view text() const;
+
+private:
+    void read_fd(int fd, const std::filesystem::path& fn);
+
+    void* map = nullptr;
+    size_t length = 0;
+    std::string buf;
+};
+
+enum class cdf_algorithm {
+    none,
+    SHA1,
+    SHA256
+};
+
+// A CatalogFiles entry whose path has wildcards in it, which stands for all
+// the files it matches. * and ? match within a directory, and a directory of
+// ** matches any number of directories, so that drivers\**\*.sys is every .sys
+// file below drivers. Components with wildcards in them ignore case, for ASCII
+// letters only; the rest of the path has to match exactly. Names beginning
+// with a dot are only matched by a pattern which begins with one, and
+// wildcards don't match symlinks to directories, so that the walk can't go
+// round in circles.
+struct cdf_pattern {
+    std::string pattern;
+    std::vector<cat_extension> extensions;
+
+    // What a relative pattern is relative to, if not the current directory.
+    std::filesystem::path base;
+};
+
+// A catalogue definition file, as taken by makecat.
+struct cdf {
+    std::string name;
+    std::string result_dir;
+    unsigned int catalogue_version = 0;
+    cdf_algorithm algorithm = cdf_algorithm::none;
+    bool page_hashes = false;
+    std::vector<cat_extension> attributes;
+
+    // The files in the CatalogFiles section, in the order they were listed.
+    std::vector<cat_entry> files;
+
+    // These are expanded by write_cat, and the files they match are added to
+    // the catalogue after those given explicitly, other than any which have
+    // already been listed.
+    std::vector<cdf_pattern> patterns;
+
+    // Where the catalogue is to go, i.e. Name within ResultDir.
+    std::filesystem::path output_path() const;
+};
+
+// Parses a CDF, throwing runtime_error if there's anything wrong with it.
+// CatalogVersion and HashAlgorithms are checked against each other and filled
+// in, so that afterwards both are set.
+cdf parse_cdf(std::string_view text);
+
+// Picks out the files a CDF lists a line at a time, so that they can be hashed
+// while the rest of it is still being read. Nothing is checked here, which is
+// left to parse_cdf once the whole CDF is there, and a line it gets wrong only
+// means that file isn't hashed early.
+class cdf_scanner {
+public:
+    // Returns the file named by line, if it's in the CatalogFiles section.
+    std::optional<std::filesystem::path> next_line(std::string_view line);
+
+    bool in_files() const {
+        return files;
+    }
+
+private:
+    bool files = false;
+};
+
+// Hashes the files listed in c, and writes the catalogue to fd. If pool is
+// given, the hashing is done on that rather than on num_threads new threads.
+// Any patterns are expanded by walking the directories in parallel, and the
+// files found are hashed while the walk carries on. If inputs is given, it's
+// set to the files the catalogue was made from, followed by the directories
+// the patterns were matched against.
+void write_cat(cdf c, int fd, unsigned int num_threads = 1, digest_cache* cache = nullptr,
+               io_mode io = io_mode::automatic, thread_pool* pool = nullptr,
+               std::vector<std::filesystem::path>* inputs = nullptr);
@@ -0,0 +1,55 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NYAN_X86
+
+#include <cpuid.h>
+
+// SHA extensions, plus the SSSE3 and SSE4.1 instructions the SHA-NI code
+// uses for byte-swapping and shuffling the state.
+static inline bool cpu_has_sha_ni() {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+        return false;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    return ebx & bit_SHA;
+}
+
+static inline bool cpu_has_ssse3() {
+    return __builtin_cpu_supports("ssse3");
+}
+
+// These also check that the OS saves the wider registers.
+static inline bool cpu_has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+static inline bool cpu_has_avx512() {
+    return __builtin_cpu_supports("avx512f");
+}
+
+#endif
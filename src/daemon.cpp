@@ -0,0 +1,448 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdexcept>
+#include "daemon.h"
+#include "sha1.h"
+#include "sha256.h"
+#include "dual_hasher.h"
+
+using namespace std;
+
+filesystem::path daemon_socket_path() {
+    if (auto env = getenv("NYAN_SOCKET"); env && *env)
+        return env;
+
+    if (auto env = getenv("XDG_RUNTIME_DIR"); env && *env)
+        return filesystem::path{env} / "nyand.sock";
+
+    return daemon_private_dir() / "nyand.sock";
+}
+
+filesystem::path daemon_private_dir() {
+    return "/tmp/nyand-" + to_string(getuid());
+}
+
+void daemon_send(int sock, daemon_msg type, span<const uint8_t> payload, int fd) {
+    daemon_header h;
+
+    if (payload.size() > DAEMON_MAX_MESSAGE)
+        throw runtime_error("Message too long to send to nyand.");
+
+    h.type = (uint32_t)type;
+    h.length = (uint32_t)payload.size();
+
+    iovec iov[2];
+
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = (void*)payload.data();
+    iov[1].iov_len = payload.size();
+
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = payload.empty() ? 1 : 2;
+
+    // the file descriptor goes along with the first byte
+
+    if (fd != -1) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    while (msg.msg_iovlen > 0) {
+        auto ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            throw runtime_error("sendmsg failed (errno " + to_string(errno) + ")");
+        }
+
+        msg.msg_control = nullptr;
+        msg.msg_controllen = 0;
+
+        auto done = (size_t)ret;
+
+        while (msg.msg_iovlen > 0 && done >= msg.msg_iov->iov_len) {
+            done -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + done;
+            msg.msg_iov->iov_len -= done;
+        }
+    }
+}
+
+// Reads exactly buf.size() bytes, returning false if the connection was closed
+// before any of them. If fd isn't null, it picks up any file descriptor
+// passed alongside.
+static bool recv_all(int sock, span<uint8_t> buf, int* fd) {
+    size_t done = 0;
+
+    while (done < buf.size()) {
+        iovec iov;
+
+        iov.iov_base = buf.data() + done;
+        iov.iov_len = buf.size() - done;
+
+        union {
+            cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (fd) {
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+        }
+
+        auto ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            throw runtime_error("recvmsg failed (errno " + to_string(errno) + ")");
+        }
+
+        if (ret == 0) {
+            if (done == 0)
+                return false;
+
+            throw runtime_error("Connection closed in the middle of a message.");
+        }
+
+        if (fd) {
+            for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+                    int new_fd;
+
+                    memcpy(&new_fd, CMSG_DATA(cmsg), sizeof(int));
+
+                    if (*fd != -1)
+                        close(*fd);
+
+                    *fd = new_fd;
+                }
+            }
+        }
+
+        done += (size_t)ret;
+    }
+
+    return true;
+}
+
+bool daemon_recv(int sock, daemon_msg& type, vector<uint8_t>& payload, int* fd) {
+    daemon_header h;
+
+    if (fd)
+        *fd = -1;
+
+    try {
+        if (!recv_all(sock, span((uint8_t*)&h, sizeof(h)), fd))
+            return false;
+
+        if (h.length > DAEMON_MAX_MESSAGE)
+            throw runtime_error("Message of " + to_string(h.length) + " bytes is too long.");
+
+        payload.resize(h.length);
+
+        if (!recv_all(sock, payload, fd) && h.length != 0)
+            throw runtime_error("Connection closed in the middle of a message.");
+    } catch (...) {
+        if (fd && *fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+
+        throw;
+    }
+
+    type = (daemon_msg)h.type;
+
+    return true;
+}
+
+daemon_client::~daemon_client() {
+    close(sock);
+}
+
+unique_ptr<daemon_client> daemon_client::connect(const filesystem::path& path) {
+    sockaddr_un addr;
+    struct stat st;
+
+    // We'd be handing whoever is listening our paths and our output files, so
+    // a socket which belongs to someone else is an error, rather than a reason
+    // to quietly do the work ourselves.
+
+    if (lstat(path.c_str(), &st) == -1)
+        return nullptr;
+
+    if (st.st_uid != getuid())
+        throw runtime_error(path.string() + " belongs to another user.");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.native().size() >= sizeof(addr.sun_path))
+        return nullptr;
+
+    memcpy(addr.sun_path, path.c_str(), path.native().size());
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock == -1)
+        throw runtime_error("socket failed (errno " + to_string(errno) + ")");
+
+    // If nobody's listening, we do the work ourselves.
+
+    if (::connect(sock, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return nullptr;
+    }
+
+    // The socket could have been swapped for another since we looked at it,
+    // so check who we've actually connected to.
+
+    ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        auto err = errno;
+
+        close(sock);
+        throw runtime_error("getsockopt failed (errno " + to_string(err) + ")");
+    }
+
+    if (cred.uid != getuid()) {
+        close(sock);
+        throw runtime_error("nyand on " + path.string() + " is running as another user.");
+    }
+
+    return unique_ptr<daemon_client>(new daemon_client(sock));
+}
+
+template<typename Hasher>
+static constexpr daemon_algorithm algorithm_of() {
+    if constexpr (is_same_v<Hasher, sha1_hasher>)
+        return daemon_algorithm::sha1;
+    else if constexpr (is_same_v<Hasher, sha256_hasher>)
+        return daemon_algorithm::sha256;
+    else
+        return daemon_algorithm::both;
+}
+
+void daemon_put_paths(vector<uint8_t>& buf, span<const filesystem::path> fns) {
+    for (const auto& fn : fns) {
+        buf.insert(buf.end(), fn.native().begin(), fn.native().end());
+        buf.push_back(0);
+    }
+}
+
+vector<filesystem::path> daemon_get_paths(span<const uint8_t> sp) {
+    vector<filesystem::path> fns;
+
+    while (!sp.empty()) {
+        auto nul = find(sp.begin(), sp.end(), 0);
+
+        if (nul == sp.end())
+            throw runtime_error("Malformed list of files.");
+
+        fns.emplace_back(string(sp.begin(), nul));
+        sp = sp.subspan((size_t)(nul - sp.begin()) + 1);
+    }
+
+    return fns;
+}
+
+void daemon_client::request(daemon_msg type, daemon_algorithm algorithm, span<const filesystem::path> fns) {
+    vector<uint8_t> payload;
+
+    payload.push_back((uint8_t)algorithm);
+
+    for (const auto& fn : fns) {
+        auto abs = filesystem::absolute(fn);
+
+        payload.insert(payload.end(), abs.native().begin(), abs.native().end());
+        payload.push_back(0);
+    }
+
+    daemon_send(sock, type, payload);
+}
+
+// Reads the results of a hash or page_hashes request. Errors go into errors,
+// and anything else is passed to func along with the index of the file.
+void daemon_client::results(span<string> errors, const function<void(size_t, span<const uint8_t>)>& func) {
+    size_t i = 0;
+
+    while (true) {
+        daemon_msg type;
+        vector<uint8_t> payload;
+
+        if (!daemon_recv(sock, type, payload))
+            throw runtime_error("nyand closed the connection.");
+
+        switch (type) {
+            case daemon_msg::result:
+                if (i == errors.size() || payload.empty())
+                    throw runtime_error("Unexpected result from nyand.");
+
+                if (payload[0] == 1)
+                    func(i, span(payload).subspan(1));
+                else
+                    errors[i] = string(payload.begin() + 1, payload.end());
+
+                i++;
+            break;
+
+            case daemon_msg::done:
+                if (i != errors.size())
+                    throw runtime_error("nyand returned " + to_string(i) + " results rather than " + to_string(errors.size()) + ".");
+
+                return;
+
+            case daemon_msg::error:
+                throw runtime_error(string(payload.begin(), payload.end()));
+
+            default:
+                throw runtime_error("Unexpected message " + to_string((uint32_t)type) + " from nyand.");
+        }
+    }
+}
+
+template<typename Hasher>
+void daemon_client::authenticode(span<const filesystem::path> fns, span<optional<decltype(Hasher{}.finalize())>> digests,
+                                 span<string> errors) {
+    request(daemon_msg::hash, algorithm_of<Hasher>(), fns);
+
+    results(errors.subspan(0, fns.size()), [&](size_t i, span<const uint8_t> sp) {
+        decltype(Hasher{}.finalize()) d;
+
+        daemon_get_digest(sp, d);
+        digests[i] = d;
+    });
+}
+
+template<typename Hasher>
+void daemon_client::page_hashes(span<const filesystem::path> fns, span<optional<pe_hashes<Hasher>>> hashes,
+                                span<string> errors) {
+    request(daemon_msg::page_hashes, algorithm_of<Hasher>(), fns);
+
+    results(errors.subspan(0, fns.size()), [&](size_t i, span<const uint8_t> sp) {
+        pe_hashes<Hasher> h;
+        uint32_t num;
+
+        daemon_get_digest(sp, h.hash);
+
+        if (sp.size() < sizeof(num))
+            throw runtime_error("Truncated message from nyand.");
+
+        memcpy(&num, sp.data(), sizeof(num));
+        sp = sp.subspan(sizeof(num));
+
+        h.page_hashes.resize(num);
+
+        for (auto& ph : h.page_hashes) {
+            if (sp.size() < sizeof(uint32_t))
+                throw runtime_error("Truncated message from nyand.");
+
+            memcpy(&ph.first, sp.data(), sizeof(uint32_t));
+            sp = sp.subspan(sizeof(uint32_t));
+
+            daemon_get_digest(sp, ph.second);
+        }
+
+        hashes[i] = move(h);
+    });
+}
+
+vector<filesystem::path> daemon_client::makecat(string_view cdf, const filesystem::path& cwd, int fd) {
+    vector<uint8_t> payload;
+    vector<filesystem::path> inputs;
+    string error;
+
+    payload.insert(payload.end(), cwd.native().begin(), cwd.native().end());
+    payload.push_back(0);
+    payload.insert(payload.end(), cdf.begin(), cdf.end());
+
+    daemon_send(sock, daemon_msg::makecat, payload, fd);
+
+    results(span(&error, 1), [&](size_t, span<const uint8_t> sp) {
+        inputs = daemon_get_paths(sp);
+    });
+
+    if (!error.empty())
+        throw runtime_error(error);
+
+    for (auto& fn : inputs) {
+        auto rel = fn.lexically_relative(cwd);
+
+        if (!rel.empty() && *rel.begin() != "..")
+            fn = move(rel);
+    }
+
+    return inputs;
+}
+
+template void daemon_client::authenticode<sha1_hasher>(span<const filesystem::path> fns,
+                                                       span<optional<decltype(sha1_hasher{}.finalize())>> digests,
+                                                       span<string> errors);
+template void daemon_client::authenticode<sha256_hasher>(span<const filesystem::path> fns,
+                                                         span<optional<decltype(sha256_hasher{}.finalize())>> digests,
+                                                         span<string> errors);
+template void daemon_client::authenticode<dual_hasher<sha256_hasher, sha1_hasher>>(span<const filesystem::path> fns,
+                                                                                   span<optional<decltype(dual_hasher<sha256_hasher, sha1_hasher>{}.finalize())>> digests,
+                                                                                   span<string> errors);
+template void daemon_client::page_hashes<sha1_hasher>(span<const filesystem::path> fns,
+                                                      span<optional<pe_hashes<sha1_hasher>>> hashes,
+                                                      span<string> errors);
+template void daemon_client::page_hashes<sha256_hasher>(span<const filesystem::path> fns,
+                                                        span<optional<pe_hashes<sha256_hasher>>> hashes,
+                                                        span<string> errors);
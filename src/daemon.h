@@ -0,0 +1,157 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <vector>
+#include "authenticode.h"
+
+// nyand takes work from authenticode and makecat over a Unix socket, so that
+// its threads and its cache stay warm from one run to the next. Each message
+// is a daemon_header followed by length bytes. Both ends are on the same
+// machine, so everything is in its byte order.
+
+enum class daemon_msg : uint32_t {
+    // Requests. hash and page_hashes have the algorithm as a daemon_algorithm
+    // byte, followed by the files as null-terminated absolute paths. makecat
+    // has the client's working directory, null-terminated, followed by the
+    // CDF, and comes with the file to write the catalogue to.
+    hash = 1,
+    page_hashes = 2,
+    makecat = 3,
+
+    // Replies. hash and page_hashes get a result for each file, in order,
+    // which is a byte of 1 followed by the hashes, or a byte of 0 followed by
+    // the error message. makecat gets a single result of a byte of 1 followed
+    // by the files and directories the catalogue was made from, as
+    // null-terminated absolute paths. Every request ends with done, or with
+    // error if it failed as a whole.
+    result = 0x100,
+    done = 0x101,
+    error = 0x102
+};
+
+enum class daemon_algorithm : uint8_t {
+    sha1 = 1,
+    sha256 = 2,
+    both = 3 // the SHA-256 hash followed by the SHA-1 hash
+};
+
+struct daemon_header {
+    uint32_t type;
+    uint32_t length;
+};
+
+static_assert(sizeof(daemon_header) == 8);
+
+static const uint32_t DAEMON_MAX_MESSAGE = 64 * 1024 * 1024;
+
+// $NYAN_SOCKET if it's set, otherwise nyand.sock in $XDG_RUNTIME_DIR, otherwise
+// nyand.sock in daemon_private_dir().
+std::filesystem::path daemon_socket_path();
+
+// /tmp/nyand-UID, which nyand creates with mode 0700 for the socket when
+// there's no $XDG_RUNTIME_DIR.
+std::filesystem::path daemon_private_dir();
+
+// Sends a message, passing fd along with it if it isn't -1.
+void daemon_send(int sock, daemon_msg type, std::span<const uint8_t> payload, int fd = -1);
+
+// Receives a message, returning false if the connection was closed before it
+// started. If fd isn't null, it's set to the file descriptor passed with the
+// message, or -1.
+bool daemon_recv(int sock, daemon_msg& type, std::vector<uint8_t>& payload, int* fd = nullptr);
+
+// Appends a digest, or a pair of them from a dual_hasher, to buf.
+template<typename Digest>
+void daemon_put_digest(std::vector<uint8_t>& buf, const Digest& d) {
+    if constexpr (requires { d.first; }) {
+        daemon_put_digest(buf, d.first);
+        daemon_put_digest(buf, d.second);
+    } else
+        buf.insert(buf.end(), d.begin(), d.end());
+}
+
+// Takes a digest, or a pair of them, from the front of sp.
+template<typename Digest>
+void daemon_get_digest(std::span<const uint8_t>& sp, Digest& d) {
+    if constexpr (requires { d.first; }) {
+        daemon_get_digest(sp, d.first);
+        daemon_get_digest(sp, d.second);
+    } else {
+        if (sp.size() < d.size())
+            throw std::runtime_error("Truncated message from nyand.");
+
+        std::copy(sp.begin(), sp.begin() + d.size(), d.begin());
+        sp = sp.subspan(d.size());
+    }
+}
+
+// Appends fns to buf as null-terminated paths.
+void daemon_put_paths(std::vector<uint8_t>& buf, std::span<const std::filesystem::path> fns);
+
+// Splits a list of null-terminated paths.
+std::vector<std::filesystem::path> daemon_get_paths(std::span<const uint8_t> sp);
+
+// A connection to nyand. Relative paths are resolved against our working
+// directory before they're sent.
+class daemon_client {
+public:
+    ~daemon_client();
+
+    // Returns null if nyand isn't listening on path, and throws if the socket
+    // or the nyand listening on it belongs to another user.
+    static std::unique_ptr<daemon_client> connect(const std::filesystem::path& path = daemon_socket_path());
+
+    // Gets the Authenticode hashes of fns, putting the results or the errors
+    // in the corresponding places in digests and errors. Hasher is
+    // sha1_hasher, sha256_hasher, or dual_hasher<sha256_hasher, sha1_hasher>.
+    template<typename Hasher>
+    void authenticode(std::span<const std::filesystem::path> fns,
+                      std::span<std::optional<decltype(Hasher{}.finalize())>> digests,
+                      std::span<std::string> errors);
+
+    // The same, but with the page hashes too.
+    template<typename Hasher>
+    void page_hashes(std::span<const std::filesystem::path> fns, std::span<std::optional<pe_hashes<Hasher>>> hashes,
+                     std::span<std::string> errors);
+
+    // Has nyand write the catalogue described by cdf to fd. Files in the CDF
+    // are relative to cwd. Throws if it fails. Returns what the catalogue was
+    // made from, as write_cat's inputs, with the paths within cwd made
+    // relative to it again.
+    std::vector<std::filesystem::path> makecat(std::string_view cdf, const std::filesystem::path& cwd, int fd);
+
+private:
+    explicit daemon_client(int sock) : sock(sock) {
+    }
+
+    void request(daemon_msg type, daemon_algorithm algorithm, std::span<const std::filesystem::path> fns);
+    void results(std::span<std::string> errors, const std::function<void(size_t, std::span<const uint8_t>)>& func);
+
+    int sock;
+};
@@ -0,0 +1,70 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <fstream>
+#include <stdexcept>
+#include "depfile.h"
+
+using namespace std;
+
+// Make splits on spaces and treats # as a comment and $ as a variable, so
+// those need escaping. Ninja understands the same escapes.
+static void escape(string& out, const filesystem::path& fn) {
+    for (auto c : fn.string()) {
+        switch (c) {
+            case ' ':
+            case '#':
+                out += '\\';
+                out += c;
+            break;
+
+            case '$':
+                out += "$$";
+            break;
+
+            default:
+                out += c;
+            break;
+        }
+    }
+}
+
+void depfile::add(const filesystem::path& target, span<const filesystem::path> deps) {
+    escape(text, target);
+    text += ':';
+
+    for (const auto& dep : deps) {
+        text += " \\\n  ";
+        escape(text, dep);
+    }
+
+    text += '\n';
+}
+
+void depfile::write(const filesystem::path& fn) const {
+    ofstream f(fn, ios::binary);
+
+    // FIXME - throw more descriptive error message (not found, access denied, etc.)
+    if (!f.is_open())
+        throw runtime_error("Could not open " + fn.string() + " for writing.");
+
+    f << text;
+    f.close();
+
+    if (f.fail())
+        throw runtime_error("Could not write " + fn.string() + ".");
+}
@@ -0,0 +1,34 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <span>
+
+// A dependency file, in the form gcc writes for -MD, which tells Make or Ninja
+// what a target was made from so that it needn't be made again unless one of
+// them changes.
+class depfile {
+public:
+    void add(const std::filesystem::path& target, std::span<const std::filesystem::path> deps);
+    void write(const std::filesystem::path& fn) const;
+
+private:
+    std::string text;
+};
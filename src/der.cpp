@@ -0,0 +1,177 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include <string>
+#include "der.h"
+
+using namespace std;
+
+void der_writer::begin(uint8_t tag) {
+    buf.push_back(tag);
+    buf.push_back(0);
+    stack.push_back(buf.size());
+}
+
+void der_writer::end() {
+    auto start = stack.back();
+    auto len = buf.size() - start;
+
+    stack.pop_back();
+
+    if (len < 0x80) {
+        buf[start - 1] = (uint8_t)len;
+        return;
+    }
+
+    // long form - make room for the length bytes
+
+    auto extra = der_header_size(len) - 2;
+
+    buf.insert(buf.begin() + (ptrdiff_t)start, extra, 0);
+    buf[start - 1] = (uint8_t)(0x80 | extra);
+
+    for (size_t i = 0; i < extra; i++) {
+        buf[start + i] = (uint8_t)(len >> ((extra - i - 1) * 8));
+    }
+}
+
+void der_writer::header(uint8_t tag, size_t len) {
+    buf.push_back(tag);
+
+    if (len < 0x80) {
+        buf.push_back((uint8_t)len);
+        return;
+    }
+
+    auto extra = der_header_size(len) - 2;
+
+    buf.push_back((uint8_t)(0x80 | extra));
+
+    for (size_t i = 0; i < extra; i++) {
+        buf.push_back((uint8_t)(len >> ((extra - i - 1) * 8)));
+    }
+}
+
+void der_writer::put(uint8_t tag, span<const uint8_t> data) {
+    header(tag, data.size());
+    raw(data);
+}
+
+void der_writer::integer(int64_t val) {
+    uint8_t bytes[8];
+    unsigned int len = 8;
+
+    for (unsigned int i = 0; i < 8; i++) {
+        bytes[7 - i] = (uint8_t)((uint64_t)val >> (i * 8));
+    }
+
+    // strip redundant leading bytes, keeping the sign bit the same
+
+    unsigned int off = 0;
+
+    while (len > 1 && ((bytes[off] == 0 && !(bytes[off + 1] & 0x80)) ||
+                       (bytes[off] == 0xff && (bytes[off + 1] & 0x80)))) {
+        off++;
+        len--;
+    }
+
+    put(DER_INTEGER, span(bytes + off, len));
+}
+
+void der_writer::sort_set(size_t start, span<const size_t> ends) {
+    if (ends.size() < 2)
+        return;
+
+    vector<span<const uint8_t>> elements;
+    auto pos = start;
+
+    for (auto e : ends) {
+        elements.emplace_back(buf.data() + pos, e - pos);
+        pos = e;
+    }
+
+    // DER sorts by the encodings, as if the shorter were padded with zeroes
+
+    auto cmp = [](span<const uint8_t> a, span<const uint8_t> b) {
+        return lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    };
+
+    if (is_sorted(elements.begin(), elements.end(), cmp))
+        return;
+
+    sort(elements.begin(), elements.end(), cmp);
+
+    vector<uint8_t> sorted;
+
+    sorted.reserve(ends.back() - start);
+
+    for (const auto& e : elements) {
+        sorted.insert(sorted.end(), e.begin(), e.end());
+    }
+
+    copy(sorted.begin(), sorted.end(), buf.begin() + (ptrdiff_t)start);
+}
+
+vector<uint8_t> der_oid(string_view oid) {
+    vector<uint32_t> arcs;
+    vector<uint8_t> ret;
+    auto orig = oid;
+
+    while (!oid.empty()) {
+        uint32_t arc;
+        auto [ptr, ec] = from_chars(oid.data(), oid.data() + oid.size(), arc);
+
+        if (ec != errc() || (ptr != oid.data() + oid.size() && *ptr != '.'))
+            throw runtime_error("Invalid OID " + string(orig) + ".");
+
+        arcs.push_back(arc);
+
+        oid = oid.substr(min(oid.size(), (size_t)(ptr - oid.data()) + 1));
+    }
+
+    if (arcs.size() < 2)
+        throw runtime_error("OID must have at least two arcs.");
+
+    arcs[1] += arcs[0] * 40;
+
+    ret.push_back(DER_OBJECT);
+    ret.push_back(0);
+
+    for (size_t i = 1; i < arcs.size(); i++) {
+        uint8_t tmp[5];
+        unsigned int n = 0;
+        auto v = arcs[i];
+
+        do {
+            tmp[n] = (uint8_t)(v & 0x7f);
+            n++;
+            v >>= 7;
+        } while (v != 0);
+
+        while (n > 0) {
+            n--;
+            ret.push_back((uint8_t)(tmp[n] | (n > 0 ? 0x80 : 0)));
+        }
+    }
+
+    ret[1] = (uint8_t)(ret.size() - 2);
+
+    return ret;
+}
@@ -0,0 +1,81 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <vector>
+#include <span>
+#include <string_view>
+#include <stdint.h>
+
+static const uint8_t DER_INTEGER = 0x02;
+static const uint8_t DER_BIT_STRING = 0x03;
+static const uint8_t DER_OCTET_STRING = 0x04;
+static const uint8_t DER_NULL = 0x05;
+static const uint8_t DER_OBJECT = 0x06;
+static const uint8_t DER_UTCTIME = 0x17;
+static const uint8_t DER_BMPSTRING = 0x1e;
+static const uint8_t DER_SEQUENCE = 0x30;
+static const uint8_t DER_SET = 0x31;
+
+static inline uint8_t der_context(uint8_t num, bool constructed) {
+    return 0x80 | (constructed ? 0x20 : 0) | num;
+}
+
+// Number of bytes taken up by the tag and length of a value len bytes long.
+static inline size_t der_header_size(size_t len) {
+    size_t ret = 2;
+
+    if (len >= 0x80) {
+        while (len != 0) {
+            ret++;
+            len >>= 8;
+        }
+    }
+
+    return ret;
+}
+
+// Writes DER into a byte buffer. Constructed values are opened with begin()
+// and closed with end(), which goes back and fills in the length.
+class der_writer {
+public:
+    void begin(uint8_t tag);
+    void end();
+    void header(uint8_t tag, size_t len);
+    void put(uint8_t tag, std::span<const uint8_t> data);
+    void integer(int64_t val);
+
+    void raw(std::span<const uint8_t> data) {
+        buf.insert(buf.end(), data.begin(), data.end());
+    }
+
+    // Puts the elements written since start, which end at the offsets in ends,
+    // into the order that DER requires for a SET OF.
+    void sort_set(size_t start, std::span<const size_t> ends);
+
+    size_t size() const {
+        return buf.size();
+    }
+
+    std::vector<uint8_t> buf;
+
+private:
+    std::vector<size_t> stack;
+};
+
+std::vector<uint8_t> der_oid(std::string_view oid);
@@ -0,0 +1,550 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdexcept>
+#include <string>
+#include "digest_cache.h"
+#include "sha256.h"
+
+using namespace std;
+
+static const char CACHE_MAGIC[8] = { 'N', 'Y', 'A', 'N', 'H', 'A', 'S', 'H' };
+static const uint32_t CACHE_VERSION = 1;
+static const uint32_t RECORD_MAGIC = 0x52434e44; // "DNCR"
+
+// Once the cache file is this big, and at least half of it is taken up by
+// records for old versions of files, flush() writes out a fresh copy.
+static const size_t COMPACT_MIN_SIZE = 1024 * 1024;
+
+// A file which is modified again within the resolution of its timestamps will
+// look the same as it did before, so we don't cache anything that was changed
+// just before we started.
+static const int64_t RACY_NS = 1000000000;
+
+enum class digest_algorithm : uint8_t {
+    sha1 = 1,
+    sha256 = 2
+};
+
+template<typename Hasher>
+static constexpr digest_algorithm algorithm_of() {
+    if constexpr (is_same_v<Hasher, sha256_hasher>)
+        return digest_algorithm::sha256;
+    else
+        return digest_algorithm::sha1;
+}
+
+static size_t hash_size(uint8_t algorithm) {
+    switch ((digest_algorithm)algorithm) {
+        case digest_algorithm::sha1:
+            return sizeof(decltype(sha1_hasher{}.finalize()));
+
+        case digest_algorithm::sha256:
+            return sizeof(decltype(sha256_hasher{}.finalize()));
+
+        default:
+            return 0;
+    }
+}
+
+// Returns the length of a record, or 0 if the algorithm isn't one we know.
+static size_t record_length(uint8_t algorithm, uint32_t num_page_hashes) {
+    auto hs = hash_size(algorithm);
+
+    if (hs == 0)
+        return 0;
+
+    auto len = sizeof(digest_cache_record) + hs + ((size_t)num_page_hashes * (sizeof(uint32_t) + hs));
+
+    // SHA-256 records also have the SHA-1 hash, for version 2 catalogues
+    if ((digest_algorithm)algorithm == digest_algorithm::sha256)
+        len += hash_size((uint8_t)digest_algorithm::sha1);
+
+    return (len + 7) & ~(size_t)7;
+}
+
+static bool record_valid(const digest_cache_record& r, size_t avail) {
+    return r.magic == RECORD_MAGIC && r.length <= avail &&
+           r.length == record_length(r.key.algorithm, r.num_page_hashes);
+}
+
+// Calls func for each record in data, stopping at anything which isn't one,
+// and returns the number of bytes they take up.
+template<typename F>
+static size_t parse_records(span<const uint8_t> data, F func) {
+    size_t off = 0;
+
+    while (data.size() - off >= sizeof(digest_cache_record)) {
+        const auto& r = *(const digest_cache_record*)(data.data() + off);
+
+        if (!record_valid(r, data.size() - off))
+            break;
+
+        func(r);
+
+        off += r.length;
+    }
+
+    return off;
+}
+
+// Records for different versions of the same file have the same identity,
+// and only the last one is worth keeping.
+static digest_cache_key file_identity(const digest_cache_key& key) {
+    auto ret = key;
+
+    ret.size = 0;
+    ret.mtime_ns = 0;
+    ret.ctime_ns = 0;
+
+    return ret;
+}
+
+static digest_cache_key make_key(const struct stat& st, digest_algorithm algorithm, bool page_hashes) {
+    digest_cache_key key;
+
+    memset(&key, 0, sizeof(key));
+
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    key.ctime_ns = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+    key.algorithm = (uint8_t)algorithm;
+    key.page_hashes = page_hashes ? 1 : 0;
+
+    return key;
+}
+
+static void lock_file(int fd, int op, const filesystem::path& fn) {
+    while (flock(fd, op) == -1) {
+        if (errno != EINTR)
+            throw runtime_error("flock of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+    }
+}
+
+static size_t file_size(int fd, const filesystem::path& fn) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        throw runtime_error("fstat of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+
+    return st.st_size;
+}
+
+static void write_all(int fd, span<const uint8_t> sp, size_t off, const filesystem::path& fn) {
+    while (!sp.empty()) {
+        auto ret = pwrite(fd, sp.data(), sp.size(), (off_t)off);
+
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            throw runtime_error("write to " + fn.string() + " failed (errno " + to_string(errno) + ")");
+        }
+
+        sp = sp.subspan((size_t)ret);
+        off += (size_t)ret;
+    }
+}
+
+static digest_cache_header make_header() {
+    digest_cache_header h;
+
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version = CACHE_VERSION;
+    h.reserved = 0;
+
+    return h;
+}
+
+enum class header_state {
+    ok,
+    missing,
+    foreign
+};
+
+static header_state check_header(int fd, size_t size) {
+    digest_cache_header h;
+
+    if (size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h))
+        return header_state::missing;
+
+    if (memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)))
+        return header_state::foreign;
+
+    // if the format has changed, we start again
+    if (h.version != CACHE_VERSION)
+        return header_state::missing;
+
+    return header_state::ok;
+}
+
+static int64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+digest_cache::digest_cache(const filesystem::path& fn, bool long_lived) : fn(fn), long_lived(long_lived) {
+    start_ns = now_ns();
+
+    open_file();
+}
+
+digest_cache::digest_cache(in_memory_t, bool long_lived) : long_lived(long_lived) {
+    start_ns = now_ns();
+}
+
+digest_cache::~digest_cache() {
+    close_file();
+}
+
+void digest_cache::open_file() {
+    fd = open(fn.string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+
+    if (fd == -1)
+        throw runtime_error("open of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+
+    try {
+        lock_file(fd, LOCK_SH, fn);
+
+        auto size = file_size(fd, fn);
+        auto state = check_header(fd, size);
+
+        if (state == header_state::missing) {
+            // new file, or an old format - check again once nobody else can
+            // be writing to it
+
+            lock_file(fd, LOCK_EX, fn);
+
+            size = file_size(fd, fn);
+            state = check_header(fd, size);
+
+            if (state == header_state::missing) {
+                auto h = make_header();
+
+                if (ftruncate(fd, 0) == -1)
+                    throw runtime_error("ftruncate of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+
+                write_all(fd, span((const uint8_t*)&h, sizeof(h)), 0, fn);
+                size = sizeof(h);
+                state = header_state::ok;
+            }
+
+            lock_file(fd, LOCK_SH, fn);
+        }
+
+        if (state == header_state::foreign)
+            throw runtime_error(fn.string() + " is not a digest cache.");
+
+        addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            addr = nullptr;
+            throw runtime_error("mmap of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+        }
+
+        length = size;
+
+        unordered_map<digest_cache_key, uint32_t, key_hash, key_equal> latest;
+
+        auto data = span((const uint8_t*)addr, length).subspan(sizeof(digest_cache_header));
+
+        auto parsed = parse_records(data, [&](const digest_cache_record& r) {
+            records[r.key] = &r;
+
+            auto [it, inserted] = latest.try_emplace(file_identity(r.key), r.length);
+
+            if (!inserted) {
+                stale_size += it->second;
+                it->second = r.length;
+            }
+        });
+
+        valid_end = sizeof(digest_cache_header) + parsed;
+
+        lock_file(fd, LOCK_UN, fn);
+    } catch (...) {
+        close_file();
+        throw;
+    }
+}
+
+void digest_cache::close_file() {
+    records.clear();
+
+    if (addr) {
+        munmap(addr, length);
+        addr = nullptr;
+    }
+
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+
+    length = 0;
+    valid_end = 0;
+    stale_size = 0;
+}
+
+// Takes an exclusive lock on the cache file, reopening it if another process
+// has replaced it with a compacted copy in the meantime.
+void digest_cache::lock_for_append() {
+    while (true) {
+        lock_file(fd, LOCK_EX, fn);
+
+        struct stat st1, st2;
+
+        if (fstat(fd, &st1) == -1)
+            throw runtime_error("fstat of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+
+        if (stat(fn.string().c_str(), &st2) == 0 && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+            return;
+
+        close_file();
+        open_file();
+    }
+}
+
+// Returns the end of the last complete record. Anything after that is left
+// over from a process which died while appending to the file.
+size_t digest_cache::find_valid_end() {
+    auto size = file_size(fd, fn);
+    auto off = valid_end;
+
+    while (size - off >= sizeof(digest_cache_record)) {
+        digest_cache_record r;
+
+        if (pread(fd, &r, sizeof(r), (off_t)off) != sizeof(r) || !record_valid(r, size - off))
+            break;
+
+        off += r.length;
+    }
+
+    if (off != size && ftruncate(fd, (off_t)off) == -1)
+        throw runtime_error("ftruncate of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+
+    return off;
+}
+
+// Writes a copy of the cache file without the old records, plus the ones
+// we're adding, and puts it in place of the original.
+void digest_cache::compact(size_t end) {
+    auto map = mmap(nullptr, end, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        throw runtime_error("mmap of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+
+    auto tmp = fn;
+    tmp += ".tmp" + to_string(getpid());
+
+    int tmp_fd = -1;
+
+    try {
+        unordered_map<digest_cache_key, const digest_cache_record*, key_hash, key_equal> latest;
+        vector<const digest_cache_record*> order;
+
+        auto add_record = [&](const digest_cache_record& r) {
+            auto [it, inserted] = latest.try_emplace(file_identity(r.key), &r);
+
+            if (inserted)
+                order.push_back(&r);
+            else
+                it->second = &r;
+        };
+
+        parse_records(span((const uint8_t*)map, end).subspan(sizeof(digest_cache_header)), add_record);
+        parse_records(pending, add_record);
+
+        vector<uint8_t> buf;
+        auto h = make_header();
+
+        buf.insert(buf.end(), (const uint8_t*)&h, (const uint8_t*)&h + sizeof(h));
+
+        for (auto r : order) {
+            auto latest_r = latest.at(file_identity(r->key));
+
+            buf.insert(buf.end(), (const uint8_t*)latest_r, (const uint8_t*)latest_r + latest_r->length);
+        }
+
+        tmp_fd = open(tmp.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+        if (tmp_fd == -1)
+            throw runtime_error("open of " + tmp.string() + " failed (errno " + to_string(errno) + ")");
+
+        write_all(tmp_fd, buf, 0, tmp);
+
+        close(tmp_fd);
+        tmp_fd = -1;
+
+        if (rename(tmp.string().c_str(), fn.string().c_str()) == -1)
+            throw runtime_error("rename of " + tmp.string() + " failed (errno " + to_string(errno) + ")");
+    } catch (...) {
+        if (tmp_fd != -1) {
+            close(tmp_fd);
+            unlink(tmp.string().c_str());
+        }
+
+        munmap(map, end);
+        throw;
+    }
+
+    munmap(map, end);
+}
+
+void digest_cache::flush() {
+    lock_guard lg(mutex);
+
+    if (pending.empty() || fn.empty())
+        return;
+
+    lock_for_append();
+
+    try {
+        auto end = find_valid_end();
+
+        if (end >= COMPACT_MIN_SIZE && stale_size >= end / 2) {
+            compact(end);
+            stale_size = 0;
+        } else
+            write_all(fd, pending, end, fn);
+
+        lock_file(fd, LOCK_UN, fn);
+    } catch (...) {
+        flock(fd, LOCK_UN);
+        throw;
+    }
+
+    pending.clear();
+}
+
+template<typename Hasher>
+static void read_record(const digest_cache_record& r, file_hashes<Hasher>& fh) {
+    auto ptr = (const uint8_t*)(&r + 1);
+
+    fh.is_pe = r.is_pe;
+
+    memcpy(fh.hash.data(), ptr, fh.hash.size());
+    ptr += fh.hash.size();
+
+    if constexpr (is_same_v<Hasher, sha256_hasher>) {
+        memcpy(fh.sha1_hash.data(), ptr, fh.sha1_hash.size());
+        ptr += fh.sha1_hash.size();
+    }
+
+    fh.page_hashes.resize(r.num_page_hashes);
+
+    for (auto& ph : fh.page_hashes) {
+        memcpy(&ph.first, ptr, sizeof(uint32_t));
+        ptr += sizeof(uint32_t);
+
+        memcpy(ph.second.data(), ptr, ph.second.size());
+        ptr += ph.second.size();
+    }
+}
+
+template<typename Hasher>
+bool digest_cache::find(const struct stat& st, bool page_hashes, file_hashes<Hasher>& fh) const {
+    auto key = make_key(st, algorithm_of<Hasher>(), page_hashes);
+
+    if (auto it = records.find(key); it != records.end()) {
+        read_record(*it->second, fh);
+        return true;
+    }
+
+    // Records we've added ourselves are kept by file, so only the latest
+    // version of each is held in memory.
+
+    lock_guard lg(mutex);
+
+    auto it = added.find(file_identity(key));
+
+    if (it == added.end())
+        return false;
+
+    const auto& r = *(const digest_cache_record*)it->second.data();
+
+    if (memcmp(&r.key, &key, sizeof(key)))
+        return false;
+
+    read_record(r, fh);
+
+    return true;
+}
+
+template<typename Hasher>
+void digest_cache::add(const struct stat& st, bool page_hashes, const file_hashes<Hasher>& fh) {
+    auto key = make_key(st, algorithm_of<Hasher>(), page_hashes);
+
+    // Something which runs for a long time has to go by when the file was
+    // hashed, rather than when it started.
+
+    auto since = long_lived ? now_ns() : start_ns;
+    auto racy = key.mtime_ns > since - RACY_NS || key.ctime_ns > since - RACY_NS;
+
+    if (racy && long_lived)
+        return;
+
+    auto len = record_length(key.algorithm, (uint32_t)fh.page_hashes.size());
+    vector<uint8_t> buf(len);
+
+    auto& r = *(digest_cache_record*)buf.data();
+
+    r.magic = RECORD_MAGIC;
+    r.length = (uint32_t)len;
+    r.key = key;
+    r.num_page_hashes = (uint32_t)fh.page_hashes.size();
+    r.is_pe = fh.is_pe ? 1 : 0;
+    memset(r.reserved, 0, sizeof(r.reserved));
+
+    auto ptr = (uint8_t*)(&r + 1);
+
+    memcpy(ptr, fh.hash.data(), fh.hash.size());
+    ptr += fh.hash.size();
+
+    if constexpr (is_same_v<Hasher, sha256_hasher>) {
+        memcpy(ptr, fh.sha1_hash.data(), fh.sha1_hash.size());
+        ptr += fh.sha1_hash.size();
+    }
+
+    for (const auto& ph : fh.page_hashes) {
+        memcpy(ptr, &ph.first, sizeof(uint32_t));
+        ptr += sizeof(uint32_t);
+
+        memcpy(ptr, ph.second.data(), ph.second.size());
+        ptr += ph.second.size();
+    }
+
+    lock_guard lg(mutex);
+
+    if (!fn.empty() && !racy)
+        pending.insert(pending.end(), buf.begin(), buf.end());
+
+    added[file_identity(key)] = move(buf);
+}
+
+template bool digest_cache::find(const struct stat& st, bool page_hashes, file_hashes<sha1_hasher>& fh) const;
+template bool digest_cache::find(const struct stat& st, bool page_hashes, file_hashes<sha256_hasher>& fh) const;
+template void digest_cache::add(const struct stat& st, bool page_hashes, const file_hashes<sha1_hasher>& fh);
+template void digest_cache::add(const struct stat& st, bool page_hashes, const file_hashes<sha256_hasher>& fh);
@@ -0,0 +1,143 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <string.h>
+#include <filesystem>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <span>
+#include "sha1.h"
+
+// The hashes of a file that go into a catalogue. For PE files, hash is the
+// Authenticode hash, otherwise it's the hash of the whole file. sha1_hash is
+// the same thing using SHA-1, which version 2 catalogues also need.
+template<typename Hasher>
+struct file_hashes {
+    decltype(Hasher{}.finalize()) hash;
+    decltype(sha1_hasher{}.finalize()) sha1_hash;
+    bool is_pe = false;
+    std::vector<std::pair<uint32_t, decltype(Hasher{}.finalize())>> page_hashes;
+};
+
+// Identifies a file, and the version of it, that some hashes were calculated
+// from.
+struct digest_cache_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint8_t algorithm;
+    uint8_t page_hashes;
+    uint8_t reserved[6];
+};
+
+static_assert(sizeof(digest_cache_key) == 48);
+
+// A record in the cache file, which is followed by the hash, the SHA-1 hash
+// for SHA-256 records, and num_page_hashes pairs of offset and hash. Records
+// are padded to a multiple of eight bytes.
+struct digest_cache_record {
+    uint32_t magic;
+    uint32_t length;
+    digest_cache_key key;
+    uint32_t num_page_hashes;
+    uint8_t is_pe;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(digest_cache_record) == 64);
+
+struct digest_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(digest_cache_header) == 16);
+
+// Remembers the hashes of files between runs, so that unchanged files only
+// need to be stat-ed. The cache file is mapped when it's opened, and new
+// entries are appended to it by flush(), which takes an exclusive lock on it
+// so that several processes can share the same file. Entries added are also
+// kept in memory, so they can be found again before they've been flushed.
+//
+// Files which were changed just before they were hashed are never written to
+// the file, as they could change again without their timestamps showing it.
+// For a single run they're still kept in memory, so nothing is hashed twice,
+// but a long_lived cache, such as nyand's, leaves them out altogether.
+class digest_cache {
+public:
+    // Selects the constructor for a cache which is only kept in memory, and
+    // which flush() does nothing to. This is a tag rather than a bool, as a
+    // filename given as a const char* would otherwise convert to the bool.
+    struct in_memory_t {
+        explicit in_memory_t() = default;
+    };
+
+    static constexpr in_memory_t in_memory{};
+
+    explicit digest_cache(const std::filesystem::path& fn, bool long_lived = false);
+    digest_cache(in_memory_t, bool long_lived = false);
+    ~digest_cache();
+
+    template<typename Hasher>
+    bool find(const struct stat& st, bool page_hashes, file_hashes<Hasher>& fh) const;
+
+    template<typename Hasher>
+    void add(const struct stat& st, bool page_hashes, const file_hashes<Hasher>& fh);
+
+    void flush();
+
+private:
+    struct key_hash {
+        size_t operator()(const digest_cache_key& k) const {
+            return std::hash<std::string_view>{}(std::string_view((const char*)&k, sizeof(k)));
+        }
+    };
+
+    struct key_equal {
+        bool operator()(const digest_cache_key& a, const digest_cache_key& b) const {
+            return !memcmp(&a, &b, sizeof(digest_cache_key));
+        }
+    };
+
+    void open_file();
+    void close_file();
+    void lock_for_append();
+    size_t find_valid_end();
+    void compact(size_t end);
+
+    std::filesystem::path fn;
+    int fd = -1;
+    void* addr = nullptr;
+    size_t length = 0;
+    size_t valid_end = 0;
+    size_t stale_size = 0;
+    int64_t start_ns;
+    bool long_lived = false;
+    std::unordered_map<digest_cache_key, const digest_cache_record*, key_hash, key_equal> records;
+    mutable std::mutex mutex;
+    std::vector<uint8_t> pending;
+    std::unordered_map<digest_cache_key, std::vector<uint8_t>, key_hash, key_equal> added;
+};
@@ -0,0 +1,53 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+
+// Calculates two digests of the same data in one pass. The input is split into
+// blocks small enough to stay in L1, and each is given to both hashers in
+// turn, so that it only has to be read from memory once.
+template<typename H1, typename H2>
+class dual_hasher {
+public:
+    void update(const uint8_t* data, size_t len) {
+        while (len > 0) {
+            auto n = std::min(len, BLOCK_SIZE);
+
+            h1.update(data, n);
+            h2.update(data, n);
+
+            data += n;
+            len -= n;
+        }
+    }
+
+    std::pair<decltype(H1{}.finalize()), decltype(H2{}.finalize())> finalize() {
+        return { h1.finalize(), h2.finalize() };
+    }
+
+private:
+    // small enough that each step is still in cache when the second hasher reads it
+    static constexpr size_t BLOCK_SIZE = 16384;
+
+    H1 h1;
+    H2 h2;
+};
@@ -0,0 +1,480 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include "file_reader.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define NYAN_IO_URING
+#endif
+
+using namespace std;
+
+// Files up to this size are read into the reader's buffer - for small files,
+// setting up and tearing down a mapping costs more than copying the data.
+static const size_t SMALL_FILE_SIZE = 256 * 1024;
+
+// Limits on how much read() does at once.
+static const size_t MAX_BATCH_FILES = 256;
+static const size_t MAX_BATCH_BUFFER = 16 * 1024 * 1024;
+
+optional<io_mode> parse_io_mode(string_view s) {
+    if (s == "auto")
+        return io_mode::automatic;
+    else if (s == "mmap")
+        return io_mode::mmap;
+    else if (s == "pread")
+        return io_mode::pread;
+    else if (s == "io_uring")
+        return io_mode::io_uring;
+    else
+        return nullopt;
+}
+
+file_contents::file_contents(file_contents&& f) noexcept :
+    sp(f.sp), map(f.map), map_length(f.map_length), buf(move(f.buf)), st(f.st), error(move(f.error)),
+    stream_fd(f.stream_fd) {
+    f.map = nullptr;
+    f.stream_fd = -1;
+}
+
+file_contents& file_contents::operator=(file_contents&& f) noexcept {
+    if (map)
+        munmap(map, map_length);
+
+    if (stream_fd != -1)
+        close(stream_fd);
+
+    sp = f.sp;
+    map = f.map;
+    map_length = f.map_length;
+    buf = move(f.buf);
+    st = f.st;
+    error = move(f.error);
+    stream_fd = f.stream_fd;
+
+    f.map = nullptr;
+    f.stream_fd = -1;
+
+    return *this;
+}
+
+file_contents::~file_contents() {
+    if (map)
+        munmap(map, map_length);
+
+    if (stream_fd != -1)
+        close(stream_fd);
+}
+
+file_error::file_error(const char* op, int err) :
+    runtime_error(string(op) + " failed (errno " + to_string(err) + ")"), op(op), err(err) {
+}
+
+string file_error::describe(const filesystem::path& fn) const {
+    return string(op) + " of " + fn.string() + " failed (errno " + to_string(err) + ")";
+}
+
+size_t file_contents::read_stream(span<uint8_t> buf) const {
+    while (true) {
+        auto ret = ::read(stream_fd, buf.data(), buf.size());
+
+        if (ret != -1)
+            return (size_t)ret;
+
+        if (errno != EINTR)
+            throw file_error("read", errno);
+    }
+}
+
+// A read of a whole file into memory.
+struct read_request {
+    int fd;
+    uint8_t* buf;
+    size_t length;
+    size_t done = 0;
+    int err = 0;
+};
+
+// Reads up to length bytes, stopping early if the file turns out to be
+// shorter than it was.
+static void pread_all(read_request& r) {
+    while (r.done < r.length) {
+        auto ret = pread(r.fd, r.buf + r.done, r.length - r.done, (off_t)r.done);
+
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            r.err = errno;
+            return;
+        }
+
+        if (ret == 0) {
+            r.length = r.done;
+            return;
+        }
+
+        r.done += (size_t)ret;
+    }
+}
+
+#ifdef NYAN_IO_URING
+
+// A minimal io_uring, set up with the raw system calls so that we don't need
+// liburing. All it knows how to do is read files.
+class io_ring {
+public:
+    explicit io_ring(unsigned int entries) {
+        io_uring_params p;
+
+        memset(&p, 0, sizeof(p));
+
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+
+        if (fd < 0)
+            throw runtime_error("io_uring_setup failed (errno " + to_string(errno) + ")");
+
+        sq_len = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+        cq_len = p.cq_off.cqes + (p.cq_entries * sizeof(io_uring_cqe));
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_len = cq_len = max(sq_len, cq_len);
+
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            auto err = errno;
+            close(fd);
+            throw runtime_error("mmap of io_uring failed (errno " + to_string(err) + ")");
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr = sq_ptr;
+        else {
+            cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                auto err = errno;
+                munmap(sq_ptr, sq_len);
+                close(fd);
+                throw runtime_error("mmap of io_uring failed (errno " + to_string(err) + ")");
+            }
+        }
+
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            auto err = errno;
+
+            if (cq_ptr != sq_ptr)
+                munmap(cq_ptr, cq_len);
+
+            munmap(sq_ptr, sq_len);
+            close(fd);
+            throw runtime_error("mmap of io_uring failed (errno " + to_string(err) + ")");
+        }
+
+        auto sq = (uint8_t*)sq_ptr;
+        auto cq = (uint8_t*)cq_ptr;
+
+        sq_head = (uint32_t*)(sq + p.sq_off.head);
+        sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+        sq_mask = *(uint32_t*)(sq + p.sq_off.ring_mask);
+        sq_array = (uint32_t*)(sq + p.sq_off.array);
+        cq_head = (uint32_t*)(cq + p.cq_off.head);
+        cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+        cq_mask = *(uint32_t*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        num_entries = p.sq_entries;
+    }
+
+    ~io_ring() {
+        munmap(sqes, sqes_len);
+
+        if (cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_len);
+
+        munmap(sq_ptr, sq_len);
+        close(fd);
+    }
+
+    // Carries out all the reads, keeping as many in flight as the ring has
+    // room for. Short reads are resubmitted for the rest.
+    void read_all(span<read_request> reqs) {
+        vector<uint32_t> queue;
+        size_t queue_pos = 0;
+        unsigned int in_flight = 0;
+
+        for (uint32_t i = 0; i < reqs.size(); i++) {
+            if (reqs[i].length != 0)
+                queue.push_back(i);
+        }
+
+        while (queue_pos < queue.size() || in_flight > 0) {
+            auto tail = *sq_tail;
+
+            while (queue_pos < queue.size() && in_flight < num_entries) {
+                auto& r = reqs[queue[queue_pos]];
+                auto idx = tail & sq_mask;
+                auto& sqe = sqes[idx];
+
+                memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = IORING_OP_READ;
+                sqe.fd = r.fd;
+                sqe.addr = (uintptr_t)(r.buf + r.done);
+                sqe.len = (uint32_t)min(r.length - r.done, (size_t)0x40000000);
+                sqe.off = r.done;
+                sqe.user_data = queue[queue_pos];
+
+                sq_array[idx] = idx;
+                tail++;
+                queue_pos++;
+                in_flight++;
+            }
+
+            atomic_ref(*sq_tail).store(tail, memory_order_release);
+
+            auto to_submit = tail - atomic_ref(*sq_head).load(memory_order_acquire);
+            auto ret = syscall(__NR_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+            if (ret < 0 && errno != EINTR)
+                throw runtime_error("io_uring_enter failed (errno " + to_string(errno) + ")");
+
+            auto head = *cq_head;
+            auto cq_end = atomic_ref(*cq_tail).load(memory_order_acquire);
+
+            while (head != cq_end) {
+                const auto& cqe = cqes[head & cq_mask];
+                auto& r = reqs[cqe.user_data];
+
+                if (cqe.res < 0)
+                    r.err = -cqe.res;
+                else if (cqe.res == 0)
+                    r.length = r.done;
+                else {
+                    r.done += (size_t)cqe.res;
+
+                    if (r.done < r.length)
+                        queue.push_back((uint32_t)cqe.user_data);
+                }
+
+                head++;
+                in_flight--;
+            }
+
+            atomic_ref(*cq_head).store(head, memory_order_release);
+        }
+    }
+
+private:
+    int fd;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    io_uring_sqe* sqes;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    io_uring_cqe* cqes;
+    unsigned int num_entries;
+};
+
+#else
+
+class io_ring {
+public:
+    explicit io_ring(unsigned int) {
+        throw runtime_error("io_uring not supported");
+    }
+
+    void read_all(span<read_request>) {
+    }
+};
+
+#endif
+
+// Setting up a ring isn't free, and a reader may only be used for a few
+// files, so each thread holds on to the last one it had.
+static thread_local unique_ptr<io_ring> spare_ring;
+static thread_local bool ring_unavailable = false;
+
+file_reader::file_reader(io_mode mode) : mode(mode) {
+    if (mode != io_mode::automatic && mode != io_mode::io_uring)
+        return;
+
+    if (spare_ring) {
+        ring = move(spare_ring);
+        return;
+    }
+
+    // if io_uring isn't available, or we're not allowed to use it, we
+    // quietly fall back to pread
+
+    if (ring_unavailable)
+        return;
+
+    try {
+        ring.reset(new io_ring(MAX_BATCH_FILES));
+    } catch (const exception&) {
+        ring_unavailable = true;
+    }
+}
+
+file_reader::~file_reader() {
+    if (ring && !spare_ring)
+        spare_ring = move(ring);
+}
+
+size_t file_reader::read(span<const filesystem::path> fns, vector<file_contents>& out) {
+    vector<read_request> reqs;
+    vector<size_t> req_files, buf_offsets;
+    size_t buf_size = 0, read_size = 0;
+
+    out.clear();
+
+    for (const auto& fn : fns) {
+        if (out.size() == MAX_BATCH_FILES)
+            break;
+
+        file_contents fc;
+        int fd;
+
+        if (fn == "-")
+            fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+        else
+            fd = open(fn.string().c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd == -1) {
+            fc.error = make_exception_ptr(file_error("open", errno));
+            out.push_back(move(fc));
+            continue;
+        }
+
+        if (fstat(fd, &fc.st) == -1) {
+            fc.error = make_exception_ptr(file_error("fstat", errno));
+            close(fd);
+            out.push_back(move(fc));
+            continue;
+        }
+
+        if (S_ISFIFO(fc.st.st_mode) || S_ISCHR(fc.st.st_mode) || S_ISSOCK(fc.st.st_mode)) {
+            fc.stream_fd = fd;
+            out.push_back(move(fc));
+            continue;
+        }
+
+        size_t length = fc.st.st_size;
+        bool small = length <= SMALL_FILE_SIZE;
+
+        if (length == 0)
+            close(fd);
+        else if (mode == io_mode::mmap || (mode == io_mode::automatic && !small)) {
+            auto addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr == MAP_FAILED)
+                fc.error = make_exception_ptr(file_error("mmap", errno));
+            else {
+                // Hashing goes through files from start to end, so ask the
+                // kernel to read ahead aggressively, and to start now.
+                madvise(addr, length, MADV_SEQUENTIAL);
+                madvise(addr, length, MADV_WILLNEED);
+
+                fc.map = addr;
+                fc.map_length = length;
+                fc.sp = span((const uint8_t*)addr, length);
+            }
+
+            close(fd);
+        } else {
+            // leave the rest for the next batch, unless this is the only file
+            if (read_size + length > MAX_BATCH_BUFFER && !reqs.empty()) {
+                close(fd);
+                break;
+            }
+
+            // Small files share the reader's buffer, which we don't know the
+            // location of yet. Large ones get a buffer of their own.
+
+            if (small) {
+                reqs.push_back({ fd, nullptr, length });
+                buf_offsets.push_back(buf_size);
+                buf_size += length;
+            } else {
+                fc.buf.resize(length);
+                reqs.push_back({ fd, fc.buf.data(), length });
+                buf_offsets.push_back(SIZE_MAX);
+            }
+
+            req_files.push_back(out.size());
+            read_size += length;
+        }
+
+        out.push_back(move(fc));
+    }
+
+    if (reqs.empty())
+        return out.size();
+
+    if (buf.size() < buf_size)
+        buf.resize(buf_size);
+
+    for (size_t i = 0; i < reqs.size(); i++) {
+        if (buf_offsets[i] != SIZE_MAX)
+            reqs[i].buf = buf.data() + buf_offsets[i];
+    }
+
+    try {
+        if (ring && mode != io_mode::pread)
+            ring->read_all(reqs);
+        else {
+            for (auto& r : reqs) {
+                pread_all(r);
+            }
+        }
+    } catch (...) {
+        for (const auto& r : reqs) {
+            close(r.fd);
+        }
+
+        throw;
+    }
+
+    for (size_t i = 0; i < reqs.size(); i++) {
+        const auto& r = reqs[i];
+        auto& fc = out[req_files[i]];
+
+        close(r.fd);
+
+        if (r.err != 0)
+            fc.error = make_exception_ptr(file_error("read", r.err));
+        else
+            fc.sp = span(r.buf, r.length);
+    }
+
+    return out.size();
+}
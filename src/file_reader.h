@@ -0,0 +1,120 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <filesystem>
+#include <exception>
+#include <optional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <span>
+
+// How files get read. automatic maps large files, and reads small ones together
+// through io_uring, or with pread if io_uring isn't available. The others read
+// everything the same way.
+enum class io_mode {
+    automatic,
+    mmap,
+    pread,
+    io_uring
+};
+
+std::optional<io_mode> parse_io_mode(std::string_view s);
+
+// A system call which failed on a file, e.g. "open failed (errno 2)". The
+// message leaves out the file, as the tools print its name alongside; where
+// they don't, describe() gives one which includes it.
+class file_error : public std::runtime_error {
+public:
+    file_error(const char* op, int err);
+
+    std::string describe(const std::filesystem::path& fn) const;
+
+private:
+    const char* op;
+    int err;
+};
+
+// The contents of a file, which have either been read into memory or mapped.
+class file_contents {
+public:
+    file_contents() = default;
+    file_contents(file_contents&& f) noexcept;
+    file_contents& operator=(file_contents&& f) noexcept;
+    ~file_contents();
+
+    // Throws if the file couldn't be opened or read.
+    std::span<const uint8_t> data() const {
+        if (error)
+            std::rethrow_exception(error);
+
+        if (stream_fd != -1)
+            throw std::runtime_error("Not a regular file.");
+
+        return sp;
+    }
+
+    // Pipes and devices, including stdin, can't be mapped or read in one go,
+    // so they are left open for the caller to read a piece at a time.
+    bool is_stream() const {
+        return stream_fd != -1;
+    }
+
+    // Reads the next part of a stream into buf, returning 0 at the end.
+    size_t read_stream(std::span<uint8_t> buf) const;
+
+    // The stat of the file as it was opened.
+    const struct stat& file_stat() const {
+        return st;
+    }
+
+private:
+    friend class file_reader;
+
+    std::span<const uint8_t> sp;
+    void* map = nullptr;
+    size_t map_length = 0;
+    std::vector<uint8_t> buf;
+    struct stat st;
+    std::exception_ptr error;
+    int stream_fd = -1;
+};
+
+class io_ring;
+
+// Opens and reads files, choosing how according to the mode and their sizes.
+// Small files are read into a buffer belonging to the reader, which is reused
+// by the next call to read(). A filename of - means stdin.
+class file_reader {
+public:
+    explicit file_reader(io_mode mode);
+    ~file_reader();
+
+    // Reads as many files from the start of fns as make up a batch, and
+    // returns how many that was. Errors are returned in the file_contents
+    // rather than thrown.
+    size_t read(std::span<const std::filesystem::path> fns, std::vector<file_contents>& out);
+
+private:
+    io_mode mode;
+    std::vector<uint8_t> buf;
+    std::unique_ptr<io_ring> ring;
+};
@@ -17,514 +17,489 @@
 
 #include <filesystem>
 #include <iostream>
-#include <fstream>
+#include <memory>
 #include <charconv>
-#include <vector>
-#include <unordered_map>
-#include <random>
 #include <format>
-#include "cat.h"
+#include <thread>
+#include <optional>
+#include <functional>
+#include <unordered_set>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include "cdf.h"
+#include "daemon.h"
+#include "depfile.h"
+#include "digest_cache.h"
+#include "thread_pool.h"
 #include "sha1.h"
 #include "sha256.h"
 #include "config.h"
 
 using namespace std;
 
-enum class cdf_section {
-    none,
-    CatalogHeader,
-    CatalogFiles
-};
-
-enum class cdf_algorithm {
-    none,
-    SHA1,
-    SHA256
-};
-
-static constexpr size_t utf8_to_utf16_len(string_view sv) noexcept {
-    size_t ret = 0;
-
-    while (!sv.empty()) {
-        if ((uint8_t)sv[0] < 0x80) {
-            ret++;
-            sv = sv.substr(1);
-        } else if (((uint8_t)sv[0] & 0xe0) == 0xc0 && (uint8_t)sv.length() >= 2 && ((uint8_t)sv[1] & 0xc0) == 0x80) {
-            ret++;
-            sv = sv.substr(2);
-        } else if (((uint8_t)sv[0] & 0xf0) == 0xe0 && (uint8_t)sv.length() >= 3 && ((uint8_t)sv[1] & 0xc0) == 0x80 && ((uint8_t)sv[2] & 0xc0) == 0x80) {
-            ret++;
-            sv = sv.substr(3);
-        } else if (((uint8_t)sv[0] & 0xf8) == 0xf0 && (uint8_t)sv.length() >= 4 && ((uint8_t)sv[1] & 0xc0) == 0x80 && ((uint8_t)sv[2] & 0xc0) == 0x80 && ((uint8_t)sv[3] & 0xc0) == 0x80) {
-            char32_t cp = (char32_t)(((uint8_t)sv[0] & 0x7) << 18) | (char32_t)(((uint8_t)sv[1] & 0x3f) << 12) | (char32_t)(((uint8_t)sv[2] & 0x3f) << 6) | (char32_t)((uint8_t)sv[3] & 0x3f);
-
-            if (cp > 0x10ffff) {
-                ret++;
-                sv = sv.substr(4);
-                continue;
-            }
+// Opens the catalogue file and calls func to write to it. The catalogue is
+// streamed to the file as it's written, so if anything goes wrong we remove it
+// rather than leave half of one.
+static void write_output(const filesystem::path& outfn, const function<void(int)>& func) {
+    int fd = open(outfn.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-            ret += 2;
-            sv = sv.substr(4);
-        } else {
-            ret++;
-            sv = sv.substr(1);
-        }
-    }
+    // FIXME - better error messages
+    if (fd == -1)
+        throw runtime_error("Could not open " + outfn.string() + " for writing.");
 
-    return ret;
-}
+    try {
+        func(fd);
 
-template<typename T>
-requires (ranges::output_range<T, char16_t> && is_same_v<ranges::range_value_t<T>, char16_t>) ||
-    (sizeof(wchar_t) == 2 && ranges::output_range<T, wchar_t> && is_same_v<ranges::range_value_t<T>, wchar_t>)
-static constexpr void utf8_to_utf16_range(string_view sv, T& t) noexcept {
-    auto ptr = t.begin();
+        if (close(fd) == -1) {
+            fd = -1;
+            throw runtime_error("close of " + outfn.string() + " failed (errno " + to_string(errno) + ")");
+        }
+    } catch (...) {
+        if (fd != -1)
+            close(fd);
 
-    if (ptr == t.end())
-        return;
+        error_code ec;
+        filesystem::remove(outfn, ec);
 
-    while (!sv.empty()) {
-        if ((uint8_t)sv[0] < 0x80) {
-            *ptr = (uint8_t)sv[0];
-            ptr++;
+        throw;
+    }
+}
 
-            if (ptr == t.end())
-                return;
+// When there's more than one CDF, we say which one went wrong.
+static void report_error(const filesystem::path& fn, bool several, const exception& e) {
+    if (several)
+        cerr << "Exception: " << fn.string() << ": " << e.what() << endl;
+    else
+        cerr << "Exception: " << e.what() << endl;
+}
 
-            sv = sv.substr(1);
-        } else if (((uint8_t)sv[0] & 0xe0) == 0xc0 && (uint8_t)sv.length() >= 2 && ((uint8_t)sv[1] & 0xc0) == 0x80) {
-            char16_t cp = (char16_t)(((uint8_t)sv[0] & 0x1f) << 6) | (char16_t)((uint8_t)sv[1] & 0x3f);
+// Records for -MD that the catalogue was made from the CDF and inputs. The
+// target is the catalogue, unless -MT gave another.
+static void add_deps(depfile* deps, const char* dep_target, const filesystem::path& outfn,
+                     const filesystem::path& fn, vector<filesystem::path>& inputs) {
+    if (!deps)
+        return;
 
-            *ptr = cp;
-            ptr++;
+    if (fn != "-")
+        inputs.insert(inputs.begin(), fn);
 
-            if (ptr == t.end())
-                return;
+    deps->add(dep_target ? dep_target : outfn, inputs);
+}
 
-            sv = sv.substr(2);
-        } else if (((uint8_t)sv[0] & 0xf0) == 0xe0 && (uint8_t)sv.length() >= 3 && ((uint8_t)sv[1] & 0xc0) == 0x80 && ((uint8_t)sv[2] & 0xc0) == 0x80) {
-            char16_t cp = (char16_t)(((uint8_t)sv[0] & 0xf) << 12) | (char16_t)(((uint8_t)sv[1] & 0x3f) << 6) | (char16_t)((uint8_t)sv[2] & 0x3f);
+// Has nyand make the catalogue. The CDF is still parsed here, so that we know
+// where the catalogue goes and can report any mistakes in it ourselves.
+static void make_cat_daemon(const filesystem::path& fn, daemon_client& client, depfile* deps,
+                            const char* dep_target) {
+    cdf_file f(fn);
+    vector<filesystem::path> inputs;
 
-            if (cp >= 0xd800 && cp <= 0xdfff) {
-                *ptr = 0xfffd;
-                ptr++;
+    auto c = parse_cdf(f.text());
+    auto outfn = c.output_path();
 
-                if (ptr == t.end())
-                    return;
+    write_output(outfn, [&](int fd) {
+        inputs = client.makecat(f.text(), filesystem::current_path(), fd);
+    });
 
-                sv = sv.substr(3);
-                continue;
-            }
+    add_deps(deps, dep_target, outfn, fn, inputs);
+}
 
-            *ptr = cp;
-            ptr++;
+// Makes the catalogues for all the CDFs in fns, returning false if any of them
+// failed. Every file is hashed once up front, on the one pool, so that a file
+// listed by several catalogues isn't hashed for each of them.
+static bool make_cats(span<const filesystem::path> fns, unsigned int num_threads, digest_cache* cache, io_mode io,
+                      depfile* deps, const char* dep_target) {
+    thread_pool pool(num_threads);
+    vector<optional<cdf>> cdfs(fns.size());
+    bool success = true;
+
+    for (size_t i = 0; i < fns.size(); i++) {
+        try {
+            cdf_file f(fns[i]);
+
+            cdfs[i] = parse_cdf(f.text());
+        } catch (const exception& e) {
+            report_error(fns[i], fns.size() > 1, e);
+            success = false;
+        }
+    }
 
-            if (ptr == t.end())
-                return;
+    // With one catalogue there's nothing to share, so we leave the hashing
+    // to write_cat, which does the same thing.
 
-            sv = sv.substr(3);
-        } else if (((uint8_t)sv[0] & 0xf8) == 0xf0 && (uint8_t)sv.length() >= 4 && ((uint8_t)sv[1] & 0xc0) == 0x80 && ((uint8_t)sv[2] & 0xc0) == 0x80 && ((uint8_t)sv[3] & 0xc0) == 0x80) {
-            char32_t cp = (char32_t)(((uint8_t)sv[0] & 0x7) << 18) | (char32_t)(((uint8_t)sv[1] & 0x3f) << 12) | (char32_t)(((uint8_t)sv[2] & 0x3f) << 6) | (char32_t)((uint8_t)sv[3] & 0x3f);
+    if (cache && fns.size() > 1) {
+        for (auto algorithm : { cdf_algorithm::SHA1, cdf_algorithm::SHA256 }) {
+            for (auto page_hashes : { false, true }) {
+                vector<cat_entry> entries;
+                unordered_set<string_view> seen;
 
-            if (cp > 0x10ffff) {
-                *ptr = 0xfffd;
-                ptr++;
+                for (const auto& c : cdfs) {
+                    if (!c || c->algorithm != algorithm || c->page_hashes != page_hashes)
+                        continue;
 
-                if (ptr == t.end())
-                    return;
+                    for (const auto& ent : c->files) {
+                        if (seen.insert(ent.fn.native()).second)
+                            entries.emplace_back(ent.fn);
+                    }
+                }
 
-                sv = sv.substr(4);
-                continue;
+                if (algorithm == cdf_algorithm::SHA1)
+                    cache_file_hashes<sha1_hasher>(entries, page_hashes, pool, *cache, io);
+                else
+                    cache_file_hashes<sha256_hasher>(entries, page_hashes, pool, *cache, io);
             }
+        }
+    }
 
-            cp -= 0x10000;
-
-            *ptr = (char16_t)(0xd800 | (cp >> 10));
-            ptr++;
-
-            if (ptr == t.end())
-                return;
-
-            *ptr = (char16_t)(0xdc00 | (cp & 0x3ff));
-            ptr++;
-
-            if (ptr == t.end())
-                return;
+    for (size_t i = 0; i < fns.size(); i++) {
+        if (!cdfs[i])
+            continue;
 
-            sv = sv.substr(4);
-        } else {
-            *ptr = 0xfffd;
-            ptr++;
+        try {
+            auto outfn = cdfs[i]->output_path();
+            vector<filesystem::path> inputs;
 
-            if (ptr == t.end())
-                return;
+            write_output(outfn, [&](int fd) {
+                write_cat(move(*cdfs[i]), fd, num_threads, cache, io, &pool, &inputs);
+            });
 
-            sv = sv.substr(1);
+            add_deps(deps, dep_target, outfn, fns[i], inputs);
+        } catch (const exception& e) {
+            report_error(fns[i], fns.size() > 1, e);
+            success = false;
         }
     }
-}
 
-static constexpr u16string utf8_to_utf16(string_view sv) {
-    if (sv.empty())
-        return u"";
+    return success;
+}
 
-    u16string ret(utf8_to_utf16_len(sv), 0);
+// Makes a catalogue from a CDF on stdin, writing it to stdout. This is meant
+// for the CDF being piped from whatever is generating it, so rather than wait
+// for the end, the files are hashed into the cache as they're listed, while
+// the rest is still being read. The CDF is only properly parsed once it's all
+// there, and anything which wasn't hashed early is hashed then.
+static void make_cat_stdin(unsigned int num_threads, digest_cache& cache, io_mode io, depfile* deps,
+                           const char* dep_target) {
+    thread_pool pool(num_threads);
+    string text;
+    mutex m;
+    condition_variable cv;
+    vector<cat_entry> queued;
+    optional<pair<cdf_algorithm, bool>> settings;
+    bool eof = false;
+    exception_ptr read_error;
+
+    if (isatty(STDOUT_FILENO))
+        throw runtime_error("Not writing catalogue to a terminal.");
+
+    thread reader([&]() {
+        cdf_scanner scanner;
+        size_t scanned = 0;
+        bool tried_header = false;
+
+        try {
+            while (true) {
+                char buf[65536];
+
+                auto ret = read(STDIN_FILENO, buf, sizeof(buf));
+
+                if (ret == -1) {
+                    if (errno == EINTR)
+                        continue;
+
+                    throw runtime_error("read of stdin failed (errno " + to_string(errno) + ")");
+                }
 
-    utf8_to_utf16_range(sv, ret);
+                if (ret == 0)
+                    break;
 
-    return ret;
-}
+                text.append(buf, (size_t)ret);
 
-struct string_hash {
-    using hash_type = hash<string_view>;
-    using is_transparent = void;
+                lock_guard lg(m);
 
-    size_t operator()(const char* str) const {
-        return hash_type{}(str);
-    }
+                for (auto nl = text.find('\n', scanned); nl != string::npos; nl = text.find('\n', scanned)) {
+                    auto line = string_view(text).substr(scanned, nl - scanned);
+                    auto fn = scanner.next_line(line);
 
-    size_t operator()(string_view str) const {
-        return hash_type{}(str);
-    }
+                    // The header tells us how the files are to be hashed, so
+                    // when we get to them we parse what we've got so far. If
+                    // it's changed later on, whatever we hash now won't match
+                    // and will just be hashed again.
 
-    size_t operator()(const string& str) const {
-        return hash_type{}(str);
-    }
-};
-
-static void parse_attribute(vector<cat_extension>& attributes, string_view value, unsigned int line_no) {
-    string_view type, oid, val;
-    unsigned int type_num;
-
-    if (auto colon = value.find(':'); colon != string::npos) {
-        type = value.substr(0, colon);
-        oid = value.substr(colon + 1);
-    } else
-        throw runtime_error("Line " + to_string(line_no) + ": ATTR value must have form {type}:{oid}:{value}.");
-
-    if (auto colon = oid.find(':'); colon != string::npos) {
-        val = oid.substr(colon + 1);
-        oid = oid.substr(0, colon);
-    } else
-        throw runtime_error("Line " + to_string(line_no) + ": ATTR value must have form {type}:{oid}:{value}.");
-
-    if (type.substr(0, 2) == "0x") {
-        auto [ptr, ec] = from_chars(type.begin() + 2, type.end(), type_num, 16);
-
-        if (ptr != type.end())
-            throw runtime_error("Line " + to_string(line_no) + ": could not parse type " + string(type) + " as integer.");
-    } else {
-        auto [ptr, ec] = from_chars(type.begin(), type.end(), type_num);
-
-        if (ptr != value.end())
-            throw runtime_error("Line " + to_string(line_no) + ": could not parse type " + string(type) + " as integer.");
-    }
+                    if (scanner.in_files() && !tried_header) {
+                        tried_header = true;
 
-    if (type_num & 0x00020000)
-        throw runtime_error("Line " + to_string(line_no) + ": base64 values not yet supported.");
+                        try {
+                            auto c = parse_cdf(string_view(text).substr(0, scanned));
 
-    if (type_num & 0x00000002)
-        throw runtime_error("Line " + to_string(line_no) + ": OIDs not yet supported.");
+                            settings = make_pair(c.algorithm, c.page_hashes);
+                        } catch (...) {
+                        }
+                    }
 
-    attributes.emplace_back(oid, type_num, utf8_to_utf16(val));
-}
+                    scanned = nl + 1;
 
-// FIXME - is this actually random, or should it be a hash? (Does it matter?)
-static vector<uint8_t> create_identifier() {
-    random_device dev;
-    mt19937 rng(dev());
-    uniform_int_distribution<mt19937::result_type> dist(0, 0xffffffff);
-    vector<uint8_t> ret;
+                    if (fn && settings)
+                        queued.emplace_back(move(*fn));
+                }
 
-    ret.reserve(16);
+                if (!queued.empty())
+                    cv.notify_one();
+            }
+        } catch (...) {
+            read_error = current_exception();
+        }
 
-    for (unsigned int i = 0; i < 4; i++) {
-        auto v = (uint32_t)dist(rng);
+        lock_guard lg(m);
 
-        auto sp = span((uint8_t*)&v, sizeof(uint32_t));
+        eof = true;
+        cv.notify_one();
+    });
 
-        ret.insert(ret.end(), sp.begin(), sp.end());
-    }
+    // Whatever has been listed since the last batch makes up the next one, so
+    // batches grow when the hashing is slower than the CDF is arriving.
 
-    return ret;
-}
+    while (true) {
+        vector<cat_entry> batch;
 
-static void make_cat(const filesystem::path& fn) {
-    ifstream f(fn);
+        {
+            unique_lock lock(m);
 
-    // FIXME - throw more descriptive error message (not found, access denied, etc.)
-    if (!f.is_open())
-        throw runtime_error("Could not open " + fn.string() + " for reading.");
+            cv.wait(lock, [&]() { return eof || !queued.empty(); });
 
-    enum cdf_section sect = cdf_section::none;
-    unsigned int line_no = 0;
-    string cat_name, result_dir;
-    unsigned int catalogue_version = 0;
-    enum cdf_algorithm algo = cdf_algorithm::none;
-    bool do_page_hashes = false;
-    unsigned int encoding_type = 0x00010001; // PKCS_7_ASN_ENCODING | X509_ASN_ENCODING
-    vector<cat_extension> attributes;
-    unordered_map<string, cat_entry, string_hash, equal_to<>> entries;
-
-    while (!f.eof()) {
-        string line;
+            if (queued.empty())
+                break;
 
-        getline(f, line);
-        line_no++;
+            swap(batch, queued);
+        }
 
-        if (line.empty())
-            continue;
+        if (settings->first == cdf_algorithm::SHA1)
+            cache_file_hashes<sha1_hasher>(batch, settings->second, pool, cache, io);
+        else
+            cache_file_hashes<sha256_hasher>(batch, settings->second, pool, cache, io);
+    }
 
-        if (line.front() == '[') {
-            auto end = line.find(']');
+    reader.join();
 
-            if (end == string::npos)
-                throw runtime_error("Line " + to_string(line_no) + ": square brackets not terminated.");
+    if (read_error)
+        rethrow_exception(read_error);
 
-            auto sectname = string_view(line.data() + 1, end - 1);
+    vector<filesystem::path> inputs;
 
-            if (sectname == "CatalogHeader")
-                sect = cdf_section::CatalogHeader;
-            else if (sectname == "CatalogFiles")
-                sect = cdf_section::CatalogFiles;
-            else
-                throw runtime_error("Line " + to_string(line_no) + ": unrecognized section name " + string(sectname) + ".");
+    write_cat(parse_cdf(text), STDOUT_FILENO, num_threads, &cache, io, &pool, &inputs);
 
-            continue;
-        }
+    add_deps(deps, dep_target, {}, "-", inputs);
+}
 
-        auto sv = string_view(line);
+// Adds fn to fns, or if it's a directory, all the CDFs within it.
+static void add_cdfs(const filesystem::path& fn, vector<filesystem::path>& fns) {
+    if (fn == "-" || !filesystem::is_directory(fn)) {
+        fns.push_back(fn);
+        return;
+    }
 
-        while (!sv.empty() && (sv.front() == ' ' || sv.front() == '\t')) {
-            sv = sv.substr(1);
-        }
+    vector<filesystem::path> found;
 
-        while (!sv.empty() && (sv.back() == ' ' || sv.back() == '\t' || sv.back() == '\r')) {
-            sv = sv.substr(0, sv.size() - 1);
-        }
+    for (const auto& ent : filesystem::directory_iterator(fn)) {
+        auto ext = ent.path().extension().string();
 
-        if (sv.empty())
+        if (!ent.is_regular_file() || ext.size() != 4 || strcasecmp(ext.c_str(), ".cdf"))
             continue;
 
-        // FIXME - can we have comments?
-
-        auto eq = sv.find('=');
-
-        if (eq == string::npos)
-            throw runtime_error("Line " + to_string(line_no) + ": error while parsing.");
-
-        auto name = sv.substr(0, eq);
-        auto value = sv.substr(eq + 1);
-
-        switch (sect) {
-            case cdf_section::none:
-                throw runtime_error("Line " + to_string(line_no) + ": name-value pair outside of section.");
-
-            case cdf_section::CatalogHeader:
-                if (name == "Name")
-                    cat_name = value;
-                else if (name == "ResultDir")
-                    result_dir = value;
-                else if (name == "CatalogVersion") {
-                    if (value.empty())
-                        break;
-
-                    auto [ptr, ec] = from_chars(value.begin(), value.end(), catalogue_version);
-
-                    if (ptr != value.end())
-                        throw runtime_error("Line " + to_string(line_no) + ": could not parse " + string(value) + " as integer.");
-
-                    if (catalogue_version != 1 && catalogue_version != 2)
-                        throw runtime_error("Line " + to_string(line_no) + ": invalid value " + to_string(catalogue_version) + " for CatalogVersion.");
-                } else if (name == "HashAlgorithms") {
-                    if (value.empty())
-                        algo = cdf_algorithm::none;
-                    else if (value == "SHA1")
-                        algo = cdf_algorithm::SHA1;
-                    else if (value == "SHA256")
-                        algo = cdf_algorithm::SHA256;
-                    else
-                        throw runtime_error("Line " + to_string(line_no) + ": invalid value " + string(value) + " for HashAlgorithms.");
-                } else if (name == "PageHashes") {
-                    if (value == "true")
-                        do_page_hashes = true;
-                    else if (value == "false")
-                        do_page_hashes = false;
-                    else
-                        throw runtime_error("Line " + to_string(line_no) + ": invalid value " + string(value) + " for PageHashes.");
-                } else if (name == "EncodingType") {
-                    if (value.substr(0, 2) == "0x") {
-                        auto [ptr, ec] = from_chars(value.begin() + 2, value.end(), encoding_type, 16);
-
-                        if (ptr != value.end())
-                            throw runtime_error("Line " + to_string(line_no) + ": could not parse " + string(value) + " as integer.");
-                    } else {
-                        auto [ptr, ec] = from_chars(value.begin(), value.end(), encoding_type);
-
-                        if (ptr != value.end())
-                            throw runtime_error("Line " + to_string(line_no) + ": could not parse " + string(value) + " as integer.");
-                    }
+        found.push_back(ent.path());
+    }
 
-                    if (encoding_type != 0x00010001)
-                        throw runtime_error("Line " + to_string(line_no) + ": unsupported value " + string(value) + " for EncodingType.");
-                } else if (name.substr(0, 7) == "CATATTR")
-                    parse_attribute(attributes, value, line_no);
-                else
-                    throw runtime_error("Line " + to_string(line_no) + ": unrecognized option " + string(name) + " in CatalogHeader section.");
-            break;
+    if (found.empty())
+        throw runtime_error("No CDF files found in " + fn.string() + ".");
 
-            case cdf_section::CatalogFiles:
-                if (name.size() > 8 && name.substr(name.size() - 8) == "ALTSIPID")
-                    throw runtime_error("Line " + to_string(line_no) + ": ALTSIPID not yet supported.");
+    sort(found.begin(), found.end());
 
-                if (auto attr = name.find("ATTR"); attr != string::npos) {
-                    auto [ptr, ec] = from_chars(name.begin() + attr + 4, name.end(), encoding_type, 16);
+    fns.insert(fns.end(), found.begin(), found.end());
+}
 
-                    if (ptr == name.end() && entries.count(name.substr(0, attr)) != 0) {
-                        auto it = entries.find(name.substr(0, attr));
-                        auto& ent = it->second;
+int main(int argc, char* argv[]) {
+    if (argc < 2 || !strcmp(argv[1], "--help") || !strcmp(argv[1], "-?")) {
+        cerr << format(R"(Usage: {} [OPTION]... FILE...
+Creates catalogue files from CDF files. A FILE which is a directory stands for
+all the .cdf files in it. Files listed by more than one CDF are only hashed
+once. If FILE is -, the CDF is read from stdin and the catalogue written to
+stdout, with the files being hashed as they're listed. This is always done
+here rather than by nyand.
+
+      -j N          hash files using N threads (default: number of CPUs)
+      --cache FILE  remember the hashes of files in FILE, and reuse them if
+                      the files haven't changed
+      --io MODE     how to read files: auto (the default), mmap, pread, or
+                      io_uring
+      --no-daemon   make the catalogue ourselves, even if nyand is running
+      -MD FILE      write the files each catalogue was made from to FILE, as
+                      a dependency file for Make or Ninja
+      -MT TARGET    name TARGET in the dependency file, rather than the
+                      catalogue (needed if reading from stdin)
+      --help, -?    display this help and exit
+      --version     output version information and exit
 
-                        parse_attribute(ent.extensions, value, line_no);
-                        break;
-                    }
-                }
+If nyand is running, the catalogue is made by it, and its cache is used
+rather than the one given by --cache.
+)", argv[0]);
 
-                if (entries.count(name) != 0)
-                    throw runtime_error("Line " + to_string(line_no) + ": file " + string(name) + " already set.");
+        return 1;
+    }
 
-                if constexpr (filesystem::path::preferred_separator != '\\') {
-                    string value2;
+    if (!strcmp(argv[1], "--version")) {
+        cerr << "makecat " << PROJECT_VERSION_MAJOR << endl;
+        cerr << "Copyright (c) Mark Harmstone 2024" << endl;
+        return 1;
+    }
 
-                    value2.reserve(value.size());
+    // FIXME - parse options (-v, -r, -n)
 
-                    for (auto c : value) {
-                        if (c == '\\')
-                            value2 += filesystem::path::preferred_separator;
-                        else
-                            value2 += c;
-                    }
+    unsigned int num_threads = max(thread::hardware_concurrency(), 1u);
+    const char* cache_fn = nullptr;
+    io_mode io = io_mode::automatic;
+    bool use_daemon = true;
+    const char* depfile_fn = nullptr;
+    const char* dep_target = nullptr;
+    int arg = 1;
 
-                    entries.emplace(make_pair(name, value2));
-                } else
-                    entries.emplace(make_pair(name, value));
-            break;
-        }
-    }
+    while (arg < argc && argv[arg][0] == '-' && argv[arg][1] != 0) {
+        string_view opt = argv[arg];
 
-    switch (catalogue_version) {
-        case 0:
-            switch (algo) {
-                case cdf_algorithm::SHA1:
-                    catalogue_version = 1;
-                break;
+        if (opt.starts_with("-j")) {
+            string_view val;
 
-                case cdf_algorithm::SHA256:
-                    catalogue_version = 2;
-                break;
+            if (opt.size() > 2)
+                val = opt.substr(2);
+            else if (arg + 1 < argc)
+                val = argv[++arg];
 
-                case cdf_algorithm::none:
-                    catalogue_version = 1;
-                    algo = cdf_algorithm::SHA1;
-                break;
+            auto [ptr, ec] = from_chars(val.data(), val.data() + val.size(), num_threads);
+
+            if (val.empty() || ptr != val.data() + val.size() || ec != errc() || num_threads == 0) {
+                cerr << argv[0] << ": invalid number of threads." << endl;
+                return 1;
+            }
+        } else if (opt == "--cache") {
+            if (arg + 1 == argc) {
+                cerr << argv[0] << ": --cache requires a filename." << endl;
+                return 1;
             }
-        break;
-
-        case 1:
-            if (algo == cdf_algorithm::SHA256)
-                throw runtime_error("CatalogVersion must be 2 if HashAlgorithms is SHA256.");
-            algo = cdf_algorithm::SHA1;
-        break;
-
-        case 2:
-            if (algo == cdf_algorithm::SHA1)
-                throw runtime_error("CatalogVersion must be 1 if HashAlgorithms is SHA1.");
-            algo = cdf_algorithm::SHA256;
-        break;
-    }
 
-    if (cat_name.empty())
-        throw runtime_error("No value specified for Name.");
+            cache_fn = argv[++arg];
+        } else if (opt == "--io") {
+            optional<io_mode> mode;
 
-    vector<uint8_t> v;
+            if (arg + 1 < argc)
+                mode = parse_io_mode(argv[arg + 1]);
 
-    auto identifier = create_identifier();
+            if (!mode) {
+                cerr << argv[0] << ": --io must be one of auto, mmap, pread, or io_uring." << endl;
+                return 1;
+            }
 
-    auto lambda = [&]<typename Hasher>() {
-        cat<Hasher> c(identifier, time(nullptr));
+            arg++;
+            io = *mode;
+        } else if (opt == "-MD") {
+            if (arg + 1 == argc) {
+                cerr << argv[0] << ": -MD requires a filename." << endl;
+                return 1;
+            }
 
-        for (const auto& ent : entries) {
-            if (ent.first.substr(0, 6) != "<HASH>")
-                throw runtime_error("Only catalogue files with identifiers beginning <HASH> are supported.");
+            depfile_fn = argv[++arg];
+        } else if (opt == "-MT") {
+            if (arg + 1 == argc) {
+                cerr << argv[0] << ": -MT requires a target." << endl;
+                return 1;
+            }
 
-            c.entries.emplace_back(ent.second);
+            dep_target = argv[++arg];
+        } else if (opt == "--no-daemon")
+            use_daemon = false;
+        else {
+            cerr << argv[0] << ": unrecognized option " << opt << "." << endl;
+            return 1;
         }
 
-        c.extensions = attributes;
-
-        v = c.write(do_page_hashes);
-    };
-
-    switch (algo) {
-        case cdf_algorithm::SHA1:
-            lambda.template operator()<sha1_hasher>();
-        break;
-
-        case cdf_algorithm::SHA256:
-            lambda.template operator()<sha256_hasher>();
-        break;
+        arg++;
+    }
 
-        default:
-        break;
+    if (arg == argc) {
+        cerr << argv[0] << ": at least one CDF file must be specified." << endl;
+        return 1;
     }
 
-    filesystem::path outfn;
+    bool success = true;
 
-    // FIXME - Microsoft makecat creates result_dir if it doesn't already exist
-    if (!result_dir.empty())
-        outfn = filesystem::path{result_dir} / cat_name;
-    else
-        outfn = cat_name;
+    try {
+        vector<filesystem::path> fns;
+        unique_ptr<daemon_client> client;
+        optional<digest_cache> cache;
+        optional<depfile> deps;
 
-    {
-        ofstream out(outfn, ios::binary);
+        for (int i = arg; i < argc; i++) {
+            add_cdfs(argv[i], fns);
+        }
 
-        // FIXME - better error messages
-        if (!out.is_open())
-            throw runtime_error("Could not open " + outfn.string() + " for writing.");
+        bool from_stdin = find(fns.begin(), fns.end(), "-") != fns.end();
 
-        out.write((char*)v.data(), v.size());
-    }
-}
+        if (from_stdin && fns.size() > 1)
+            throw runtime_error("A CDF can only be read from stdin on its own.");
 
-int main(int argc, char* argv[]) {
-    // FIXME - reading from STDIN and writing to STDOUT
+        if (depfile_fn) {
+            if (from_stdin && !dep_target)
+                throw runtime_error("-MT must be given for -MD when reading from stdin.");
 
-    if (argc < 2 || !strcmp(argv[1], "--help") || !strcmp(argv[1], "-?")) {
-        cerr << format(R"(Usage: {} FILE
-Creates a catalogue file from a CDF file.
+            deps.emplace();
+        }
 
-      --help, -?    display this help and exit
-      --version     output version information and exit
-)", argv[0]);
+        auto deps_ptr = deps ? &*deps : nullptr;
 
-        return 1;
-    }
+        // nyand needs the whole CDF before it can start, which would mean
+        // waiting for stdin to finish, so a CDF from stdin is always made here,
+        // hashing the files as they're listed.
 
-    if (!strcmp(argv[1], "--version")) {
-        cerr << "makecat " << PROJECT_VERSION_MAJOR << endl;
-        cerr << "Copyright (c) Mark Harmstone 2024" << endl;
-        return 1;
-    }
+        if (use_daemon && !from_stdin)
+            client = daemon_client::connect();
 
-    // FIXME - parse options (-v, -r, -n)
+        if (client) {
+            for (const auto& fn : fns) {
+                try {
+                    make_cat_daemon(fn, *client, deps_ptr, dep_target);
+                } catch (const exception& e) {
+                    report_error(fn, fns.size() > 1, e);
+                    success = false;
+                }
+            }
+        } else {
+            // Without --cache, a cache which only lasts for this run is what
+            // lets the catalogues share their hashes, and what keeps the
+            // hashes made while reading stdin.
+
+            if (cache_fn)
+                cache.emplace(cache_fn);
+            else if (fns.size() > 1 || from_stdin)
+                cache.emplace(digest_cache::in_memory);
+
+            if (from_stdin)
+                make_cat_stdin(num_threads, *cache, io, deps_ptr, dep_target);
+            else if (!make_cats(fns, num_threads, cache ? &*cache : nullptr, io, deps_ptr, dep_target))
+                success = false;
+
+            if (cache)
+                cache->flush();
+        }
 
-    try {
-        make_cat(argv[1]);
+        // If anything failed, the build needs to run us again anyway.
+        if (deps && success)
+            deps->write(depfile_fn);
     } catch (const exception& e) {
         cerr << "Exception: " << e.what() << endl;
         return 1;
     }
 
-    return 0;
+    return success ? 0 : 1;
 }
@@ -0,0 +1,395 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <string.h>
+#include <span>
+#include <vector>
+#include <array>
+#include <type_traits>
+#include <utility>
+#include "multibuffer.h"
+#include "sha1.h"
+#include "sha256.h"
+#include "cpu.h"
+#include "simd.h"
+
+using namespace std;
+
+template<typename Hasher> using hash_type = decltype(Hasher{}.finalize());
+
+template<typename Hasher>
+static vector<hash_type<Hasher>> hash_serial(span<const span<const uint8_t>> msgs) {
+    vector<hash_type<Hasher>> ret;
+
+    ret.reserve(msgs.size());
+
+    for (auto m : msgs) {
+        Hasher ctx;
+
+        ctx.update(m.data(), m.size());
+
+        ret.emplace_back(ctx.finalize());
+    }
+
+    return ret;
+}
+
+#ifdef NYAN_X86
+
+// The multi-buffer code is written using the vector helpers in simd.h, so that
+// the same source serves for both AVX2 (8 lanes) and AVX-512 (16 lanes).
+
+// One stage of transposing the square matrix r, swapping the off-diagonal
+// s-by-s blocks of every 2s-by-2s block.
+
+template<typename V, unsigned int S, size_t... P>
+SIMD_INLINE V interleave_lo(const V& a, const V& b, index_sequence<P...>) {
+    return __builtin_shufflevector(a, b, ((P & S) == 0 ? P : num_lanes<V> + P - S)...);
+}
+
+template<typename V, unsigned int S, size_t... P>
+SIMD_INLINE V interleave_hi(const V& a, const V& b, index_sequence<P...>) {
+    return __builtin_shufflevector(a, b, ((P & S) == 0 ? P + S : num_lanes<V> + P)...);
+}
+
+template<typename V, unsigned int S>
+SIMD_INLINE void transpose_stage(V* r) {
+    auto seq = make_index_sequence<num_lanes<V>>{};
+
+    for (unsigned int i = 0; i < num_lanes<V>; i++) {
+        if (i & S)
+            continue;
+
+        V a = r[i], b = r[i + S];
+
+        r[i] = interleave_lo<V, S>(a, b, seq);
+        r[i + S] = interleave_hi<V, S>(a, b, seq);
+    }
+
+    if constexpr (S > 1)
+        transpose_stage<V, S / 2>(r);
+}
+
+// Loads the sixteen words of each lane's block as big-endian, transposed so
+// that w[i] holds word i of every lane.
+template<typename V>
+SIMD_INLINE void load_words(V* w, const uint8_t* const* blocks) {
+    static constexpr unsigned int lanes = num_lanes<V>;
+
+    for (unsigned int part = 0; part < 16 / lanes; part++) {
+        V* r = w + (part * lanes);
+
+        for (unsigned int l = 0; l < lanes; l++) {
+            memcpy(&r[l], blocks[l] + (part * sizeof(V)), sizeof(V));
+            r[l] = bswap(r[l]);
+        }
+
+        transpose_stage<V, lanes / 2>(r);
+    }
+}
+
+struct sha1_mb {
+    using hasher = sha1_hasher;
+
+    static constexpr unsigned int words = 5;
+    static constexpr uint32_t iv[] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+    template<typename V>
+    SIMD_INLINE static void compress(V* st, const uint8_t* const* blocks) {
+        V w[16];
+        V a = st[0], b = st[1], c = st[2], d = st[3], e = st[4];
+
+        load_words(w, blocks);
+
+        for (unsigned int i = 0; i < 80; i++) {
+            V f;
+            uint32_t k;
+
+            if (i >= 16)
+                w[i & 15] = rol(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+
+            if (i < 20) {
+                f = (b & (c ^ d)) ^ d;
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = ((b | c) & d) | (b & c);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+
+            V t = rol(a, 5) + f + e + k + w[i & 15];
+
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+
+        st[0] += a;
+        st[1] += b;
+        st[2] += c;
+        st[3] += d;
+        st[4] += e;
+    }
+};
+
+struct sha256_mb {
+    using hasher = sha256_hasher;
+
+    static constexpr unsigned int words = 8;
+    static constexpr uint32_t iv[] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    static constexpr uint32_t k[] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    template<typename V>
+    SIMD_INLINE static void compress(V* st, const uint8_t* const* blocks) {
+        V w[16];
+        V a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f = st[5], g = st[6], h = st[7];
+
+        load_words(w, blocks);
+
+        for (unsigned int i = 0; i < 64; i++) {
+            if (i >= 16) {
+                V w15 = w[(i + 1) & 15], w2 = w[(i + 14) & 15];
+                V s0 = ror(w15, 7) ^ ror(w15, 18) ^ (w15 >> 3);
+                V s1 = ror(w2, 17) ^ ror(w2, 19) ^ (w2 >> 10);
+
+                w[i & 15] += s0 + w[(i + 9) & 15] + s1;
+            }
+
+            V s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+            V ch = (e & f) ^ (~e & g);
+            V temp1 = h + s1 + ch + k[i] + w[i & 15];
+            V s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+            V maj = (a & b) ^ (a & c) ^ (b & c);
+            V temp2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+
+        st[0] += a;
+        st[1] += b;
+        st[2] += c;
+        st[3] += d;
+        st[4] += e;
+        st[5] += f;
+        st[6] += g;
+        st[7] += h;
+    }
+};
+
+// Every lane works through one message at a time, first straight from the
+// caller's buffer and then through the padded tail in lane_job::tail. When a
+// message finishes, its lane is given the next one; lanes left idle at the end
+// hash a dummy block, and their results are ignored.
+
+struct lane_job {
+    size_t msg;
+    const uint8_t* data;
+    size_t full_blocks;
+    size_t tail_blocks;
+    size_t tail_pos;
+    uint8_t tail[128];
+};
+
+template<typename Alg, typename V>
+SIMD_INLINE void hash_lanes(span<const span<const uint8_t>> msgs, hash_type<typename Alg::hasher>* out) {
+    static constexpr unsigned int lanes = num_lanes<V>;
+    static const uint8_t dummy[64] = { };
+    lane_job jobs[lanes];
+    bool active[lanes];
+    V st[Alg::words];
+    size_t next = 0;
+    unsigned int num_active = 0;
+
+    auto start = [&](unsigned int l) {
+        if (next == msgs.size()) {
+            active[l] = false;
+            return;
+        }
+
+        auto& j = jobs[l];
+        auto m = msgs[next];
+        auto rem = m.size() % 64;
+        uint64_t bits = (uint64_t)m.size() << 3;
+
+        j.msg = next;
+        j.data = m.data();
+        j.full_blocks = m.size() / 64;
+        j.tail_blocks = rem < 56 ? 1 : 2;
+        j.tail_pos = 0;
+
+        memset(j.tail, 0, sizeof(j.tail));
+
+        if (rem != 0)
+            memcpy(j.tail, m.data() + m.size() - rem, rem);
+
+        j.tail[rem] = 0x80;
+
+        for (unsigned int i = 0; i < 8; i++) {
+            j.tail[(j.tail_blocks * 64) - 1 - i] = (uint8_t)(bits >> (i * 8));
+        }
+
+        for (unsigned int i = 0; i < Alg::words; i++) {
+            st[i][l] = Alg::iv[i];
+        }
+
+        active[l] = true;
+        num_active++;
+        next++;
+    };
+
+    for (unsigned int l = 0; l < lanes; l++) {
+        start(l);
+    }
+
+    while (num_active > 0) {
+        const uint8_t* blocks[lanes];
+
+        for (unsigned int l = 0; l < lanes; l++) {
+            auto& j = jobs[l];
+
+            if (!active[l])
+                blocks[l] = dummy;
+            else if (j.full_blocks > 0) {
+                blocks[l] = j.data;
+                j.data += 64;
+                j.full_blocks--;
+            } else {
+                blocks[l] = j.tail + (j.tail_pos * 64);
+                j.tail_pos++;
+            }
+        }
+
+        Alg::template compress<V>(st, blocks);
+
+        for (unsigned int l = 0; l < lanes; l++) {
+            auto& j = jobs[l];
+
+            if (!active[l] || j.full_blocks > 0 || j.tail_pos < j.tail_blocks)
+                continue;
+
+            auto& d = out[j.msg];
+
+            for (unsigned int i = 0; i < Alg::words; i++) {
+                uint32_t v = st[i][l];
+
+                d[(i * 4) + 0] = (uint8_t)(v >> 24);
+                d[(i * 4) + 1] = (uint8_t)(v >> 16);
+                d[(i * 4) + 2] = (uint8_t)(v >> 8);
+                d[(i * 4) + 3] = (uint8_t)v;
+            }
+
+            num_active--;
+            start(l);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void sha1_avx2(span<const span<const uint8_t>> msgs, hash_type<sha1_hasher>* out) {
+    hash_lanes<sha1_mb, u32x8>(msgs, out);
+}
+
+__attribute__((target("avx512f")))
+static void sha1_avx512(span<const span<const uint8_t>> msgs, hash_type<sha1_hasher>* out) {
+    hash_lanes<sha1_mb, u32x16>(msgs, out);
+}
+
+__attribute__((target("avx2")))
+static void sha256_avx2(span<const span<const uint8_t>> msgs, hash_type<sha256_hasher>* out) {
+    hash_lanes<sha256_mb, u32x8>(msgs, out);
+}
+
+__attribute__((target("avx512f")))
+static void sha256_avx512(span<const span<const uint8_t>> msgs, hash_type<sha256_hasher>* out) {
+    hash_lanes<sha256_mb, u32x16>(msgs, out);
+}
+
+#endif
+
+template<typename Hasher>
+vector<hash_type<Hasher>> hash_many(span<const span<const uint8_t>> msgs) {
+#ifdef NYAN_X86
+    using func_type = void(*)(span<const span<const uint8_t>>, hash_type<Hasher>*);
+
+    struct impl {
+        func_type func;
+        size_t min_msgs;
+    };
+
+    // On our hardware 16 lanes of AVX-512 are about twice as fast as SHA-NI, and
+    // 8 lanes of AVX2 about the same, so with SHA-NI we only bother with the
+    // former, and only if there's enough messages to fill most of the lanes.
+
+    static const auto mb = []() -> impl {
+        bool sha_ni = cpu_has_sha_ni();
+
+        if constexpr (is_same_v<Hasher, sha1_hasher>) {
+            if (cpu_has_avx512())
+                return { sha1_avx512, sha_ni ? 8u : 2u };
+            else if (cpu_has_avx2() && !sha_ni)
+                return { sha1_avx2, 2 };
+        } else if constexpr (is_same_v<Hasher, sha256_hasher>) {
+            if (cpu_has_avx512())
+                return { sha256_avx512, sha_ni ? 8u : 2u };
+            else if (cpu_has_avx2() && !sha_ni)
+                return { sha256_avx2, 2 };
+        }
+
+        return { nullptr, 0 };
+    }();
+
+    if (mb.func && msgs.size() >= mb.min_msgs) {
+        vector<hash_type<Hasher>> ret(msgs.size());
+
+        mb.func(msgs, ret.data());
+
+        return ret;
+    }
+#endif
+
+    return hash_serial<Hasher>(msgs);
+}
+
+template vector<hash_type<sha1_hasher>> hash_many<sha1_hasher>(span<const span<const uint8_t>> msgs);
+template vector<hash_type<sha256_hasher>> hash_many<sha256_hasher>(span<const span<const uint8_t>> msgs);
@@ -0,0 +1,28 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include <stdint.h>
+
+// Hashes each of msgs independently, returning the digests in the same order.
+// Where the CPU supports it, up to 16 messages are hashed at once in the lanes
+// of the vector registers.
+template<typename Hasher>
+std::vector<decltype(Hasher{}.finalize())> hash_many(std::span<const std::span<const uint8_t>> msgs);
@@ -0,0 +1,687 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <iostream>
+#include <format>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <charconv>
+#include <optional>
+#include "daemon.h"
+#include "cdf.h"
+#include "digest_cache.h"
+#include "file_reader.h"
+#include "pe_image.h"
+#include "sha1.h"
+#include "sha256.h"
+#include "dual_hasher.h"
+#include "thread_pool.h"
+#include "config.h"
+
+using namespace std;
+
+template<typename Hasher>
+using digest_t = decltype(Hasher{}.finalize());
+
+// As in authenticode, anything which isn't SHA-1 alone is cached as SHA-256,
+// which has the SHA-1 hash alongside it.
+template<typename Hasher>
+using cache_hasher = conditional_t<is_same_v<Hasher, sha1_hasher>, sha1_hasher, sha256_hasher>;
+
+// Number of files given to each thread at a time.
+static const size_t FILES_PER_JOB = 16;
+
+// Number of results we work out before sending them back.
+static const size_t FILES_PER_BATCH = 1024;
+
+class server {
+public:
+    server(unsigned int num_threads, const char* cache_fn, io_mode io) : pool(num_threads), io(io) {
+        if (cache_fn)
+            cache.emplace(cache_fn, true);
+        else
+            cache.emplace(digest_cache::in_memory, true);
+
+        persistent = cache_fn != nullptr;
+    }
+
+    void serve(int sock);
+    void shutdown();
+
+private:
+    bool begin_request();
+    void end_request();
+    void handle(int sock, daemon_msg type, span<const uint8_t> payload, int fd);
+
+    template<typename Hasher>
+    void hash(int sock, span<const filesystem::path> fns);
+
+    template<typename Hasher>
+    void page_hashes(int sock, span<const filesystem::path> fns);
+
+    void makecat(int sock, span<const uint8_t> payload, int fd);
+
+    template<typename Hasher>
+    optional<file_hashes<cache_hasher<Hasher>>> find_pe(const filesystem::path& fn, bool page_hashes);
+
+    thread_pool pool;
+    optional<digest_cache> cache;
+    bool persistent;
+    io_mode io;
+
+    // The cache file is written to when nothing is running, and new requests
+    // wait until that's done.
+    mutex m;
+    condition_variable cv;
+    unsigned int active = 0;
+    bool stopping = false;
+};
+
+bool server::begin_request() {
+    lock_guard lg(m);
+
+    if (stopping)
+        return false;
+
+    active++;
+
+    return true;
+}
+
+void server::end_request() {
+    lock_guard lg(m);
+
+    active--;
+
+    if (active != 0)
+        return;
+
+    if (persistent) {
+        try {
+            cache->flush();
+        } catch (const exception& e) {
+            cerr << format("nyand: {}\n", e.what());
+        }
+    }
+
+    cv.notify_all();
+}
+
+void server::shutdown() {
+    unique_lock lock(m);
+
+    stopping = true;
+
+    cv.wait(lock, [&]() { return active == 0; });
+}
+
+// Looks a PE file up in the cache. A non-PE file would only be there because
+// of makecat.
+template<typename Hasher>
+optional<file_hashes<cache_hasher<Hasher>>> server::find_pe(const filesystem::path& fn, bool page_hashes) {
+    struct stat st;
+    file_hashes<cache_hasher<Hasher>> fh;
+
+    if (stat(fn.c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+        return nullopt;
+
+    if (!cache->find(st, page_hashes, fh) || !fh.is_pe)
+        return nullopt;
+
+    return fh;
+}
+
+template<typename Hasher>
+static digest_t<Hasher> from_cache(const file_hashes<cache_hasher<Hasher>>& fh) {
+    if constexpr (is_same_v<Hasher, dual_hasher<sha256_hasher, sha1_hasher>>)
+        return { fh.hash, fh.sha1_hash };
+    else
+        return fh.hash;
+}
+
+// Calls func for each file in fns, on the pool, with its contents, unless it's
+// in the cache. The results are sent back a batch at a time, in order, with
+// add_result being given the buffer for each file which worked.
+template<typename Result>
+static void run_batches(int sock, thread_pool& pool, io_mode io, span<const filesystem::path> fns,
+                        const function<optional<Result>(const filesystem::path&)>& lookup,
+                        const function<Result(const file_contents&)>& func,
+                        const function<void(vector<uint8_t>&, const Result&)>& add_result) {
+    for (size_t start = 0; start < fns.size(); start += FILES_PER_BATCH) {
+        auto batch = fns.subspan(start, min(FILES_PER_BATCH, fns.size() - start));
+        vector<optional<Result>> results(batch.size());
+        vector<string> errors(batch.size());
+
+        auto num_jobs = (batch.size() + FILES_PER_JOB - 1) / FILES_PER_JOB;
+
+        pool.parallel_for(num_jobs, [&](size_t j) {
+            auto job_start = j * FILES_PER_JOB;
+            auto n = min(FILES_PER_JOB, batch.size() - job_start);
+            vector<size_t> to_read;
+            vector<filesystem::path> read_fns;
+
+            for (size_t i = job_start; i < job_start + n; i++) {
+                if ((results[i] = lookup(batch[i])))
+                    continue;
+
+                to_read.push_back(i);
+                read_fns.push_back(batch[i]);
+            }
+
+            file_reader reader(io);
+            vector<file_contents> files;
+            size_t pos = 0;
+
+            while (pos < read_fns.size()) {
+                auto got = reader.read(span(read_fns).subspan(pos), files);
+
+                for (size_t k = 0; k < got; k++) {
+                    auto i = to_read[pos + k];
+
+                    try {
+                        results[i] = func(files[k]);
+                    } catch (const exception& e) {
+                        errors[i] = e.what();
+                    }
+                }
+
+                pos += got;
+            }
+        });
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            vector<uint8_t> payload;
+
+            if (results[i]) {
+                payload.push_back(1);
+                add_result(payload, *results[i]);
+            } else {
+                payload.push_back(0);
+                payload.insert(payload.end(), errors[i].begin(), errors[i].end());
+            }
+
+            daemon_send(sock, daemon_msg::result, payload);
+        }
+    }
+}
+
+template<typename Hasher>
+void server::hash(int sock, span<const filesystem::path> fns) {
+    run_batches<digest_t<Hasher>>(sock, pool, io, fns,
+        [&](const filesystem::path& fn) -> optional<digest_t<Hasher>> {
+            if (auto fh = find_pe<Hasher>(fn, false))
+                return from_cache<Hasher>(*fh);
+
+            return nullopt;
+        },
+        [&](const file_contents& f) {
+            pe_image image(f.data());
+            file_hashes<cache_hasher<Hasher>> fh;
+
+            fh.is_pe = true;
+
+            if constexpr (is_same_v<Hasher, sha1_hasher>)
+                fh.hash = authenticode<sha1_hasher>(image);
+            else
+                tie(fh.hash, fh.sha1_hash) = authenticode<dual_hasher<sha256_hasher, sha1_hasher>>(image);
+
+            cache->add(f.file_stat(), false, fh);
+
+            return from_cache<Hasher>(fh);
+        },
+        [](vector<uint8_t>& payload, const digest_t<Hasher>& d) {
+            daemon_put_digest(payload, d);
+        });
+}
+
+template<typename Hasher>
+void server::page_hashes(int sock, span<const filesystem::path> fns) {
+    // These are cached the same way as makecat does it, so each can use the
+    // other's results.
+
+    run_batches<file_hashes<Hasher>>(sock, pool, io, fns,
+        [&](const filesystem::path& fn) {
+            return find_pe<Hasher>(fn, true);
+        },
+        [&](const file_contents& f) {
+            pe_image image(f.data());
+            file_hashes<Hasher> fh;
+
+            fh.is_pe = true;
+
+            if constexpr (is_same_v<Hasher, sha256_hasher>) {
+                auto h = authenticode_with_page_hashes<dual_hasher<Hasher, sha1_hasher>, Hasher>(image, &pool);
+
+                tie(fh.hash, fh.sha1_hash) = h.hash;
+                fh.page_hashes = move(h.page_hashes);
+            } else {
+                auto h = authenticode_with_page_hashes<Hasher>(image, &pool);
+
+                fh.hash = h.hash;
+                fh.page_hashes = move(h.page_hashes);
+            }
+
+            cache->add(f.file_stat(), true, fh);
+
+            return fh;
+        },
+        [](vector<uint8_t>& payload, const file_hashes<Hasher>& fh) {
+            auto num = (uint32_t)fh.page_hashes.size();
+
+            daemon_put_digest(payload, fh.hash);
+            payload.insert(payload.end(), (const uint8_t*)&num, (const uint8_t*)&num + sizeof(num));
+
+            for (const auto& ph : fh.page_hashes) {
+                payload.insert(payload.end(), (const uint8_t*)&ph.first, (const uint8_t*)&ph.first + sizeof(uint32_t));
+                daemon_put_digest(payload, ph.second);
+            }
+        });
+}
+
+void server::makecat(int sock, span<const uint8_t> payload, int fd) {
+    auto nul = find(payload.begin(), payload.end(), 0);
+
+    if (nul == payload.end())
+        throw runtime_error("Malformed makecat request.");
+
+    if (fd == -1)
+        throw runtime_error("No output file was passed with makecat request.");
+
+    filesystem::path cwd{string(payload.begin(), nul)};
+
+    auto text = payload.subspan((size_t)(nul - payload.begin()) + 1);
+    auto c = parse_cdf(string_view((const char*)text.data(), text.size()));
+
+    // the files are relative to the client's working directory, not ours
+
+    for (auto& f : c.files) {
+        f.fn = cwd / f.fn;
+    }
+
+    for (auto& p : c.patterns) {
+        p.base = cwd;
+    }
+
+    vector<filesystem::path> inputs;
+    vector<uint8_t> result{1};
+
+    write_cat(move(c), fd, pool.size(), &*cache, io, &pool, &inputs);
+
+    daemon_put_paths(result, inputs);
+    daemon_send(sock, daemon_msg::result, result);
+}
+
+void server::handle(int sock, daemon_msg type, span<const uint8_t> payload, int fd) {
+    switch (type) {
+        case daemon_msg::hash:
+        case daemon_msg::page_hashes: {
+            if (payload.empty())
+                throw runtime_error("Malformed request.");
+
+            auto algorithm = (daemon_algorithm)payload[0];
+            auto fns = daemon_get_paths(payload.subspan(1));
+
+            if (type == daemon_msg::hash) {
+                switch (algorithm) {
+                    case daemon_algorithm::sha1:
+                        hash<sha1_hasher>(sock, fns);
+                    break;
+
+                    case daemon_algorithm::sha256:
+                        hash<sha256_hasher>(sock, fns);
+                    break;
+
+                    case daemon_algorithm::both:
+                        hash<dual_hasher<sha256_hasher, sha1_hasher>>(sock, fns);
+                    break;
+
+                    default:
+                        throw runtime_error("Unsupported algorithm " + to_string((unsigned int)algorithm) + ".");
+                }
+            } else {
+                switch (algorithm) {
+                    case daemon_algorithm::sha1:
+                        page_hashes<sha1_hasher>(sock, fns);
+                    break;
+
+                    case daemon_algorithm::sha256:
+                        page_hashes<sha256_hasher>(sock, fns);
+                    break;
+
+                    default:
+                        throw runtime_error("Unsupported algorithm " + to_string((unsigned int)algorithm) + " for page hashes.");
+                }
+            }
+            break;
+        }
+
+        case daemon_msg::makecat:
+            makecat(sock, payload, fd);
+        break;
+
+        default:
+            throw runtime_error("Unrecognized request " + to_string((uint32_t)type) + ".");
+    }
+}
+
+// Handles requests on a connection until it's closed.
+void server::serve(int sock) {
+    // Another user could get us to read files on their behalf, and we'd be
+    // none the wiser.
+
+    ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != getuid()) {
+        close(sock);
+        return;
+    }
+
+    try {
+        while (true) {
+            daemon_msg type;
+            vector<uint8_t> payload;
+            int fd;
+
+            if (!daemon_recv(sock, type, payload, &fd))
+                break;
+
+            if (!begin_request()) {
+                if (fd != -1)
+                    close(fd);
+
+                string_view msg = "nyand is shutting down.";
+
+                daemon_send(sock, daemon_msg::error, span((const uint8_t*)msg.data(), msg.size()));
+                break;
+            }
+
+            string error;
+
+            try {
+                handle(sock, type, payload, fd);
+
+                if (fd != -1) {
+                    auto ret = close(fd);
+
+                    fd = -1;
+
+                    if (ret == -1)
+                        throw runtime_error("close of catalogue failed (errno " + to_string(errno) + ")");
+                }
+            } catch (const exception& e) {
+                if (fd != -1)
+                    close(fd);
+
+                error = e.what();
+
+                if (error.empty())
+                    error = "Unknown error.";
+            }
+
+            end_request();
+
+            if (error.empty())
+                daemon_send(sock, daemon_msg::done, {});
+            else
+                daemon_send(sock, daemon_msg::error, span((const uint8_t*)error.data(), error.size()));
+        }
+    } catch (const exception&) {
+        // the client's gone away, or sent us nonsense
+    }
+
+    close(sock);
+}
+
+// /tmp is shared, so someone else could have made the directory first and be
+// waiting to swap our socket for theirs.
+static void make_private_dir(const filesystem::path& dir) {
+    struct stat st;
+
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+        throw runtime_error("mkdir of " + dir.string() + " failed (errno " + to_string(errno) + ")");
+
+    if (lstat(dir.c_str(), &st) == -1)
+        throw runtime_error("lstat of " + dir.string() + " failed (errno " + to_string(errno) + ")");
+
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0077) != 0)
+        throw runtime_error(dir.string() + " is not a directory which only we can use.");
+}
+
+static int listen_on(const filesystem::path& path) {
+    sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.native().size() >= sizeof(addr.sun_path))
+        throw runtime_error("Socket path " + path.string() + " is too long.");
+
+    memcpy(addr.sun_path, path.c_str(), path.native().size());
+
+    if (path.parent_path() == daemon_private_dir())
+        make_private_dir(path.parent_path());
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock == -1)
+        throw runtime_error("socket failed (errno " + to_string(errno) + ")");
+
+    // only we can connect to the socket, as anyone who can could have us read
+    // any of our files
+
+    auto old_mask = umask(0077);
+    auto ret = ::bind(sock, (sockaddr*)&addr, sizeof(addr));
+
+    if (ret == -1 && errno == EADDRINUSE) {
+        // If it's left over from a nyand which didn't exit cleanly, nobody
+        // will answer, and we can take its place.
+
+        if (daemon_client::connect(path)) {
+            umask(old_mask);
+            close(sock);
+            throw runtime_error("nyand is already listening on " + path.string() + ".");
+        }
+
+        unlink(path.c_str());
+        ret = ::bind(sock, (sockaddr*)&addr, sizeof(addr));
+    }
+
+    auto err = errno;
+
+    umask(old_mask);
+
+    if (ret == -1) {
+        close(sock);
+        throw runtime_error("bind to " + path.string() + " failed (errno " + to_string(err) + ")");
+    }
+
+    if (listen(sock, SOMAXCONN) == -1) {
+        err = errno;
+        close(sock);
+        unlink(path.c_str());
+        throw runtime_error("listen failed (errno " + to_string(err) + ")");
+    }
+
+    return sock;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-?"))) {
+        cerr << format(R"(Usage: {} [-j N] [--cache FILE] [--io MODE] [--socket PATH]
+Hashes files and makes catalogues for authenticode and makecat, which pass
+their work to it when it's running. Hashes are remembered between requests.
+
+      -j N          hash files using N threads (default: number of CPUs)
+      --cache FILE  also keep the hashes in FILE, so that they last after
+                      nyand exits
+      --io MODE     how to read files: auto (the default), mmap, pread, or
+                      io_uring
+      --socket PATH listen on PATH rather than the default of {}
+      --help, -?    display this help and exit
+      --version     output version information and exit
+)", argv[0], daemon_socket_path().string());
+
+        return 1;
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "--version")) {
+        cerr << "nyand " << PROJECT_VERSION_MAJOR << endl;
+        cerr << "Copyright (c) Mark Harmstone 2024" << endl;
+        return 1;
+    }
+
+    unsigned int num_threads = max(thread::hardware_concurrency(), 1u);
+    const char* cache_fn = nullptr;
+    filesystem::path socket_path = daemon_socket_path();
+    io_mode io = io_mode::automatic;
+    int arg = 1;
+
+    while (arg < argc) {
+        string_view opt = argv[arg];
+
+        if (opt.starts_with("-j")) {
+            string_view val;
+
+            if (opt.size() > 2)
+                val = opt.substr(2);
+            else if (arg + 1 < argc)
+                val = argv[++arg];
+
+            auto [ptr, ec] = from_chars(val.data(), val.data() + val.size(), num_threads);
+
+            if (val.empty() || ptr != val.data() + val.size() || ec != errc() || num_threads == 0) {
+                cerr << argv[0] << ": invalid number of threads." << endl;
+                return 1;
+            }
+        } else if (opt == "--cache") {
+            if (arg + 1 == argc) {
+                cerr << argv[0] << ": --cache requires a filename." << endl;
+                return 1;
+            }
+
+            cache_fn = argv[++arg];
+        } else if (opt == "--socket") {
+            if (arg + 1 == argc) {
+                cerr << argv[0] << ": --socket requires a path." << endl;
+                return 1;
+            }
+
+            socket_path = argv[++arg];
+        } else if (opt == "--io") {
+            optional<io_mode> mode;
+
+            if (arg + 1 < argc)
+                mode = parse_io_mode(argv[arg + 1]);
+
+            if (!mode) {
+                cerr << argv[0] << ": --io must be one of auto, mmap, pread, or io_uring." << endl;
+                return 1;
+            }
+
+            arg++;
+            io = *mode;
+        } else {
+            cerr << argv[0] << ": unrecognized option " << opt << "." << endl;
+            return 1;
+        }
+
+        arg++;
+    }
+
+    // The signals are blocked before any threads are started, so that they
+    // only ever come to us through the signalfd.
+
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    if (sfd == -1) {
+        cerr << format("{}: signalfd failed (errno {})\n", argv[0], errno);
+        return 1;
+    }
+
+    optional<server> srv;
+    int sock;
+
+    try {
+        srv.emplace(num_threads, cache_fn, io);
+        sock = listen_on(socket_path);
+    } catch (const exception& e) {
+        cerr << format("{}: {}\n", argv[0], e.what());
+        return 1;
+    }
+
+    while (true) {
+        pollfd fds[2];
+
+        fds[0].fd = sock;
+        fds[0].events = POLLIN;
+        fds[1].fd = sfd;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            cerr << format("{}: poll failed (errno {})\n", argv[0], errno);
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+            break;
+
+        if (fds[0].revents & POLLIN) {
+            int conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+
+            if (conn == -1)
+                continue;
+
+            thread([&srv, conn]() {
+                srv->serve(conn);
+            }).detach();
+        }
+    }
+
+    // Let anything which is running finish, so nobody's left with half a
+    // catalogue, and then write out the cache.
+
+    close(sock);
+    unlink(socket_path.c_str());
+
+    srv->shutdown();
+
+    // Connections which are still open may be waiting in recv, so we leave
+    // without tidying up after them.
+
+    _exit(0);
+}
@@ -0,0 +1,279 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include <stdexcept>
+#include "pe_image.h"
+#include "cpu.h"
+
+using namespace std;
+
+// The parts of the optional header we need, which are in different places
+// for 32- and 64-bit images.
+struct opthead_info {
+    uint32_t size_of_headers;
+    uint32_t section_alignment;
+    uint32_t file_alignment;
+    uint32_t num_dirs;
+    size_t checksum_off;
+    size_t dirs_off;
+};
+
+template<typename T>
+static opthead_info get_opthead_info(const T& opthead, const uint8_t* base) {
+    return {
+        opthead.SizeOfHeaders,
+        opthead.SectionAlignment,
+        opthead.FileAlignment,
+        opthead.NumberOfRvaAndSizes,
+        (size_t)((const uint8_t*)&opthead.CheckSum - base),
+        (size_t)((const uint8_t*)opthead.DataDirectory - base)
+    };
+}
+
+static bool get_opthead_info(const IMAGE_NT_HEADERS& nt_header, const uint8_t* base, opthead_info& info) {
+    switch (nt_header.OptionalHeader32.Magic) {
+        case IMAGE_NT_OPTIONAL_HDR32_MAGIC:
+            info = get_opthead_info(nt_header.OptionalHeader32, base);
+            return true;
+
+        case IMAGE_NT_OPTIONAL_HDR64_MAGIC:
+            info = get_opthead_info(nt_header.OptionalHeader64, base);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static uint64_t get_sections_end(const IMAGE_NT_HEADERS& nt_header, const opthead_info& info) {
+    return info.dirs_off + ((uint64_t)info.num_dirs * sizeof(IMAGE_DATA_DIRECTORY)) +
+           ((uint64_t)nt_header.FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER));
+}
+
+pe_image::pe_image(span<const uint8_t> file, bool headers_only) : data(file) {
+    if (file.size() < sizeof(IMAGE_DOS_HEADER))
+        throw runtime_error("File too short for IMAGE_DOS_HEADER.");
+
+    auto& dos_header = *(const IMAGE_DOS_HEADER*)file.data();
+
+    if (dos_header.e_magic != IMAGE_DOS_SIGNATURE)
+        throw runtime_error("Invalid DOS signature.");
+
+    if (file.size() < (uint64_t)dos_header.e_lfanew + sizeof(IMAGE_NT_HEADERS))
+        throw runtime_error("File too short for IMAGE_NT_HEADERS.");
+
+    nt_header = (const IMAGE_NT_HEADERS*)(file.data() + dos_header.e_lfanew);
+
+    if (nt_header->Signature != IMAGE_NT_SIGNATURE)
+        throw runtime_error("Incorrect PE signature.");
+
+    opthead_info info;
+
+    if (!get_opthead_info(*nt_header, file.data(), info))
+        throw runtime_error("Invalid optional header magic.");
+
+    // The page hashes step through sections by SectionAlignment, so a zero
+    // would have us going round for ever.
+
+    if (info.section_alignment == 0 || (info.section_alignment & (info.section_alignment - 1)))
+        throw runtime_error("Invalid SectionAlignment.");
+
+    if (info.file_alignment == 0 || (info.file_alignment & (info.file_alignment - 1)))
+        throw runtime_error("Invalid FileAlignment.");
+
+    auto sections_end = get_sections_end(*nt_header, info);
+
+    if (sections_end > file.size())
+        throw runtime_error("Section table out of bounds.");
+
+    if (info.size_of_headers > file.size())
+        throw runtime_error("File too short for headers.");
+
+    header_size = info.size_of_headers;
+    alignment = info.section_alignment;
+    checksum_off = info.checksum_off;
+
+    directories = span((const IMAGE_DATA_DIRECTORY*)(file.data() + info.dirs_off), info.num_dirs);
+    section_table = span((const IMAGE_SECTION_HEADER*)(file.data() + info.dirs_off + directories.size_bytes()),
+                         file_header().NumberOfSections);
+
+    size_t hashed_end;
+
+    if (directories.size() > IMAGE_DIRECTORY_ENTRY_CERTIFICATE) {
+        cert_entry_off = info.dirs_off + (IMAGE_DIRECTORY_ENTRY_CERTIFICATE * sizeof(IMAGE_DATA_DIRECTORY));
+        cert_length = directories[IMAGE_DIRECTORY_ENTRY_CERTIFICATE].Size;
+        hashed_end = cert_entry_off + sizeof(IMAGE_DATA_DIRECTORY);
+    } else
+        hashed_end = info.dirs_off + directories.size_bytes();
+
+    if (header_size < hashed_end)
+        throw runtime_error("SizeOfHeaders too small.");
+
+    if (headers_only)
+        return;
+
+    uint64_t hashed_size = header_size;
+
+    for (const auto& s : section_table) {
+        if (s.SizeOfRawData == 0)
+            continue;
+
+        if ((uint64_t)s.PointerToRawData + s.SizeOfRawData > file.size())
+            throw runtime_error("Section out of bounds.");
+
+        hashed_size += s.SizeOfRawData;
+    }
+
+    if (file.size() > hashed_size) {
+        if (file.size() - hashed_size < cert_length)
+            throw runtime_error("Certificate table out of bounds.");
+
+        trailer_data = file.subspan((size_t)hashed_size, (size_t)(file.size() - hashed_size - cert_length));
+    }
+}
+
+bool pe_image::is_pe(span<const uint8_t> file) {
+    return file.size() > sizeof(IMAGE_DOS_HEADER) &&
+           ((const IMAGE_DOS_HEADER*)file.data())->e_magic == IMAGE_DOS_SIGNATURE;
+}
+
+size_t pe_image::headers_size(span<const uint8_t> file) {
+    if (file.size() < sizeof(IMAGE_DOS_HEADER))
+        return sizeof(IMAGE_DOS_HEADER);
+
+    auto& dos_header = *(const IMAGE_DOS_HEADER*)file.data();
+
+    if (dos_header.e_magic != IMAGE_DOS_SIGNATURE)
+        return file.size();
+
+    auto nt_end = (uint64_t)dos_header.e_lfanew + sizeof(IMAGE_NT_HEADERS);
+
+    if (file.size() < nt_end)
+        return (size_t)nt_end;
+
+    auto& nt_header = *(const IMAGE_NT_HEADERS*)(file.data() + dos_header.e_lfanew);
+    opthead_info info;
+
+    if (nt_header.Signature != IMAGE_NT_SIGNATURE || !get_opthead_info(nt_header, file.data(), info))
+        return file.size();
+
+    return (size_t)max(get_sections_end(nt_header, info), (uint64_t)info.size_of_headers);
+}
+
+array<span<const uint8_t>, 3> pe_image::hashed_headers() const {
+    auto after_checksum = checksum_off + sizeof(uint32_t);
+
+    // cert_entry_off can't be 0, as it's after the other headers
+    if (cert_entry_off == 0)
+        return { data.subspan(0, checksum_off), data.subspan(after_checksum, header_size - after_checksum), {} };
+
+    auto after_cert_entry = cert_entry_off + sizeof(IMAGE_DATA_DIRECTORY);
+
+    return {
+        data.subspan(0, checksum_off),
+        data.subspan(after_checksum, cert_entry_off - after_checksum),
+        data.subspan(after_cert_entry, header_size - after_cert_entry)
+    };
+}
+
+uint32_t pe_image::stored_checksum() const {
+    uint32_t checksum;
+
+    memcpy(&checksum, data.data() + checksum_off, sizeof(checksum));
+
+    return checksum;
+}
+
+typedef uint32_t checksum_u32x8 __attribute__((vector_size(32)));
+typedef uint64_t checksum_u64x8 __attribute__((vector_size(64)));
+
+// Adds up the little-endian 32-bit words in 32-byte blocks of p. As 0x10000 is
+// 1 mod 0xffff, this comes to the same thing as adding up the 16-bit words,
+// once it's folded. A 64-bit total can't overflow for anything smaller than
+// 16 GB.
+[[gnu::always_inline]] static inline uint64_t sum_blocks(const uint8_t* p, size_t blocks) {
+    checksum_u64x8 acc = {};
+
+    for (size_t i = 0; i < blocks; i++) {
+        checksum_u32x8 v;
+
+        memcpy(&v, p, sizeof(v));
+        acc += __builtin_convertvector(v, checksum_u64x8);
+
+        p += sizeof(v);
+    }
+
+    uint64_t sum = 0;
+
+    for (unsigned int i = 0; i < 8; i++) {
+        sum += acc[i];
+    }
+
+    return sum;
+}
+
+static uint64_t sum_blocks_generic(const uint8_t* p, size_t blocks) {
+    return sum_blocks(p, blocks);
+}
+
+#ifdef NYAN_X86
+
+__attribute__((target("avx2")))
+static uint64_t sum_blocks_avx2(const uint8_t* p, size_t blocks) {
+    return sum_blocks(p, blocks);
+}
+
+#endif
+
+uint32_t pe_image::checksum() const {
+    static const auto func = []() {
+#ifdef NYAN_X86
+        if (cpu_has_avx2())
+            return sum_blocks_avx2;
+#endif
+
+        return sum_blocks_generic;
+    }();
+
+    auto blocks = data.size() / sizeof(checksum_u32x8);
+    uint64_t sum = func(data.data(), blocks);
+
+    // The odd bytes at the end are in the low or high half of a word,
+    // depending on whether they're at an even or an odd offset. An odd byte
+    // right at the end is padded with zero.
+
+    for (auto off = blocks * sizeof(checksum_u32x8); off < data.size(); off++) {
+        sum += (uint64_t)data[off] << ((off & 1) * 8);
+    }
+
+    // CheckSum itself counts as zero.
+
+    for (auto off = checksum_off; off < checksum_off + sizeof(uint32_t); off++) {
+        sum -= (uint64_t)data[off] << ((off & 1) * 8);
+    }
+
+    // Folding with end-around carry gives 0xffff rather than 0 for anything
+    // but an all-zero file, which can't happen as we have an MZ header.
+
+    auto folded = (uint32_t)(sum % 0xffff);
+
+    if (folded == 0 && sum != 0)
+        folded = 0xffff;
+
+    return folded + (uint32_t)data.size();
+}
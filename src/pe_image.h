@@ -0,0 +1,124 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <span>
+#include "pe.h"
+
+// A PE file in memory, whose headers are checked when it's constructed. After
+// that the section table, the data directories, and the section data can be
+// used without any more bounds checks.
+class pe_image {
+public:
+    // Throws if file isn't a valid PE image. If headers_only is set, file need
+    // only be the first headers_size() bytes of the image, and the sections
+    // and certificate table aren't checked against the end of the file.
+    explicit pe_image(std::span<const uint8_t> file, bool headers_only = false);
+
+    // Whether file starts with an MZ header - files that do are hashed as PE
+    // images, and are an error if they turn out not to be valid.
+    static bool is_pe(std::span<const uint8_t> file);
+
+    // How much of the start of file a headers-only pe_image needs. The answer
+    // may grow as more of the file is given, and if the headers are invalid
+    // it's no more than we've already got, so that the constructor can say
+    // what's wrong.
+    static size_t headers_size(std::span<const uint8_t> file);
+
+    std::span<const uint8_t> file() const {
+        return data;
+    }
+
+    const IMAGE_FILE_HEADER& file_header() const {
+        return nt_header->FileHeader;
+    }
+
+    uint16_t magic() const {
+        return nt_header->OptionalHeader32.Magic;
+    }
+
+    uint32_t size_of_headers() const {
+        return header_size;
+    }
+
+    uint32_t section_alignment() const {
+        return alignment;
+    }
+
+    // Where the CheckSum field of the optional header is in the file.
+    size_t checksum_offset() const {
+        return checksum_off;
+    }
+
+    // The CheckSum field of the optional header.
+    uint32_t stored_checksum() const;
+
+    // Calculates what CheckSum ought to be: the 16-bit ones' complement sum
+    // of the file, taking CheckSum as zero, plus the file's length. This is
+    // only meaningful for images that aren't headers_only.
+    uint32_t checksum() const;
+
+    std::span<const IMAGE_SECTION_HEADER> sections() const {
+        return section_table;
+    }
+
+    std::span<const IMAGE_DATA_DIRECTORY> data_directories() const {
+        return directories;
+    }
+
+    // The raw data of a section, which has been checked to lie within the file.
+    std::span<const uint8_t> section_data(const IMAGE_SECTION_HEADER& s) const {
+        return data.subspan(s.PointerToRawData, s.SizeOfRawData);
+    }
+
+    // The size of the certificate table, according to its data directory
+    // entry. Authenticode leaves out this many bytes from the end of the file.
+    uint32_t cert_size() const {
+        return cert_length;
+    }
+
+    // The certificate table at the end of the file.
+    std::span<const uint8_t> certificate() const {
+        return data.subspan(data.size() - cert_length);
+    }
+
+    // The parts of the headers that go into the Authenticode hash, which is
+    // everything up to SizeOfHeaders apart from CheckSum and the certificate
+    // data directory entry.
+    std::array<std::span<const uint8_t>, 3> hashed_headers() const;
+
+    // What Authenticode hashes after the sections: everything from
+    // SizeOfHeaders plus the sizes of the sections, up to the certificate table.
+    std::span<const uint8_t> trailer() const {
+        return trailer_data;
+    }
+
+private:
+    std::span<const uint8_t> data;
+    const IMAGE_NT_HEADERS* nt_header;
+    uint32_t header_size;
+    uint32_t alignment;
+    size_t checksum_off;
+    size_t cert_entry_off = 0;
+    uint32_t cert_length = 0;
+    std::span<const IMAGE_SECTION_HEADER> section_table;
+    std::span<const IMAGE_DATA_DIRECTORY> directories;
+    std::span<const uint8_t> trailer_data;
+};
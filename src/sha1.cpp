@@ -22,6 +22,11 @@ A million repetitions of "a"
 #include <stdint.h>
 
 #include "sha1.h"
+#include "cpu.h"
+
+#ifdef NYAN_X86
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -110,6 +115,110 @@ static void SHA1Transform(uint32_t state[5], const uint8_t buffer[64])
 #endif
 }
 
+static void transform_generic(uint32_t state[5], const uint8_t* data, size_t blocks)
+{
+	for (size_t i = 0; i < blocks; i++) {
+		SHA1Transform(state, data + (i * 64));
+	}
+}
+
+#ifdef NYAN_X86
+
+/* Hash blocks using the SHA extensions. The message schedule is kept in four
+ * registers of four words each, with W[i..i+3] worked out from the previous
+ * sixteen words by SHA1MSG1 / SHA1MSG2. */
+
+#define NI_ROUNDS(f, msg) \
+	e = _mm_sha1nexte_epu32(prev, msg); \
+	prev = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, e, f);
+
+#define NI_SCHEDULE() { \
+	__m128i next = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(msg0, msg1), msg2), msg3); \
+	msg0 = msg1; msg1 = msg2; msg2 = msg3; msg3 = next; \
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void transform_sha_ni(uint32_t state[5], const uint8_t* data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, e0;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+	e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+	while (blocks > 0) {
+		__m128i abcd_save = abcd, e0_save = e0, e, prev;
+		__m128i msg0, msg1, msg2, msg3;
+
+		msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), mask);
+		msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+		msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+		msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+		/* Rounds 0-19 */
+		e = _mm_add_epi32(e0, msg0);
+		prev = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+		NI_ROUNDS(0, msg1);
+		NI_ROUNDS(0, msg2);
+		NI_ROUNDS(0, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(0, msg3);
+
+		/* Rounds 20-39 */
+		NI_SCHEDULE(); NI_ROUNDS(1, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(1, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(1, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(1, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(1, msg3);
+
+		/* Rounds 40-59 */
+		NI_SCHEDULE(); NI_ROUNDS(2, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(2, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(2, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(2, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(2, msg3);
+
+		/* Rounds 60-79 */
+		NI_SCHEDULE(); NI_ROUNDS(3, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(3, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(3, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(3, msg3);
+		NI_SCHEDULE(); NI_ROUNDS(3, msg3);
+
+		e0 = _mm_sha1nexte_epu32(prev, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+
+		data += 64;
+		blocks--;
+	}
+
+	_mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#undef NI_ROUNDS
+#undef NI_SCHEDULE
+
+#endif
+
+/* Pick the fastest implementation the CPU supports the first time we're
+ * called. */
+
+static void transform(uint32_t state[5], const uint8_t* data, size_t blocks)
+{
+	static const auto func = []() {
+#ifdef NYAN_X86
+		if (cpu_has_sha_ni())
+			return transform_sha_ni;
+#endif
+
+		return transform_generic;
+	}();
+
+	func(state, data, blocks);
+}
+
 sha1_hasher::sha1_hasher() {
 	/* SHA1 initialization constants */
 	state[0] = 0x67452301;
@@ -138,10 +247,10 @@ void sha1_hasher::update(const uint8_t* data, size_t len)
 
 	if ((j + len) > 63) {
 		memcpy(&buffer[j], data, (i = 64-j));
-		SHA1Transform(state, buffer);
-		for ( ; i + 63 < len; i += 64) {
-			SHA1Transform(state, &data[i]);
-		}
+		transform(state, buffer, 1);
+		size_t blocks = (len - i) / 64;
+		transform(state, &data[i], blocks);
+		i += blocks * 64;
 		j = 0;
 	} else
 		i = 0;
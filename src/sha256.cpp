@@ -1,4 +1,10 @@
 #include "sha256.h"
+#include "cpu.h"
+#include "simd.h"
+
+#ifdef NYAN_X86
+#include <immintrin.h>
+#endif
 
 // Public domain code from https://github.com/amosnier/sha-2
 
@@ -23,91 +29,328 @@ static inline uint32_t right_rot(uint32_t value, unsigned int count)
 	return value >> count | value << (32 - count);
 }
 
+/*
+ * Initialize array of round constants:
+ * (first 32 bits of the fractional parts of the cube roots of the first 64 primes 2..311):
+ */
+alignas(16) static const uint32_t k[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2};
+
+#define CH(e, f, g) (((e) & (f)) ^ (~(e) & (g)))
+#define MAJ(a, b, c) (((a) & (b)) ^ ((a) & (c)) ^ ((b) & (c)))
+#define EP0(a) (right_rot(a, 2) ^ right_rot(a, 13) ^ right_rot(a, 22))
+#define EP1(e) (right_rot(e, 6) ^ right_rot(e, 11) ^ right_rot(e, 25))
+#define SIG0(w) (right_rot(w, 7) ^ right_rot(w, 18) ^ ((w) >> 3))
+#define SIG1(w) (right_rot(w, 17) ^ right_rot(w, 19) ^ ((w) >> 10))
+
+/*
+ * One round, where kw is the round constant plus the message schedule word. Rather than moving the working
+ * variables along after each round, the callers rotate the arguments.
+ */
+#define ROUND(a, b, c, d, e, f, g, h, kw) do { \
+	const uint32_t temp1 = (h) + EP1(e) + CH(e, f, g) + (kw); \
+	const uint32_t temp2 = EP0(a) + MAJ(a, b, c); \
+	(d) += temp1; \
+	(h) = temp1 + temp2; \
+} while (0)
+
+#define ROUNDS8(KW, i) \
+	ROUND(a, b, c, d, e, f, g, h, KW(i)); \
+	ROUND(h, a, b, c, d, e, f, g, KW((i) + 1)); \
+	ROUND(g, h, a, b, c, d, e, f, KW((i) + 2)); \
+	ROUND(f, g, h, a, b, c, d, e, KW((i) + 3)); \
+	ROUND(e, f, g, h, a, b, c, d, KW((i) + 4)); \
+	ROUND(d, e, f, g, h, a, b, c, KW((i) + 5)); \
+	ROUND(c, d, e, f, g, h, a, b, KW((i) + 6)); \
+	ROUND(b, c, d, e, f, g, h, a, KW((i) + 7))
+
+#define ROUNDS64(KW) \
+	ROUNDS8(KW, 0); ROUNDS8(KW, 8); ROUNDS8(KW, 16); ROUNDS8(KW, 24); \
+	ROUNDS8(KW, 32); ROUNDS8(KW, 40); ROUNDS8(KW, 48); ROUNDS8(KW, 56)
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+/*
+ * The message schedule, worked out as we go: the first 16 words are the chunk itself, and every word after
+ * that replaces the one 16 before it in w. As the rounds are unrolled, all the indices are constants.
+ */
+#define KW_SCALAR(i) (k[i] + ((i) < 16 ? (w[(i) & 0xf] = load_be32(p + ((i) & 0xf) * 4)) : \
+	(w[(i) & 0xf] += SIG0(w[((i) + 1) & 0xf]) + w[((i) + 9) & 0xf] + SIG1(w[((i) + 14) & 0xf]))))
+
 /*
  * @brief Update a hash value under calculation with a new chunk of data.
- * @param h Pointer to the first hash item, of a total of eight.
+ * @param state Pointer to the first hash item, of a total of eight.
  * @param p Pointer to the chunk data, which has a standard length.
  *
  * @note This is the SHA-256 work horse.
  */
-static inline void consume_chunk(uint32_t *h, const uint8_t *p)
+static inline void consume_chunk(uint32_t *state, const uint8_t *p)
 {
-	unsigned i, j;
-	uint32_t ah[8];
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	uint32_t w[16];
 
-	/* Initialize working variables to current hash value: */
-	for (i = 0; i < 8; i++)
-		ah[i] = h[i];
+	ROUNDS64(KW_SCALAR);
 
-	/*
-	 * The w-array is really w[64], but since we only need 16 of them at a time, we save stack by
-	 * calculating 16 at a time.
-	 *
-	 * This optimization was not there initially and the rest of the comments about w[64] are kept in their
-	 * initial state.
-	 */
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
 
-	/*
-	 * create a 64-entry message schedule array w[0..63] of 32-bit words (The initial values in w[0..63]
-	 * don't matter, so many implementations zero them here) copy chunk into first 16 words w[0..15] of the
-	 * message schedule array
-	 */
-	uint32_t w[16];
+static void consume_chunks_generic(uint32_t *h, const uint8_t *p, size_t chunks)
+{
+	for (size_t i = 0; i < chunks; i++) {
+		consume_chunk(h, p);
+		p += SIZE_OF_SHA_256_CHUNK;
+	}
+}
 
-	/* Compression function main loop: */
-	for (i = 0; i < 4; i++) {
-		for (j = 0; j < 16; j++) {
-			if (i == 0) {
-				w[j] =
-				    (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
-				p += 4;
-			} else {
-				/* Extend the first 16 words into the remaining 48 words w[16..63] of the
-				 * message schedule array: */
-				const uint32_t s0 = right_rot(w[(j + 1) & 0xf], 7) ^ right_rot(w[(j + 1) & 0xf], 18) ^
-						    (w[(j + 1) & 0xf] >> 3);
-				const uint32_t s1 = right_rot(w[(j + 14) & 0xf], 17) ^
-						    right_rot(w[(j + 14) & 0xf], 19) ^ (w[(j + 14) & 0xf] >> 10);
-				w[j] = w[j] + s0 + w[(j + 9) & 0xf] + s1;
-			}
-			const uint32_t s1 = right_rot(ah[4], 6) ^ right_rot(ah[4], 11) ^ right_rot(ah[4], 25);
-			const uint32_t ch = (ah[4] & ah[5]) ^ (~ah[4] & ah[6]);
+#ifdef NYAN_X86
+
+#define KW_PRE(i) wk[((i) >> 2) * stride + ((i) & 3)]
+
+/*
+ * @brief Do the rounds for one chunk, with the message schedule plus round constants already worked out.
+ * @param wk Group j of four words is at wk[j * stride].
+ */
+template<unsigned int stride>
+SIMD_INLINE void consume_scheduled(uint32_t *state, const uint32_t *wk)
+{
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	ROUNDS64(KW_PRE);
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/*
+ * @brief Update a hash value with one or two chunks, working out the message schedule with SIMD.
+ *
+ * @note With V as u32x4 this is one chunk using SSSE3; with u32x8 it's two consecutive chunks using AVX2, one in
+ * each 128-bit half. The schedule is worked out four words at a time in between the rounds for the first chunk,
+ * so that the two can overlap, and the second chunk's rounds are then done from what was saved in wk.
+ */
+template<typename V>
+SIMD_INLINE void consume_simd(uint32_t *state, const uint8_t *p)
+{
+	static constexpr unsigned int lanes = num_lanes<V>;
+	alignas(sizeof(V)) uint32_t wk[16 * lanes];
+	const V zero = { };
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	V x[4];
+
+	for (unsigned int j = 0; j < 4; j++) {
+		if constexpr (lanes == 4)
+			memcpy(&x[j], p + (j * 16), sizeof(V));
+		else {
+			u32x4 lo, hi;
+
+			memcpy(&lo, p + (j * 16), sizeof(u32x4));
+			memcpy(&hi, p + SIZE_OF_SHA_256_CHUNK + (j * 16), sizeof(u32x4));
+
+			x[j] = __builtin_shufflevector(lo, hi, 0, 1, 2, 3, 4, 5, 6, 7);
+		}
+
+		x[j] = bswap(x[j]);
+	}
+
+#pragma GCC unroll 16
+	for (unsigned int j = 0; j < 16; j++) {
+		if (j >= 4) {
+			/* w[t-15] and w[t-7] straddle two registers */
+			const V w15 = shuffle4<1, 2, 3, 4>(x[0], x[1]);
+			const V w7 = shuffle4<1, 2, 3, 4>(x[2], x[3]);
+			V t = x[0] + (ror(w15, 7) ^ ror(w15, 18) ^ (w15 >> 3)) + w7;
+			V w2;
 
 			/*
-			 * Initialize array of round constants:
-			 * (first 32 bits of the fractional parts of the cube roots of the first 64 primes 2..311):
+			 * The last two words depend on the first two of the same group, so sigma1 is done in two
+			 * halves. Zero is its own sigma1, so the other half can be left as zero.
 			 */
-			static const uint32_t k[] = {
-			    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
-			    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
-			    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
-			    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
-			    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
-			    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
-			    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
-			    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-			    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
-			    0xc67178f2};
-
-			const uint32_t temp1 = ah[7] + s1 + ch + k[i << 4 | j] + w[j];
-			const uint32_t s0 = right_rot(ah[0], 2) ^ right_rot(ah[0], 13) ^ right_rot(ah[0], 22);
-			const uint32_t maj = (ah[0] & ah[1]) ^ (ah[0] & ah[2]) ^ (ah[1] & ah[2]);
-			const uint32_t temp2 = s0 + maj;
-
-			ah[7] = ah[6];
-			ah[6] = ah[5];
-			ah[5] = ah[4];
-			ah[4] = ah[3] + temp1;
-			ah[3] = ah[2];
-			ah[2] = ah[1];
-			ah[1] = ah[0];
-			ah[0] = temp1 + temp2;
+			w2 = shuffle4<2, 3, 4, 4>(x[3], zero);
+			t += ror(w2, 17) ^ ror(w2, 19) ^ (w2 >> 10);
+			w2 = shuffle4<4, 4, 0, 1>(t, zero);
+			t += ror(w2, 17) ^ ror(w2, 19) ^ (w2 >> 10);
+
+			x[0] = x[1];
+			x[1] = x[2];
+			x[2] = x[3];
+			x[3] = t;
 		}
+
+		u32x4 k4;
+
+		memcpy(&k4, &k[j * 4], sizeof(k4));
+
+		V v;
+
+		if constexpr (lanes == 4)
+			v = x[j < 4 ? j : 3] + k4;
+		else
+			v = x[j < 4 ? j : 3] + __builtin_shufflevector(k4, k4, 0, 1, 2, 3, 0, 1, 2, 3);
+
+		memcpy(&wk[j * lanes], &v, sizeof(V));
+
+		ROUND(a, b, c, d, e, f, g, h, wk[(j * lanes) + 0]);
+		ROUND(h, a, b, c, d, e, f, g, wk[(j * lanes) + 1]);
+		ROUND(g, h, a, b, c, d, e, f, wk[(j * lanes) + 2]);
+		ROUND(f, g, h, a, b, c, d, e, wk[(j * lanes) + 3]);
+
+		/* move the working variables along by four, to match the next group's ROUNDs */
+		uint32_t t0 = e, t1 = f, t2 = g, t3 = h;
+
+		e = a; f = b; g = c; h = d;
+		a = t0; b = t1; c = t2; d = t3;
 	}
 
-	/* Add the compressed chunk to the current hash value: */
-	for (i = 0; i < 8; i++)
-		h[i] += ah[i];
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+
+	if constexpr (lanes == 8)
+		consume_scheduled<8>(state, wk + 4);
+}
+
+__attribute__((target("ssse3")))
+static void consume_chunks_ssse3(uint32_t *h, const uint8_t *p, size_t chunks)
+{
+	while (chunks > 0) {
+		consume_simd<u32x4>(h, p);
+
+		p += SIZE_OF_SHA_256_CHUNK;
+		chunks--;
+	}
+}
+
+__attribute__((target("avx2")))
+static void consume_chunks_avx2(uint32_t *h, const uint8_t *p, size_t chunks)
+{
+	while (chunks >= 2) {
+		consume_simd<u32x8>(h, p);
+
+		p += 2 * SIZE_OF_SHA_256_CHUNK;
+		chunks -= 2;
+	}
+
+	if (chunks == 1)
+		consume_simd<u32x4>(h, p);
+}
+
+#undef KW_PRE
+
+#endif
+
+#ifdef NYAN_X86
+
+/*
+ * @brief Update a hash value using the SHA extensions.
+ *
+ * @note The state is kept as the register pairs ABEF and CDGH that SHA256RNDS2 expects. Each iteration of the
+ * inner loop does four rounds, working out the next four words of the message schedule with SHA256MSG1 /
+ * SHA256MSG2.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void consume_chunks_sha_ni(uint32_t *h, const uint8_t *p, size_t chunks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1); /* CDAB */
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b); /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8); /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0); /* CDGH */
+
+	while (chunks > 0) {
+		const __m128i abef_save = state0, cdgh_save = state1;
+		__m128i msg[4];
+
+		for (unsigned i = 0; i < 16; i++) {
+			__m128i w;
+
+			if (i < 4) {
+				msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + (i * 16))), mask);
+				w = msg[i];
+			} else {
+				w = _mm_sha256msg1_epu32(msg[0], msg[1]);
+				w = _mm_add_epi32(w, _mm_alignr_epi8(msg[3], msg[2], 4));
+				w = _mm_sha256msg2_epu32(w, msg[3]);
+
+				msg[0] = msg[1];
+				msg[1] = msg[2];
+				msg[2] = msg[3];
+				msg[3] = w;
+			}
+
+			w = _mm_add_epi32(w, _mm_load_si128((const __m128i *)&k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, w);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(w, 0x0e));
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+
+		p += SIZE_OF_SHA_256_CHUNK;
+		chunks--;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b); /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1); /* DCHG */
+	_mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xf0)); /* DCBA */
+	_mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8)); /* HGFE */
+}
+
+#endif
+
+/*
+ * @brief Update a hash value with a run of whole chunks, using the fastest implementation the CPU supports.
+ */
+static void consume_chunks(uint32_t *h, const uint8_t *p, size_t chunks)
+{
+	static const auto func = []() {
+#ifdef NYAN_X86
+		if (cpu_has_sha_ni())
+			return consume_chunks_sha_ni;
+		else if (cpu_has_avx2())
+			return consume_chunks_avx2;
+		else if (cpu_has_ssse3())
+			return consume_chunks_ssse3;
+#endif
+
+		return consume_chunks_generic;
+	}();
+
+	func(h, p, chunks);
 }
 
 /*
@@ -132,6 +375,24 @@ sha256_hasher::sha256_hasher() {
 	h[7] = 0x5be0cd19;
 }
 
+/*
+ * chunk_pos points into chunk, so it has to be moved across to the copy's own buffer.
+ */
+sha256_hasher::sha256_hasher(const sha256_hasher& other) {
+	*this = other;
+}
+
+sha256_hasher& sha256_hasher::operator=(const sha256_hasher& other) {
+	hash = other.hash;
+	memcpy(chunk, other.chunk, sizeof(chunk));
+	chunk_pos = chunk + (other.chunk_pos - other.chunk);
+	space_left = other.space_left;
+	total_len = other.total_len;
+	memcpy(h, other.h, sizeof(h));
+
+	return *this;
+}
+
 void sha256_hasher::update(const uint8_t* data, size_t len) {
 	total_len += len;
 
@@ -147,9 +408,11 @@ void sha256_hasher::update(const uint8_t* data, size_t len) {
 		 * necessary. We operate directly on the input data instead.
 		 */
 		if (space_left == SIZE_OF_SHA_256_CHUNK && len >= SIZE_OF_SHA_256_CHUNK) {
-			consume_chunk(h, p);
-			len -= SIZE_OF_SHA_256_CHUNK;
-			p += SIZE_OF_SHA_256_CHUNK;
+			const size_t chunks = len / SIZE_OF_SHA_256_CHUNK;
+
+			consume_chunks(h, p, chunks);
+			len -= chunks * SIZE_OF_SHA_256_CHUNK;
+			p += chunks * SIZE_OF_SHA_256_CHUNK;
 			continue;
 		}
 		/* General case, no particular optimization. */
@@ -159,7 +422,7 @@ void sha256_hasher::update(const uint8_t* data, size_t len) {
 		len -= consumed_len;
 		p += consumed_len;
 		if (space_left == 0) {
-			consume_chunk(h, chunk);
+			consume_chunks(h, chunk, 1);
 			chunk_pos = chunk;
 			space_left = SIZE_OF_SHA_256_CHUNK;
 		} else {
@@ -185,7 +448,7 @@ std::array<uint8_t, 32> sha256_hasher::finalize() {
 	 */
 	if (space_left < TOTAL_LEN_LEN) {
 		memset(pos, 0x00, space_left);
-		consume_chunk(h, chunk);
+		consume_chunks(h, chunk, 1);
 		pos = chunk;
 		space_left = SIZE_OF_SHA_256_CHUNK;
 	}
@@ -200,7 +463,7 @@ std::array<uint8_t, 32> sha256_hasher::finalize() {
 		pos[i] = (uint8_t)len;
 		len >>= 8;
 	}
-	consume_chunk(h, chunk);
+	consume_chunks(h, chunk, 1);
 	/* Produce the final hash value (big-endian): */
 	int j;
 
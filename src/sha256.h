@@ -21,6 +21,8 @@
 class sha256_hasher {
 public:
 	sha256_hasher();
+	sha256_hasher(const sha256_hasher& other);
+	sha256_hasher& operator=(const sha256_hasher& other);
 	void update(const uint8_t* data, size_t len);
 	std::array<uint8_t, 32> finalize();
 
@@ -0,0 +1,76 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+// Helpers for the vectorized hashing code. These use GCC vector extensions, so
+// that the same source can be compiled for SSE, AVX2, and AVX-512. Everything
+// here is always inlined into functions with the appropriate target
+// attribute, which is where the code actually gets generated.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utility>
+#include "cpu.h"
+
+#ifdef NYAN_X86
+
+#define SIMD_INLINE [[gnu::always_inline]] inline
+
+// GCC warns about returning vectors from functions compiled without AVX, even
+// though they never exist outside of their AVX callers.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+typedef uint32_t u32x16 __attribute__((vector_size(64)));
+
+template<typename V>
+static constexpr unsigned int num_lanes = sizeof(V) / sizeof(uint32_t);
+
+template<typename V>
+SIMD_INLINE V rol(const V& v, unsigned int bits) {
+    return (v << bits) | (v >> (32 - bits));
+}
+
+template<typename V>
+SIMD_INLINE V ror(const V& v, unsigned int bits) {
+    return (v >> bits) | (v << (32 - bits));
+}
+
+template<typename V>
+SIMD_INLINE V bswap(const V& v) {
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+template<typename V, int Q0, int Q1, int Q2, int Q3, size_t... P>
+SIMD_INLINE V shuffle4_impl(const V& a, const V& b, std::index_sequence<P...>) {
+    constexpr int q[] = { Q0, Q1, Q2, Q3 };
+
+    return __builtin_shufflevector(a, b, ((int)(P & ~3) + (q[P & 3] < 4 ? q[P & 3] : (int)num_lanes<V> + q[P & 3] - 4))...);
+}
+
+// Picks words from a and b independently within each group of four, in the
+// manner of the 128-bit shuffles: 0 to 3 are the words of a, 4 to 7 those of b.
+template<int Q0, int Q1, int Q2, int Q3, typename V>
+SIMD_INLINE V shuffle4(const V& a, const V& b) {
+    return shuffle4_impl<V, Q0, Q1, Q2, Q3>(a, b, std::make_index_sequence<num_lanes<V>>{});
+}
+
+#endif
@@ -23,6 +23,7 @@
 #include <format>
 #include <string.h>
 #include "config.h"
+#include "depfile.h"
 
 using namespace std;
 
@@ -289,6 +290,9 @@ Stamp an INF file to update its directives.
                       form mm/dd/yyyy)
       -v version    version to set in DriverVer (must be * for current time, or
                       in form w.x.y.z)
+      -MD FILE      write a dependency file for Make or Ninja to FILE (needs
+                      -MT, as the INF is both input and output)
+      -MT TARGET    name TARGET in the dependency file, e.g. a stamp file
 )", argv[0]);
 
         return 1;
@@ -304,6 +308,8 @@ Stamp an INF file to update its directives.
     string section;
     optional<chrono::year_month_day> date;
     optional<version> ver;
+    optional<filesystem::path> depfile_fn;
+    optional<string> dep_target;
 
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-f")) {
@@ -384,6 +390,22 @@ Stamp an INF file to update its directives.
                 }
             }
 
+            i++;
+        } else if (!strcmp(argv[i], "-MD")) {
+            if (i == argc - 1) {
+                cerr << format("{}: no filename provided to -MD option\n", argv[0]);
+                return 1;
+            }
+
+            depfile_fn = argv[i + 1];
+            i++;
+        } else if (!strcmp(argv[i], "-MT")) {
+            if (i == argc - 1) {
+                cerr << format("{}: no target provided to -MT option\n", argv[0]);
+                return 1;
+            }
+
+            dep_target = argv[i + 1];
             i++;
         } else {
             cerr << format("{}: unrecognized option '{}'\n", argv[0], argv[i]);
@@ -401,6 +423,11 @@ Stamp an INF file to update its directives.
         return 1;
     }
 
+    if (depfile_fn.has_value() && !dep_target.has_value()) {
+        cerr << format("{}: -MT must be given for -MD, as the INF file can't depend on itself\n", argv[0]);
+        return 1;
+    }
+
     if ((!date.has_value() && ver.has_value()) || (date.has_value() && !ver.has_value())) {
         cerr << format("{}: both version and date must be specified to stamp DriverVer\n", argv[0]);
         return 1;
@@ -417,6 +444,17 @@ Stamp an INF file to update its directives.
 
     try {
         stampinf(filename.value(), section, date, ver);
+
+        // The INF is all we read, so it's the only dependency. As it's also
+        // what we write, the target has to be something else, which is why
+        // -MT is needed.
+
+        if (depfile_fn.has_value()) {
+            depfile deps;
+
+            deps.add(dep_target.value(), span(&filename.value(), 1));
+            deps.write(depfile_fn.value());
+        }
     } catch (const exception& e) {
         cerr << "Exception: " << e.what() << endl;
         return 1;
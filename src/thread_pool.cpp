@@ -0,0 +1,189 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <algorithm>
+#include "thread_pool.h"
+
+using namespace std;
+
+thread_pool::thread_pool(unsigned int num_threads) {
+    for (unsigned int i = 1; i < num_threads; i++) {
+        threads.emplace_back([this]() {
+            worker();
+        });
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        lock_guard lock(mutex);
+        stopping = true;
+    }
+
+    cv.notify_all();
+
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void thread_pool::worker() {
+    while (true) {
+        function<void()> job;
+
+        {
+            unique_lock lock(mutex);
+
+            cv.wait(lock, [&]() { return stopping || !queue.empty(); });
+
+            if (queue.empty())
+                return;
+
+            job = move(queue.front());
+            queue.pop_front();
+        }
+
+        job();
+    }
+}
+
+struct thread_pool::parallel_for_state {
+    parallel_for_state(size_t n, const function<void(size_t)>& func) : n(n), func(func) {
+    }
+
+    size_t n;
+    const function<void(size_t)>& func;
+    atomic<size_t> next = 0;
+    std::mutex m;
+    condition_variable cv;
+    unsigned int active = 0;
+    bool closed = false;
+    exception_ptr err;
+};
+
+bool thread_pool::others_waiting() {
+    lock_guard lock(mutex);
+
+    return !queue.empty();
+}
+
+// Runs indices until there are none left, and returns true. If yield is set,
+// it stops and returns false after any index where something else is waiting
+// for a thread.
+bool thread_pool::run_indices(parallel_for_state& st, bool yield) {
+    size_t i;
+
+    while ((i = st.next.fetch_add(1)) < st.n) {
+        try {
+            st.func(i);
+        } catch (...) {
+            lock_guard lock(st.m);
+
+            if (!st.err)
+                st.err = current_exception();
+
+            st.next = st.n;
+        }
+
+        if (yield && others_waiting())
+            return false;
+    }
+
+    return true;
+}
+
+// A job which helps out with a parallel_for. When other jobs are queued, it
+// gives up its thread after each index and goes to the back of the queue, so
+// that when several threads are calling parallel_for at once they take it in
+// turns.
+void thread_pool::helper(const shared_ptr<parallel_for_state>& st) {
+    {
+        lock_guard lock(st->m);
+
+        // If everything's already been done, func may no longer exist.
+        if (st->closed)
+            return;
+
+        st->active++;
+    }
+
+    auto finished = run_indices(*st, true);
+
+    if (!finished) {
+        {
+            lock_guard lock(mutex);
+
+            queue.emplace_back([this, st]() {
+                helper(st);
+            });
+        }
+
+        cv.notify_one();
+    }
+
+    lock_guard lock(st->m);
+
+    st->active--;
+
+    if (st->active == 0)
+        st->cv.notify_all();
+}
+
+void thread_pool::parallel_for(size_t n, const function<void(size_t)>& func) {
+    if (n == 0)
+        return;
+
+    // The state is shared with the helper jobs, as they may not get to run
+    // until after we've returned.
+    auto st = make_shared<parallel_for_state>(n, func);
+
+    auto helpers = (unsigned int)min((size_t)threads.size(), n - 1);
+
+    if (helpers > 0) {
+        {
+            lock_guard lock(mutex);
+
+            for (unsigned int i = 0; i < helpers; i++) {
+                queue.emplace_back([this, st]() {
+                    helper(st);
+                });
+            }
+        }
+
+        cv.notify_all();
+    }
+
+    run_indices(*st, false);
+
+    // Every index has now been claimed, so any helper which hasn't started by
+    // now has nothing to do. Wait for the ones which have.
+
+    unique_lock lock(st->m);
+
+    st->closed = true;
+    st->cv.wait(lock, [&]() { return st->active == 0; });
+
+    auto err = move(st->err);
+
+    lock.unlock();
+
+    if (err)
+        rethrow_exception(err);
+}
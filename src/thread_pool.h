@@ -0,0 +1,60 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+
+// A fixed set of worker threads. num_threads includes the thread calling
+// parallel_for, which does its share of the work rather than just waiting, so
+// parallel_for can safely be called from within a job.
+class thread_pool {
+public:
+    explicit thread_pool(unsigned int num_threads);
+    ~thread_pool();
+
+    // Calls func(i) for each i from 0 to n - 1, and returns once they have all
+    // finished. The indices are handed out in order. If any call throws, the
+    // remaining indices are skipped and the first exception is rethrown.
+    // Several threads can call this at once, and the workers are shared
+    // between them.
+    void parallel_for(size_t n, const std::function<void(size_t)>& func);
+
+    unsigned int size() const {
+        return (unsigned int)threads.size() + 1;
+    }
+
+private:
+    struct parallel_for_state;
+
+    void worker();
+    bool others_waiting();
+    bool run_indices(parallel_for_state& st, bool yield);
+    void helper(const std::shared_ptr<parallel_for_state>& st);
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> queue;
+    bool stopping = false;
+};
@@ -0,0 +1,203 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include "walker.h"
+#include "pe.h"
+
+using namespace std;
+
+static const size_t GETDENTS_BUFFER_SIZE = 65536;
+
+static bool dos_signature_at(int dirfd, const char* name, const filesystem::path& fn) {
+    uint16_t sig;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        throw runtime_error("open of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+
+    auto ret = pread(fd, &sig, sizeof(sig), 0);
+    auto err = errno;
+
+    close(fd);
+
+    if (ret == -1)
+        throw runtime_error("read of " + fn.string() + " failed (errno " + to_string(err) + ")");
+
+    return ret == sizeof(sig) && sig == IMAGE_DOS_SIGNATURE;
+}
+
+bool has_dos_signature(const filesystem::path& fn) {
+    return dos_signature_at(AT_FDCWD, fn.c_str(), fn);
+}
+
+// Reads the directory with getdents64, rather than readdir, so that we can
+// use a bigger buffer. The entry types mean we only need to stat symlinks, or
+// everything on filesystems which don't fill them in.
+vector<dir_entry> read_dir_entries(int fd, const filesystem::path& dir) {
+    vector<dir_entry> entries;
+    vector<uint8_t> buf(GETDENTS_BUFFER_SIZE);
+
+    while (true) {
+        auto ret = getdents64(fd, buf.data(), buf.size());
+
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            throw runtime_error("getdents of " + dir.string() + " failed (errno " + to_string(errno) + ")");
+        }
+
+        if (ret == 0)
+            break;
+
+        for (size_t off = 0; off < (size_t)ret; ) {
+            auto& de = *(const struct dirent64*)(buf.data() + off);
+            const char* name = de.d_name;
+            auto type = de.d_type;
+
+            off += de.d_reclen;
+
+            if (!strcmp(name, ".") || !strcmp(name, ".."))
+                continue;
+
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+
+                if (S_ISREG(st.st_mode))
+                    type = DT_REG;
+                else if (S_ISDIR(st.st_mode))
+                    type = DT_DIR;
+                else if (S_ISLNK(st.st_mode))
+                    type = DT_LNK;
+            }
+
+            // symlinks to files are included, but not symlinks to directories
+
+            if (type == DT_LNK) {
+                struct stat st;
+
+                if (fstatat(fd, name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+                    continue;
+
+                type = DT_REG;
+            }
+
+            if (type == DT_REG || type == DT_DIR)
+                entries.push_back({ name, type == DT_DIR });
+        }
+    }
+
+    ranges::sort(entries, [](const dir_entry& a, const dir_entry& b) {
+        return a.name < b.name;
+    });
+
+    return entries;
+}
+
+static void walk(int fd, const filesystem::path& dir, bool pe_only, thread_pool& pool, walk_result& res) {
+    vector<dir_entry> entries;
+
+    try {
+        entries = read_dir_entries(fd, dir);
+    } catch (const exception& e) {
+        res.errors.emplace_back(e.what());
+        return;
+    }
+
+    // Subdirectories, and files if we need to check their signatures, are
+    // handed to the pool. Everything is put back in order afterwards.
+
+    vector<size_t> jobs;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].is_dir || pe_only)
+            jobs.push_back(i);
+    }
+
+    vector<walk_result> sub(jobs.size());
+
+    pool.parallel_for(jobs.size(), [&](size_t j) {
+        const auto& e = entries[jobs[j]];
+        auto& r = sub[j];
+        auto fn = dir / e.name;
+
+        if (!e.is_dir) {
+            try {
+                if (dos_signature_at(fd, e.name.c_str(), fn))
+                    r.files.push_back(move(fn));
+            } catch (const exception& ex) {
+                r.errors.emplace_back(ex.what());
+            }
+
+            return;
+        }
+
+        int subfd = openat(fd, e.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+        if (subfd == -1) {
+            r.errors.emplace_back("open of " + fn.string() + " failed (errno " + to_string(errno) + ")");
+            return;
+        }
+
+        walk(subfd, fn, pe_only, pool, r);
+
+        close(subfd);
+    });
+
+    size_t j = 0;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (j < jobs.size() && jobs[j] == i) {
+            auto& r = sub[j];
+
+            res.files.insert(res.files.end(), make_move_iterator(r.files.begin()),
+                             make_move_iterator(r.files.end()));
+            res.errors.insert(res.errors.end(), make_move_iterator(r.errors.begin()),
+                              make_move_iterator(r.errors.end()));
+            j++;
+        } else
+            res.files.push_back(dir / entries[i].name);
+    }
+}
+
+walk_result walk_directory(const filesystem::path& dir, bool pe_only, thread_pool& pool) {
+    walk_result res;
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1) {
+        res.errors.emplace_back("open of " + dir.string() + " failed (errno " + to_string(errno) + ")");
+        return res;
+    }
+
+    walk(fd, dir, pe_only, pool, res);
+
+    close(fd);
+
+    return res;
+}
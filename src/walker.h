@@ -0,0 +1,48 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "thread_pool.h"
+
+struct dir_entry {
+    std::string name;
+    bool is_dir;
+};
+
+// Reads the entries of the directory fd, in order of name, leaving out . and
+// .. and anything that isn't a regular file or directory. Symlinks to files
+// count as files, and symlinks to directories are left out. dir is only used
+// for error messages.
+std::vector<dir_entry> read_dir_entries(int fd, const std::filesystem::path& dir);
+
+struct walk_result {
+    std::vector<std::filesystem::path> files;
+    std::vector<std::string> errors;
+};
+
+// Lists the regular files beneath dir, in order of name. Subdirectories are
+// read in parallel on the pool, but symlinks to directories aren't followed.
+// If pe_only is set, files which don't begin with the MZ signature are left
+// out. Directories which can't be read are reported in errors, and skipped.
+walk_result walk_directory(const std::filesystem::path& dir, bool pe_only, thread_pool& pool);
+
+// Whether fn begins with the MZ signature. Throws if it can't be read.
+bool has_dos_signature(const std::filesystem::path& fn);
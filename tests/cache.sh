@@ -0,0 +1,75 @@
+#!/bin/sh
+# Copyright (c) Mark Harmstone 2024
+#
+# This file is part of Nyan, and is licensed under the GNU General Public
+# Licence, version 2 or later. See LICENCE for details.
+#
+# Checks that --cache FILE creates the cache file, and that a second run
+# reuses it rather than hashing everything again.
+#
+# Usage: cache.sh MAKECAT AUTHENTICODE WORKDIR
+
+set -e
+
+makecat=$1
+authenticode=$2
+dir=$3
+
+rm -rf "$dir"
+mkdir -p "$dir"
+cd "$dir"
+
+# Writes the bytes given as octal escapes at offset in file.
+patch() {
+    printf "$3" | dd of="$1" bs=1 seek=$(($2)) conv=notrunc 2>/dev/null
+}
+
+# a PE header with no sections, which is enough to be hashed
+head -c 512 /dev/zero > test.exe
+patch test.exe 0x0 'MZ'
+patch test.exe 0x3c '\100'
+patch test.exe 0x40 'PE\000\000\114\001'
+patch test.exe 0x54 '\340\000\002\001'
+patch test.exe 0x58 '\013\001'
+patch test.exe 0x78 '\000\020\000\000\000\002\000\000'
+patch test.exe 0x90 '\000\020\000\000\000\002\000\000'
+patch test.exe 0xb4 '\020'
+
+echo "not a PE file" > test.txt
+
+cat > test.cdf <<CDF
+[CatalogHeader]
+Name=test.cat
+CatalogVersion=2
+HashAlgorithms=SHA256
+
+[CatalogFiles]
+<HASH>exe=test.exe
+<HASH>txt=test.txt
+CDF
+
+# Files changed within the last second aren't cached, as they could change
+# again without their timestamps showing it.
+sleep 2
+
+for i in 1 2; do
+    "$makecat" --no-daemon --cache makecat.db test.cdf
+    "$authenticode" --sha256 --no-daemon --cache authenticode.db test.exe > /dev/null
+
+    for db in makecat.db authenticode.db; do
+        if [ ! -s $db ]; then
+            echo "$db was not created." >&2
+            exit 1
+        fi
+    done
+
+    # the second run should find everything, and so add nothing
+    size=$(wc -c < makecat.db)$(wc -c < authenticode.db)
+
+    if [ $i = 2 ] && [ "$size" != "$first" ]; then
+        echo "Cache grew on the second run, so wasn't reused." >&2
+        exit 1
+    fi
+
+    first=$size
+done
@@ -0,0 +1,173 @@
+/* Copyright (c) Mark Harmstone 2024
+ *
+ * This file is part of Nyan.
+ *
+ * Nyan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public Licence as published by
+ * the Free Software Foundation, either version 2 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Nyan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU General Public Licence
+ * along with Nyan. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include <iostream>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+#include "pe_image.h"
+#include "authenticode.h"
+#include "sha256.h"
+
+using namespace std;
+
+static const uint32_t NT_OFFSET = 0x40;
+static const uint32_t HEADERS_SIZE = 0x200;
+static const uint32_t SECTION_SIZE = 0x200;
+
+struct test_image {
+    vector<uint8_t> data;
+
+    test_image() : data(HEADERS_SIZE + SECTION_SIZE) {
+        auto& dos_header = dos();
+
+        dos_header.e_magic = IMAGE_DOS_SIGNATURE;
+        dos_header.e_lfanew = NT_OFFSET;
+
+        auto& n = nt();
+
+        n.Signature = IMAGE_NT_SIGNATURE;
+        n.FileHeader.Machine = 0x14c; // i386
+        n.FileHeader.NumberOfSections = 1;
+        n.FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER32);
+
+        auto& opt = n.OptionalHeader32;
+
+        opt.Magic = IMAGE_NT_OPTIONAL_HDR32_MAGIC;
+        opt.SectionAlignment = 0x1000;
+        opt.FileAlignment = 0x200;
+        opt.SizeOfImage = 0x2000;
+        opt.SizeOfHeaders = HEADERS_SIZE;
+        opt.NumberOfRvaAndSizes = 16;
+
+        auto& sect = section();
+
+        memcpy(sect.Name, ".text", 5);
+        sect.VirtualSize = SECTION_SIZE;
+        sect.VirtualAddress = 0x1000;
+        sect.SizeOfRawData = SECTION_SIZE;
+        sect.PointerToRawData = HEADERS_SIZE;
+
+        for (uint32_t i = 0; i < SECTION_SIZE; i++) {
+            data[HEADERS_SIZE + i] = (uint8_t)i;
+        }
+    }
+
+    IMAGE_DOS_HEADER& dos() {
+        return *(IMAGE_DOS_HEADER*)data.data();
+    }
+
+    IMAGE_NT_HEADERS& nt() {
+        return *(IMAGE_NT_HEADERS*)(data.data() + NT_OFFSET);
+    }
+
+    IMAGE_SECTION_HEADER& section() {
+        auto off = (size_t)((const uint8_t*)nt().OptionalHeader32.DataDirectory - data.data()) +
+                   (16 * sizeof(IMAGE_DATA_DIRECTORY));
+
+        return *(IMAGE_SECTION_HEADER*)(data.data() + off);
+    }
+};
+
+static unsigned int failures = 0;
+
+// Checks that the image can be hashed, and that the page hashes end at end.
+static void expect_valid(const char* name, uint32_t end, const function<void(test_image&)>& change) {
+    test_image img;
+
+    change(img);
+
+    try {
+        pe_image image(img.data);
+
+        auto hashes = authenticode_with_page_hashes<sha256_hasher>(image);
+
+        if (hashes.page_hashes.back().first != end) {
+            cerr << name << ": page hashes end at " << hashes.page_hashes.back().first << ", expected " << end << endl;
+            failures++;
+        }
+    } catch (const exception& e) {
+        cerr << name << ": unexpected exception: " << e.what() << endl;
+        failures++;
+    }
+}
+
+// Checks that the constructor throws, for the whole image and, if in_headers is
+// set, for just its headers. If it doesn't, we try the page hashes, which is
+// where a bad image would hang.
+static void expect_invalid(const char* name, bool in_headers, const function<void(test_image&)>& change) {
+    test_image img;
+
+    change(img);
+
+    for (auto headers_only : { false, true }) {
+        if (headers_only && !in_headers)
+            break;
+
+        try {
+            pe_image image(img.data, headers_only);
+
+            if (!headers_only)
+                authenticode_with_page_hashes<sha256_hasher>(image);
+
+            cerr << name << (headers_only ? " (headers only)" : "") << ": no exception thrown" << endl;
+            failures++;
+        } catch (const runtime_error&) {
+        }
+    }
+}
+
+int main() {
+    expect_valid("valid image", HEADERS_SIZE + SECTION_SIZE, [](test_image&) { });
+
+    expect_valid("no sections", HEADERS_SIZE, [](test_image& img) {
+        img.nt().FileHeader.NumberOfSections = 0;
+    });
+
+    expect_invalid("zero SectionAlignment", true, [](test_image& img) {
+        img.nt().OptionalHeader32.SectionAlignment = 0;
+    });
+
+    expect_invalid("SectionAlignment not a power of two", true, [](test_image& img) {
+        img.nt().OptionalHeader32.SectionAlignment = 0x1001;
+    });
+
+    expect_invalid("zero FileAlignment", true, [](test_image& img) {
+        img.nt().OptionalHeader32.FileAlignment = 0;
+    });
+
+    expect_invalid("section table past end", true, [](test_image& img) {
+        img.nt().FileHeader.NumberOfSections = 0xffff;
+    });
+
+    // the sections themselves aren't checked when we only have the headers
+    expect_invalid("section past end", false, [](test_image& img) {
+        img.section().PointerToRawData = 0x300;
+    });
+
+    expect_invalid("SizeOfHeaders past end", true, [](test_image& img) {
+        img.nt().OptionalHeader32.SizeOfHeaders = 0x10000;
+    });
+
+    if (failures != 0) {
+        cerr << failures << " test(s) failed." << endl;
+        return 1;
+    }
+
+    return 0;
+}